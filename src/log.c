@@ -25,16 +25,89 @@
  * IN THE SOFTWARE.
  */
 
+// Before any system header: POSIX 2008 for clock_gettime(), fileno() and the
+// like under -std=c99, plus the usual extras (MAP_ANONYMOUS) where there are
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE 1
+#endif
+
 #include "log.h"
 
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <ctype.h>
 
-// Has the log10() function
-#include <math.h>
+#if defined(__unix__) || defined(__APPLE__)
+// fstat() and fileno() for detecting aliased sinks
+#include <sys/stat.h>
+#include <unistd.h>
+#define LOG_HAVE_POSIX 1
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+// Per-thread state, like who has the batch open, and atomics for the
+// counters updated outside the lock
+#define LOG_THREAD_LOCAL __thread
+#define LOG_HAVE_ATOMICS 1
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && \
+      !defined(__STDC_NO_THREADS__)
+#define LOG_THREAD_LOCAL _Thread_local
+#endif
+
+#if defined(LOG_HAVE_POSIX) && (defined(__x86_64__) || defined(__i386__))
+// The time stamp counter, for log_clock_tsc()
+#define LOG_HAVE_TSC 1
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef LOG_USE_OTLP
+// Sockets and spool files for the OTLP/HTTP exporter
+#include <dirent.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef LOG_USE_SHM
+// Shared memory and futexes for the shared memory ring
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(LOG_USE_VMSPLICE) && defined(__linux__)
+// Page-aligned buffers handed to a stderr pipe with vmsplice()
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define LOG_HAVE_VMSPLICE 1
+#endif
+
+#ifdef LOG_USE_RT
+// The drain thread, and argument types, for real-time mode
+#include <pthread.h>
+#include <stddef.h>
+#endif
+
+#ifdef LOG_USE_ZLIB
+// gzip for the OTLP/HTTP exporter
+#include <zlib.h>
+#endif
 
 
 // Definitions
@@ -51,6 +124,356 @@
  */
 #define BAD_LEVEL 666
 
+/**
+ * @brief Size of the stack buffer log_log() formats messages into. Messages
+ *        that don't fit are formatted again into a heap buffer.
+ */
+#ifndef LOG_MSG_BUF_SIZE
+#define LOG_MSG_BUF_SIZE 1024
+#endif
+
+/**
+ * @brief Batch buffers bigger than this (in bytes) are freed at
+ *        log_batch_commit() rather than kept for the next batch.
+ */
+#ifndef LOG_BATCH_KEEP_SIZE
+#define LOG_BATCH_KEEP_SIZE (64 * 1024)
+#endif
+
+/**
+ * @brief How many named loggers can be registered (see log_get_logger()),
+ *        and how long their names can be.
+ */
+#ifndef LOG_MAX_LOGGERS
+#define LOG_MAX_LOGGERS 64
+#endif
+
+#ifndef LOG_LOGGER_NAME_SIZE
+#define LOG_LOGGER_NAME_SIZE 64
+#endif
+
+/**
+ * @brief Loads, stores and read-modify-writes for state touched outside the
+ *        lock - memory use, boosts, the logger count. `ORDER` is `RELAXED`,
+ *        `ACQUIRE`, `RELEASE` or `ACQ_REL`.
+ * 
+ * Without the GCC builtins these are plain accesses, which are only exact
+ * while one thread at a time is logging.
+ */
+#ifdef LOG_HAVE_ATOMICS
+#define ATOMIC_LOAD(p, ORDER) __atomic_load_n(p, __ATOMIC_##ORDER)
+#define ATOMIC_STORE(p, v, ORDER) __atomic_store_n(p, v, __ATOMIC_##ORDER)
+#define ATOMIC_ADD(p, v, ORDER) \
+  ((void)__atomic_add_fetch(p, v, __ATOMIC_##ORDER))
+#define ATOMIC_SUB(p, v, ORDER) \
+  ((void)__atomic_sub_fetch(p, v, __ATOMIC_##ORDER))
+#define ATOMIC_CAS(p, expected, desired, ORDER) \
+  __atomic_compare_exchange_n( \
+    p, expected, desired, true, __ATOMIC_##ORDER, __ATOMIC_RELAXED)
+#else
+#define ATOMIC_LOAD(p, ORDER) (*(p))
+#define ATOMIC_STORE(p, v, ORDER) ((void)(*(p) = (v)))
+#define ATOMIC_ADD(p, v, ORDER) ((void)(*(p) += (v)))
+#define ATOMIC_SUB(p, v, ORDER) ((void)(*(p) -= (v)))
+#define ATOMIC_CAS(p, expected, desired, ORDER) \
+  (*(p) == *(expected) ? (*(p) = (desired), true) : \
+                         (*(expected) = *(p), false))
+#endif
+
+/**
+ * @brief Bytes in front of each logger allocation recording its size, so
+ *        mem_free() can credit it back to the budget, and the free function
+ *        (and its udata) it came with, so it's freed right even if the
+ *        allocator has changed since. 32 keeps what follows aligned for
+ *        anything.
+ */
+#define MEM_HEADER_SIZE 32
+
+/**
+ * @brief What's kept in the MEM_HEADER_SIZE bytes.
+ */
+typedef struct {
+  size_t size;
+  log_FreeFn free;            ///< `NULL` for free().
+  void *udata;
+} MemHeader;
+
+/**
+ * @brief Most bytes of stderr output held back when it's buffered (see
+ *        log_set_stderr_flush()).
+ */
+#ifndef LOG_STDERR_BUF_SIZE
+#define LOG_STDERR_BUF_SIZE (64 * 1024)
+#endif
+
+/**
+ * @brief Longest buffered stderr output is held back (in milliseconds) once
+ *        another record comes along.
+ */
+#ifndef LOG_STDERR_MAX_AGE_MS
+#define LOG_STDERR_MAX_AGE_MS 1000
+#endif
+
+/**
+ * @brief Most elements log_array() prints; longer arrays are cut short and
+ *        summarized.
+ */
+#ifndef LOG_ARRAY_MAX_ELEMS
+#define LOG_ARRAY_MAX_ELEMS 32
+#endif
+
+/**
+ * @brief Size in bits (a power of two) of the Bloom filter built for an
+ *        indexed file segment (see log_set_fp_indexed()). The default takes
+ *        1 MiB, and gives about 2% false positives at a million distinct
+ *        tokens.
+ */
+#ifndef LOG_BLOOM_BITS
+#define LOG_BLOOM_BITS (1 << 23)
+#endif
+
+/**
+ * @brief Bits set per token.
+ */
+#define BLOOM_HASHES 6
+
+/**
+ * @brief How many keys log_set_fp_indexed() takes, and how long they can be.
+ */
+#define BLOOM_MAX_KEYS 8
+#define BLOOM_KEY_SIZE 32
+
+/**
+ * @brief Filter files start with this magic, then, little-endian, the number
+ *        of hashes (4 bytes) and of bits (8 bytes), how many bytes of the
+ *        segment were indexed when it was saved (8) and the number of keys
+ *        (4), then BLOOM_MAX_KEYS keys of BLOOM_KEY_SIZE bytes (`NUL`-padded),
+ *        then the bits (bit `i` is bit `i % 8` of byte `i / 8`).
+ */
+#define BLOOM_MAGIC "LOGBLOM2"
+#define BLOOM_HEADER_SIZE (32 + BLOOM_MAX_KEYS * BLOOM_KEY_SIZE)
+
+#ifdef LOG_USE_OTLP
+// ---------------------------------------------------------------------------
+
+/**
+ * @brief Send the OTLP batch once it holds this many bytes of encoded
+ *        records...
+ */
+#ifndef LOG_OTLP_BATCH_SIZE
+#define LOG_OTLP_BATCH_SIZE (64 * 1024)
+#endif
+
+/**
+ * @brief ...or once its oldest record is this many milliseconds old (checked
+ *        as records arrive, and by log_otlp_flush()).
+ */
+#ifndef LOG_OTLP_BATCH_INTERVAL_MS
+#define LOG_OTLP_BATCH_INTERVAL_MS 1000
+#endif
+
+/**
+ * @brief Most bytes of encoded records held while the collector is
+ *        unreachable. Past this the oldest records are dropped (and counted,
+ *        see log_otlp_dropped()).
+ */
+#ifndef LOG_OTLP_MAX_PENDING
+#define LOG_OTLP_MAX_PENDING (1024 * 1024)
+#endif
+
+/**
+ * @brief Seconds to wait on the collector when connecting, sending or
+ *        reading the response. Sends happen with the lock held, so keep it
+ *        short.
+ */
+#ifndef LOG_OTLP_TIMEOUT_SEC
+#define LOG_OTLP_TIMEOUT_SEC 1
+#endif
+
+/**
+ * @brief Spool segment files roll over once they reach this many bytes (see
+ *        log_otlp_set_spool()).
+ */
+#ifndef LOG_OTLP_SPOOL_SEGMENT_SIZE
+#define LOG_OTLP_SPOOL_SEGMENT_SIZE (1024 * 1024)
+#endif
+
+/**
+ * @brief Most spooled batches replayed per send, to throttle catching up
+ *        after an outage.
+ */
+#ifndef LOG_OTLP_SPOOL_REPLAY_FRAMES
+#define LOG_OTLP_SPOOL_REPLAY_FRAMES 8
+#endif
+
+/**
+ * @brief Backoff between failed sends starts here and doubles up to
+ *        OTLP_MAX_BACKOFF_MS.
+ */
+#define OTLP_MIN_BACKOFF_MS 500
+#define OTLP_MAX_BACKOFF_MS (30 * 1000)
+
+#endif // #ifdef LOG_USE_OTLP ***********************************************
+
+#ifdef LOG_USE_MSGPACK
+// ---------------------------------------------------------------------------
+
+/**
+ * @brief Largest MessagePack frame log_msgpack_read() will accept, so a
+ *        corrupt length prefix can't make it allocate the world.
+ */
+#ifndef LOG_MSGPACK_MAX_FRAME
+#define LOG_MSGPACK_MAX_FRAME (16 * 1024 * 1024)
+#endif
+
+/**
+ * @brief Slots in the table of interned file names (a power of 2). Once it's
+ *        3/4 full, further file names are written inline in every record.
+ */
+#ifndef LOG_MSGPACK_INTERN_SLOTS
+#define LOG_MSGPACK_INTERN_SLOTS 256
+#endif
+
+/**
+ * @brief Highest intern ID log_msgpack_read() will accept in a definition.
+ */
+#define MSGPACK_MAX_INTERN_ID 0xffff
+
+/**
+ * @brief MessagePack extension type for timestamps.
+ */
+#define MSGPACK_EXT_TIMESTAMP -1
+
+#endif // #ifdef LOG_USE_MSGPACK ********************************************
+
+#ifdef LOG_USE_RT
+// ---------------------------------------------------------------------------
+
+/**
+ * @brief How many threads can log in real-time mode (each gets a ring of its
+ *        own, for the life of the process).
+ */
+#ifndef LOG_RT_THREADS
+#define LOG_RT_THREADS 8
+#endif
+
+/**
+ * @brief Records each thread's ring holds (a power of 2).
+ */
+#ifndef LOG_RT_SLOTS
+#define LOG_RT_SLOTS 256
+#endif
+
+/**
+ * @brief Most printf arguments (counting `*` widths and precisions) captured
+ *        per record. Conversions past that are written out unformatted.
+ */
+#ifndef LOG_RT_MAX_ARGS
+#define LOG_RT_MAX_ARGS 12
+#endif
+
+/**
+ * @brief Bytes per record for copies of `%s` arguments, which are truncated
+ *        to fit.
+ */
+#ifndef LOG_RT_STR_SIZE
+#define LOG_RT_STR_SIZE 96
+#endif
+
+/**
+ * @brief How long the drain thread sleeps when the rings are empty.
+ */
+#ifndef LOG_RT_DRAIN_INTERVAL_US
+#define LOG_RT_DRAIN_INTERVAL_US 1000
+#endif
+
+#endif // #ifdef LOG_USE_RT *************************************************
+
+
+// Types
+// ===========================================================================
+
+/**
+ * @brief A growable byte buffer, which can start out in caller-provided
+ *        (usually stack) storage. See buffer_init().
+ */
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+  bool on_heap;   ///< Whether `data` was allocated (and should be freed).
+} Buffer;
+
+/**
+ * @brief What a filter file's header says (see BLOOM_MAGIC).
+ */
+typedef struct {
+  uint32_t num_hashes;
+  uint64_t num_bits;
+  uint64_t covered;     ///< Bytes of the segment indexed.
+  int num_keys;
+  char keys[BLOOM_MAX_KEYS][BLOOM_KEY_SIZE];
+} BloomHeader;
+
+/**
+ * @brief Called on each token bloom_each_token() finds.
+ * 
+ * @return bool `false` to stop there.
+ */
+typedef bool (*BloomTokenFn)(const char *token, size_t len, void *udata);
+
+/**
+ * @brief A record time, rendered for the text outputs.
+ */
+typedef struct {
+  char time[16];        ///< "HH:MM:SS" for stderr.
+  char date_time[32];   ///< "YYYY-mm-dd HH:MM:SS" for the file.
+} Timestamp;
+
+#ifdef LOG_USE_RT
+// ---------------------------------------------------------------------------
+
+/**
+ * @brief A printf argument captured by rt_capture().
+ */
+typedef union {
+  int64_t i;
+  double d;
+  const void *p;
+} RtArg;
+
+/**
+ * @brief A real-time record: the format string and captured arguments, to be
+ *        formatted on the drain thread.
+ */
+typedef struct {
+  uint64_t seq;               ///< Atomic; see log_rt_log().
+  struct timespec time;
+  const char *file;
+  const char *fmt;
+  int level;
+  int line;
+  int num_args;
+  RtArg args[LOG_RT_MAX_ARGS];
+  char strs[LOG_RT_STR_SIZE]; ///< Copies of the `%s` arguments.
+} RtSlot;
+
+/**
+ * @brief One thread's ring of records. The thread is the only producer and
+ *        the drain thread the only consumer; `head` and `tail` count records
+ *        and only ever grow, and each is on its own cache line.
+ */
+typedef struct {
+  uint64_t head;              ///< Atomic; records written.
+  uint64_t dropped;           ///< Atomic; records dropped (LOG_RT_DROP).
+  char _pad0[48];
+  uint64_t tail;              ///< Atomic; records consumed.
+  char _pad1[56];
+  RtSlot slots[LOG_RT_SLOTS];
+} RtRing;
+
+#endif // #ifdef LOG_USE_RT *************************************************
+
 
 // Globals
 // ===========================================================================
@@ -64,12 +487,197 @@ static struct {
   FILE *fp;
   int level;
   bool quiet;
+  bool escape;
+  bool fp_is_stderr;
+  struct {
+    int count;                ///< Atomic; IDs are never reused.
+    int levels[LOG_MAX_LOGGERS];      ///< Effective, see loggers_resolve().
+    int configured[LOG_MAX_LOGGERS];  ///< Or BAD_LEVEL to inherit.
+    char names[LOG_MAX_LOGGERS][LOG_LOGGER_NAME_SIZE];
+  } loggers;
+  log_ClockFn clock;          ///< `NULL` for the real-time clock.
+  void *clock_udata;
+  struct {
+    bool valid;
+    time_t sec;               ///< The second `ts` is rendered for.
+    Timestamp ts;
+  } ts_cache;
+#ifdef LOG_HAVE_TSC
+  struct {
+    uint64_t base_tsc;        ///< Counter reading at `base`.
+    struct timespec base;     ///< Real time at calibration.
+    double ns_per_tick;       ///< `0` until calibrated.
+  } tsc;
+#endif
+  struct {
+    int policy;               ///< LOG_FLUSH_*
+    bool resolved;            ///< Has `buffered` been worked out?
+    bool buffered;
+    bool at_exit_registered;
+    Buffer pending;
+    int64_t pending_since_ms; ///< When `pending` got its oldest line.
+#ifdef LOG_HAVE_VMSPLICE
+    bool splice;              ///< Is `pending` a region to vmsplice()?
+    char *regions[2];
+    int current;              ///< The region `pending` is in.
+    uint64_t spliced;         ///< Bytes given to the pipe so far.
+    uint64_t region_end[2];   ///< `spliced` after each region's last flush.
+#endif
+  } err;
+  struct {
+    bool active;
+    int level;
+    struct timespec time;
+    Timestamp ts;
+    Buffer err_out;
+    Buffer file_out;
+  } batch;
+  struct {
+    log_AllocFn alloc;        ///< `NULL` for malloc() and friends.
+    log_FreeFn free;
+    void *udata;
+  } allocator;
+  struct {
+    size_t budget;            ///< `0` for no limit.
+    int policy;               ///< LOG_MEM_DROP or LOG_MEM_DROP_LOW.
+    size_t used;              ///< The counters are updated atomically.
+    size_t peak;
+    unsigned long refused;
+    unsigned long dropped;
+  } mem;
+  struct {
+    int timeout_ms;           ///< `0` when the watchdog is off.
+    FILE *fallback;           ///< Where records go while stalled, or `NULL`.
+    bool writing;             ///< Does a thread have the queue to write?
+    Buffer queue;             ///< Lines waiting for the writer.
+    Buffer out;               ///< What the writer is writing.
+    int64_t write_start_ms;   ///< When the current write began, or 0.
+    bool stalled;
+    unsigned long count;      ///< Records diverted or dropped.
+  } stall;
+  struct {
+    int trigger;
+    int level;
+    int64_t duration_ms;      ///< `0` when boosting is off.
+    bool per_thread;
+    unsigned generation;      ///< Atomic; bumped by log_set_boost(), last.
+    int64_t until_ms;         ///< Atomic; `0` when no boost is running.
+  } boost;
+  struct {
+    unsigned char *bits;      ///< `NULL` when not indexing.
+    char *path;               ///< `<segment>.bloom`
+    char *tmp_path;           ///< Written, then renamed over `path`.
+    int num_keys;             ///< `0` to index every token.
+    char keys[BLOOM_MAX_KEYS][BLOOM_KEY_SIZE];
+    uint64_t covered;         ///< Segment bytes indexed when last saved.
+    bool dirty;               ///< Added to since it was saved?
+    bool at_exit_registered;
+  } bloom;
+#ifdef LOG_USE_MSGPACK
+  FILE *msgpack_fp;
+  bool msgpack_intern;
+  uint32_t msgpack_num_interned;
+  struct {
+    const char *str;
+    uint32_t hash;            ///< Of the contents, see msgpack_intern().
+    uint32_t id;
+  } msgpack_interned[LOG_MSGPACK_INTERN_SLOTS];
+#endif
+#ifdef LOG_USE_OTLP
+  struct {
+    char *host;               ///< `NULL` when the exporter is off.
+    char *port;
+    Buffer pending;           ///< Encoded `LogRecord` fields, oldest first.
+    size_t pending_count;
+    int64_t batch_start_ms;   ///< When the oldest pending record arrived.
+    int64_t retry_at_ms;      ///< Don't send before this, after a failure.
+    int64_t backoff_ms;
+    unsigned long dropped;
+    bool at_exit_registered;
+    char *spool_dir;          ///< `NULL` when not spooling.
+    size_t spool_max;         ///< Most bytes to keep on disk.
+    size_t spool_bytes;       ///< Bytes in the segment files.
+    uint64_t spool_first;     ///< Oldest segment (being replayed).
+    uint64_t spool_next;      ///< Newest segment (being appended to).
+    off_t spool_read_offset;  ///< Replayed this far into the oldest.
+    int spool_fd;             ///< Newest segment, once opened (or `-1`).
+    size_t spool_fd_size;
+  } otlp;
+#endif
+#ifdef LOG_USE_SHM
+  log_ShmHeader *shm;         ///< `NULL` when the ring is off.
+  size_t shm_size;
+#endif
+#ifdef LOG_USE_RT
+  struct {
+    int policy;               ///< LOG_RT_DROP or LOG_RT_OVERWRITE.
+    unsigned num_rings;       ///< Atomic; rings handed out (may overshoot).
+    bool running;             ///< Atomic; the drain thread should go on.
+    bool started;
+    pthread_t drain;
+    unsigned long lost;       ///< Atomic; overwritten, or without a ring.
+  } rt;
+#endif
 } L;
 
+#ifdef LOG_THREAD_LOCAL
+
+/**
+ * @brief The calling thread's boost, with per-thread boosting (see
+ *        log_set_boost()). Only counts if `generation` is current.
+ */
+static LOG_THREAD_LOCAL struct {
+  unsigned generation;
+  int64_t until_ms;
+} thread_boost;
+
+/**
+ * @brief Set while the calling thread has the batch open (see
+ *        log_batch_begin()).
+ */
+static LOG_THREAD_LOCAL bool thread_batch_open;
+
+#endif
+
 static const char *level_names[] = {
   "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"
 };
 
+#if defined(LOG_USE_USDT) && defined(__x86_64__)
+
+/**
+ * @brief Semaphore for the `logc:record` USDT probe (see log.h). Tracers
+ *        increment it while attached; it lives in `.probes` where they expect
+ *        to find it.
+ */
+__attribute__((section(".probes")))
+volatile unsigned short log_usdt_semaphore = 0;
+
+/**
+ * @brief The level the calling thread last passed to log_batch_begin(),
+ *        whether or not it's enabled, for probing log_batch_add() lines.
+ */
+static __thread int thread_batch_level;
+
+#endif // #if defined(LOG_USE_USDT) && defined(__x86_64__)
+
+#ifdef LOG_USE_RT
+// ---------------------------------------------------------------------------
+
+static RtRing rt_rings[LOG_RT_THREADS];
+
+/**
+ * @brief The calling thread's ring, once it has one.
+ */
+static __thread RtRing *rt_thread_ring;
+
+/**
+ * @brief Set when the calling thread asked for a ring and none were left.
+ */
+static __thread bool rt_thread_ringless;
+
+#endif // #ifdef LOG_USE_RT *************************************************
+
 /**
  * @brief Internally keeps track of if log_init_from_env() has been called.
  */
@@ -77,14 +685,14 @@ static int has_init_from_env = 0;
 
 /**
  * @brief String versions of the level integers to compare input to (from 
- *        environment variables or CLI arguments).
+ *        environment variables or CLI arguments), indexed by
+ *        `level - LOG_TRACE`.
  * 
  * Array of pointers to strings.
- * 
- * @note  Don't access directly, use log_level_strings(), which first initializes
- *        the values if needed.
  */
-static char **level_strings;
+static char *level_strings[] = {
+  "-1", "0", "1", "2", "3", "4"
+};
 
 #ifdef LOG_USE_COLOR
 // ---------------------------------------------------------------------------
@@ -103,42 +711,49 @@ static const char *level_colors[] = {
 // ---------------------------------------------------------------------------
 
 /**
- * @brief How many characters an integer would be expressed as a string (in 
- *    decimal form).
+ * @brief Do two streams write to the same underlying file?
  * 
- * @note  If allocating space remember to add `1` to account for the terminating
- *        `NULL`.
+ * Compares the device and inode of the streams' file descriptors, so catches
+ * `stderr` being redirected to the same file (or pipe, or terminal) that a
+ * separately opened stream points at, not just the streams being identical.
+ * 
+ * @return bool `false` if either stream can't be `fstat()`-ed.
  */
-static int
-length_as_string(int x) {
-  int length;
-  
-  if (0 == x) {
-    // Special case for `0`, where the alg below does not work.
-    length = 1;
-  } else {
-    length = floor(log10(abs(x))) + 1;
+static bool
+same_file(FILE *a, FILE *b) {
+  if (a == b) {
+    return true;
   }
   
-  if (x < 0) {
-    length++;
+#ifdef LOG_HAVE_POSIX
+  struct stat sa, sb;
+  
+  if (  fstat(fileno(a), &sa) != 0 ||
+        fstat(fileno(b), &sb) != 0 ) {
+    return false;
   }
   
-  return length;
-} // length_as_string()
+  return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+#else
+  return false;
+#endif
+} // same_file()
 
 /**
- * @brief String-ify an integer (in decimal).
- * 
- * @note  Dynamically allocates the returned string, so don't forget to free()
- *        if and when you're done.
+ * @brief Milliseconds on the monotonic clock, for timeouts, boosts, batch
+ *        ages and backoff. Falls back to (whole seconds of) time() where
+ *        there's no POSIX clock.
  */
-static char *
-int_to_string(int x) {
-  char *str = malloc((length_as_string(x) + 1) * sizeof(char));
-  sprintf(str, "%d", x);
-  return str;
-} // int_to_string()
+static int64_t
+monotonic_ms(void) {
+#ifdef LOG_HAVE_POSIX
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#else
+  return (int64_t)time(NULL) * 1000;
+#endif
+}
 
 static void
 lock(void)   {
@@ -154,375 +769,6066 @@ unlock(void) {
   }
 }
 
-
-// Functional Utilties
-// ---------------------------------------------------------------------------
-// 
-// Don't depend on no state.
-// 
-
 /**
- * @brief Is a `level` valid?
+ * @brief Count `size` more bytes as in use, unless that would go over the
+ *        budget (see log_set_mem_budget()).
+ * 
+ * Lock-free, since messages are formatted (and may need the heap) before the
+ * lock is taken.
  */
-bool
-log_is_level(int level) {
-  return level >= LOG_TRACE && level <= LOG_FATAL;
-}
+static bool
+mem_reserve(size_t size) {
+  size_t budget = L.mem.budget;
+  size_t used = ATOMIC_LOAD(&L.mem.used, RELAXED);
+  size_t now;
+  
+  do {
+    if (budget > 0 && (size > budget || used > budget - size)) {
+      ATOMIC_ADD(&L.mem.refused, 1, RELAXED);
+      return false;
+    }
+    now = used + size;
+  } while (!ATOMIC_CAS(&L.mem.used, &used, now, RELAXED));
+  
+  size_t peak = ATOMIC_LOAD(&L.mem.peak, RELAXED);
+  while (now > peak && !ATOMIC_CAS(&L.mem.peak, &peak, now, RELAXED)) {
+    // `peak` was reloaded, try again
+  }
+  
+  return true;
+} // mem_reserve()
 
-#ifdef LOG_USE_COLOR
+static void
+mem_release(size_t size) {
+  ATOMIC_SUB(&L.mem.used, size, RELAXED);
+}
 
 /**
- * @brief Get the shell color string for a level.
- * 
- * @param level 
- * @return const char * String (`NULL`-termianted). *DO NOT* free()!
- * @return NULL When level is not valid.
+ * @brief Get a block from the allocator (see log_set_allocator()), with room
+ *        for the header, and fill the header in.
  */
-const char *
-log_level_to_color(int level) {
-  if (!log_is_level(level)) {
-    return NULL;
+static char *
+mem_block_alloc(size_t size) {
+  MemHeader header = { size, L.allocator.free, L.allocator.udata };
+  char *block = L.allocator.alloc ?
+    L.allocator.alloc(L.allocator.udata, MEM_HEADER_SIZE + size) :
+    malloc(MEM_HEADER_SIZE + size);
+  
+  if (block != NULL) {
+    memcpy(block, &header, sizeof(header));
   }
   
-  return level_colors[level - LOG_TRACE];
-} // log_level_to_color()
-
-#endif // #ifdef LOG_USE_COLOR
+  return block;
+}
 
 /**
- * @brief Get the string name for a level.
- * 
- * @note  **DO NOT free()** the returned strings! They're elements of an
- *        internal array, and we need them around.
+ * @brief Give a block back to the allocator it came from.
+ */
+static void
+mem_block_free(char *block) {
+  MemHeader header;
+  
+  memcpy(&header, block, sizeof(header));
+  
+  if (header.free) {
+    header.free(header.udata, block);
+  } else {
+    free(block);
+  }
+}
+
+/**
+ * @brief malloc() for everything the logger allocates, counted against the
+ *        memory budget.
  * 
- * @return char * String like "DEBUG" (`NULL`-termianted). **DO NOT** free()
- *                them!
- * @return char * `NULL` when `level` is not valid.
+ * @return void * `NULL` if over budget or out of memory. Free with
+ *                mem_free().
  */
-const char *
-log_level_to_name(int level) {
-  if (!log_is_level(level)) {
+static void *
+mem_alloc(size_t size) {
+  if (!mem_reserve(size)) {
     return NULL;
   }
   
-  return level_names[ level - LOG_TRACE ];
-} // log_level_to_name()
+  char *block = mem_block_alloc(size);
+  
+  if (block == NULL) {
+    mem_release(size);
+    ATOMIC_ADD(&L.mem.refused, 1, RELAXED);
+    return NULL;
+  }
+  
+  return block + MEM_HEADER_SIZE;
+} // mem_alloc()
 
 /**
- * @brief Convert log level name to level integer (that you can use in in
- * log_set_level()).
- * 
- * @param name 
- *    When up-cased, should be one of level_names.
+ * @brief realloc() for mem_alloc()-ed memory. Uses realloc() itself when
+ *        both the block and the current allocator are the default,
+ *        otherwise allocates, copies and frees.
  * 
- * @return int 
- *    Log level integer, or BAD_LEVEL on error (logs an error as well).
+ * @return void * `NULL` if over budget or out of memory, in which case `ptr`
+ *                is left as it was.
  */
-int
-log_name_to_level(char* name) {
-  char *upcased;
-  unsigned char *tmp_ptr = NULL;
+static void *
+mem_realloc(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return mem_alloc(size);
+  }
+  
+  char *block = (char *)ptr - MEM_HEADER_SIZE;
+  MemHeader header;
+  
+  memcpy(&header, block, sizeof(header));
+  
+  if (size > header.size && !mem_reserve(size - header.size)) {
+    return NULL;
+  }
+  
+  char *new_block;
+  
+  if (header.free == NULL && L.allocator.alloc == NULL) {
+    new_block = realloc(block, MEM_HEADER_SIZE + size);
+  } else {
+    new_block = mem_block_alloc(size);
+    if (new_block != NULL) {
+      memcpy(
+        new_block + MEM_HEADER_SIZE, ptr,
+        size < header.size ? size : header.size);
+      mem_block_free(block);
+    }
+  }
+  
+  if (new_block == NULL) {
+    if (size > header.size) {
+      mem_release(size - header.size);
+    }
+    ATOMIC_ADD(&L.mem.refused, 1, RELAXED);
+    return NULL;
+  }
+  
+  if (size < header.size) {
+    mem_release(header.size - size);
+  }
+  
+  memcpy(new_block, &size, sizeof(size));
+  return new_block + MEM_HEADER_SIZE;
+} // mem_realloc()
 
-  // Make an upper-case copy
-  upcased = strdup(name); 
-  tmp_ptr = (unsigned char *)upcased;
-  while(*tmp_ptr) {
-      *tmp_ptr = toupper(*tmp_ptr);
-      tmp_ptr++;
+static void
+mem_free(void *ptr) {
+  if (ptr == NULL) {
+    return;
   }
   
-  // Iterate through each level name, checking if it's the same as the
-  // upper-case copy of `name`, and return the level if it is.
-  for (int level = LOG_TRACE; level <= LOG_FATAL; level++) {
-    if (0 == strcmp(log_level_to_name(level), upcased)) {
-      return level;
+  char *block = (char *)ptr - MEM_HEADER_SIZE;
+  size_t size;
+  
+  memcpy(&size, block, sizeof(size));
+  mem_release(size);
+  mem_block_free(block);
+}
+
+#ifdef LOG_USE_OTLP
+
+static char *
+mem_strdup(const char *str) {
+  size_t size = strlen(str) + 1;
+  char *copy = mem_alloc(size);
+  
+  if (copy != NULL) {
+    memcpy(copy, str, size);
+  }
+  
+  return copy;
+}
+
+#endif // #ifdef LOG_USE_OTLP
+
+/**
+ * @brief Should a record at `level` be dropped to save memory? True under
+ *        LOG_MEM_DROP_LOW for levels below LOG_WARN once 3/4 of the budget is
+ *        in use (and counts it).
+ */
+static bool
+mem_drop_record(int level) {
+  if (L.mem.policy != LOG_MEM_DROP_LOW || level >= LOG_WARN) {
+    return false;
+  }
+  
+  size_t budget = L.mem.budget;
+  
+  if (budget == 0 ||
+      ATOMIC_LOAD(&L.mem.used, RELAXED) < budget / 4 * 3) {
+    return false;
+  }
+  
+  ATOMIC_ADD(&L.mem.dropped, 1, RELAXED);
+  return true;
+} // mem_drop_record()
+
+/**
+ * @brief Start (or extend) a boost if a record at `level` triggers one.
+ */
+static void
+boost_trigger(int level) {
+  unsigned generation = ATOMIC_LOAD(&L.boost.generation, ACQUIRE);
+  
+  if (L.boost.duration_ms == 0 || level < L.boost.trigger) {
+    return;
+  }
+  
+  int64_t until_ms = monotonic_ms() + L.boost.duration_ms;
+  
+#ifdef LOG_THREAD_LOCAL
+  if (L.boost.per_thread) {
+    thread_boost.generation = generation;
+    thread_boost.until_ms = until_ms;
+    return;
+  }
+#else
+  (void)generation;
+#endif
+  ATOMIC_STORE(&L.boost.until_ms, until_ms, RELAXED);
+}
+
+/**
+ * @brief Does a running boost let a record at `level`, below L.level,
+ *        through? Only reads the clock while a boost is running, and forgets
+ *        it once it's over.
+ */
+static bool
+boost_allows(int level) {
+  unsigned generation = ATOMIC_LOAD(&L.boost.generation, ACQUIRE);
+  
+  if (level < L.boost.level) {
+    return false;
+  }
+  
+#ifdef LOG_THREAD_LOCAL
+  if (L.boost.per_thread) {
+    if (thread_boost.until_ms == 0 ||
+        thread_boost.generation != generation) {
+      return false;
+    }
+    if (monotonic_ms() < thread_boost.until_ms) {
+      return true;
     }
+    thread_boost.until_ms = 0;
+    return false;
   }
+#else
+  (void)generation;
+#endif
   
-  log_error("Level name '%s' not found", upcased);
-  return BAD_LEVEL;
-} // log_name_to_level()
+  int64_t until_ms = ATOMIC_LOAD(&L.boost.until_ms, RELAXED);
+  
+  if (until_ms == 0) {
+    return false;
+  }
+  if (monotonic_ms() < until_ms) {
+    return true;
+  }
+  // If this fails someone else forgot it, or started a new boost
+  ATOMIC_CAS(&L.boost.until_ms, &until_ms, 0, RELAXED);
+  return false;
+} // boost_allows()
 
 /**
- * @brief Accessor for the string versions of level integers. Used for comparing
- *        inputs.
+ * @brief Is `level` being logged, given the logger's `threshold` level
+ *        (taking boosts into account)? Records that are may start a boost.
+ */
+static bool
+level_enabled(int level, int threshold) {
+  if (level < threshold) {
+    return boost_allows(level);
+  }
+  boost_trigger(level);
+  return true;
+}
+
+/**
+ * @brief Start a buffer off in `storage` (which may be `NULL` / `0` to start
+ *        empty). It moves to the heap if it needs to grow past that.
+ */
+static void
+buffer_init(Buffer *buffer, char *storage, size_t cap) {
+  buffer->data = storage;
+  buffer->len = 0;
+  buffer->cap = cap;
+  buffer->on_heap = false;
+}
+
+static void
+buffer_free(Buffer *buffer) {
+  if (buffer->on_heap) {
+    mem_free(buffer->data);
+  }
+  buffer_init(buffer, NULL, 0);
+}
+
+/**
+ * @brief Make room for `extra` more bytes.
  * 
- * Initializes the values first if they haven't been.
+ * @return bool `false` if out of memory or over the memory budget (the
+ *              buffer is left as it was).
+ */
+static bool
+buffer_reserve(Buffer *buffer, size_t extra) {
+  if (buffer->len + extra <= buffer->cap) {
+    return true;
+  }
+  
+  size_t cap = buffer->cap > 0 ? buffer->cap * 2 : 256;
+  while (cap < buffer->len + extra) {
+    cap *= 2;
+  }
+  
+  char *data;
+  
+  if (buffer->on_heap) {
+    data = mem_realloc(buffer->data, cap);
+  } else {
+    data = mem_alloc(cap);
+    if (data != NULL && buffer->len > 0) {
+      memcpy(data, buffer->data, buffer->len);
+    }
+  }
+  
+  if (data == NULL) {
+    return false;
+  }
+  
+  buffer->data = data;
+  buffer->cap = cap;
+  buffer->on_heap = true;
+  return true;
+} // buffer_reserve()
+
+/**
+ * @brief Append bytes, dropping them if out of memory.
+ */
+static void
+buffer_append(Buffer *buffer, const char *data, size_t len) {
+  if (buffer_reserve(buffer, len)) {
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+  }
+}
+
+/**
+ * @brief Append printf-style. If out of memory, appends as much as fit.
+ *        Either way the buffer is left `NULL`-terminated (past `len`) when it
+ *        has any room at all.
+ */
+static void
+buffer_vprintf(Buffer *buffer, const char *fmt, va_list args) {
+  va_list retry;
+  size_t room = buffer->cap - buffer->len;
+  
+  va_copy(retry, args);
+  
+  int length = vsnprintf(
+    room > 0 ? buffer->data + buffer->len : NULL, room, fmt, args);
+  
+  if (length < 0) {
+    va_end(retry);
+    return;
+  }
+  
+  if ((size_t)length >= room) {
+    if (buffer_reserve(buffer, (size_t)length + 1)) {
+      vsnprintf(buffer->data + buffer->len, (size_t)length + 1, fmt, retry);
+    } else {
+      // Go with what fit
+      length = room > 0 ? (int)room - 1 : 0;
+    }
+  }
+  
+  buffer->len += (size_t)length;
+  va_end(retry);
+} // buffer_vprintf()
+
+static void
+buffer_printf(Buffer *buffer, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  buffer_vprintf(buffer, fmt, args);
+  va_end(args);
+}
+
+// Number Formatting
+// ---------------------------------------------------------------------------
+// 
+// For log_array(), which formats whole arrays without going through
+// snprintf() for every element.
+// 
+
+static const char digit_pairs[] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+/**
+ * @brief Write `value` in decimal, two digits per division, ending at `end`.
  * 
- * @return char **  Array of pointers to strings.
+ * @return char * Where it starts (at most 20 bytes before `end`).
  */
-char **
-log_level_strings() {  
-  int num_levels;
-  int level;
+static char *
+format_u64(char *end, uint64_t value) {
+  char *p = end;
+  
+  while (value >= 100) {
+    p -= 2;
+    memcpy(p, digit_pairs + (value % 100) * 2, 2);
+    value /= 100;
+  }
+  
+  if (value >= 10) {
+    p -= 2;
+    memcpy(p, digit_pairs + value * 2, 2);
+  } else {
+    *--p = (char)('0' + value);
+  }
+  
+  return p;
+}
+
+static void
+buffer_append_u64(Buffer *buffer, uint64_t value) {
+  char digits[20];
+  char *start = format_u64(digits + sizeof(digits), value);
+  
+  buffer_append(buffer, start, (size_t)(digits + sizeof(digits) - start));
+}
+
+static void
+buffer_append_i64(Buffer *buffer, int64_t value) {
+  if (value < 0) {
+    buffer_append(buffer, "-", 1);
+    buffer_append_u64(buffer, -(uint64_t)value);
+  } else {
+    buffer_append_u64(buffer, (uint64_t)value);
+  }
+}
+
+// Shortest floats are found with Grisu2 (Florian Loitsch, "Printing
+// Floating-Point Numbers Quickly and Accurately with Integers", PLDI 2010):
+// the value and the halfway points to its neighbours are scaled by a cached
+// power of ten into 64-bit fixed point, and digits generated until the
+// result is inside that interval - so it always reads back as the same
+// value, and is the shortest that does in all but rare cases.
+// 
+
+/**
+ * @brief A 64-bit "do it yourself" float, `f * 2^e`.
+ */
+typedef struct {
+  uint64_t f;
+  int e;
+} DiyFp;
+
+/**
+ * @brief 10^K for K = -348, -340, ... 340, normalized (top bit set).
+ */
+static const struct {
+  uint64_t f;
+  int16_t e;
+} cached_powers[] = {
+  { 0xfa8fd5a0081c0288ULL, -1220 },
+  { 0xbaaee17fa23ebf76ULL, -1193 },
+  { 0x8b16fb203055ac76ULL, -1166 },
+  { 0xcf42894a5dce35eaULL, -1140 },
+  { 0x9a6bb0aa55653b2dULL, -1113 },
+  { 0xe61acf033d1a45dfULL, -1087 },
+  { 0xab70fe17c79ac6caULL, -1060 },
+  { 0xff77b1fcbebcdc4fULL, -1034 },
+  { 0xbe5691ef416bd60cULL, -1007 },
+  { 0x8dd01fad907ffc3cULL,  -980 },
+  { 0xd3515c2831559a83ULL,  -954 },
+  { 0x9d71ac8fada6c9b5ULL,  -927 },
+  { 0xea9c227723ee8bcbULL,  -901 },
+  { 0xaecc49914078536dULL,  -874 },
+  { 0x823c12795db6ce57ULL,  -847 },
+  { 0xc21094364dfb5637ULL,  -821 },
+  { 0x9096ea6f3848984fULL,  -794 },
+  { 0xd77485cb25823ac7ULL,  -768 },
+  { 0xa086cfcd97bf97f4ULL,  -741 },
+  { 0xef340a98172aace5ULL,  -715 },
+  { 0xb23867fb2a35b28eULL,  -688 },
+  { 0x84c8d4dfd2c63f3bULL,  -661 },
+  { 0xc5dd44271ad3cdbaULL,  -635 },
+  { 0x936b9fcebb25c996ULL,  -608 },
+  { 0xdbac6c247d62a584ULL,  -582 },
+  { 0xa3ab66580d5fdaf6ULL,  -555 },
+  { 0xf3e2f893dec3f126ULL,  -529 },
+  { 0xb5b5ada8aaff80b8ULL,  -502 },
+  { 0x87625f056c7c4a8bULL,  -475 },
+  { 0xc9bcff6034c13053ULL,  -449 },
+  { 0x964e858c91ba2655ULL,  -422 },
+  { 0xdff9772470297ebdULL,  -396 },
+  { 0xa6dfbd9fb8e5b88fULL,  -369 },
+  { 0xf8a95fcf88747d94ULL,  -343 },
+  { 0xb94470938fa89bcfULL,  -316 },
+  { 0x8a08f0f8bf0f156bULL,  -289 },
+  { 0xcdb02555653131b6ULL,  -263 },
+  { 0x993fe2c6d07b7facULL,  -236 },
+  { 0xe45c10c42a2b3b06ULL,  -210 },
+  { 0xaa242499697392d3ULL,  -183 },
+  { 0xfd87b5f28300ca0eULL,  -157 },
+  { 0xbce5086492111aebULL,  -130 },
+  { 0x8cbccc096f5088ccULL,  -103 },
+  { 0xd1b71758e219652cULL,   -77 },
+  { 0x9c40000000000000ULL,   -50 },
+  { 0xe8d4a51000000000ULL,   -24 },
+  { 0xad78ebc5ac620000ULL,     3 },
+  { 0x813f3978f8940984ULL,    30 },
+  { 0xc097ce7bc90715b3ULL,    56 },
+  { 0x8f7e32ce7bea5c70ULL,    83 },
+  { 0xd5d238a4abe98068ULL,   109 },
+  { 0x9f4f2726179a2245ULL,   136 },
+  { 0xed63a231d4c4fb27ULL,   162 },
+  { 0xb0de65388cc8ada8ULL,   189 },
+  { 0x83c7088e1aab65dbULL,   216 },
+  { 0xc45d1df942711d9aULL,   242 },
+  { 0x924d692ca61be758ULL,   269 },
+  { 0xda01ee641a708deaULL,   295 },
+  { 0xa26da3999aef774aULL,   322 },
+  { 0xf209787bb47d6b85ULL,   348 },
+  { 0xb454e4a179dd1877ULL,   375 },
+  { 0x865b86925b9bc5c2ULL,   402 },
+  { 0xc83553c5c8965d3dULL,   428 },
+  { 0x952ab45cfa97a0b3ULL,   455 },
+  { 0xde469fbd99a05fe3ULL,   481 },
+  { 0xa59bc234db398c25ULL,   508 },
+  { 0xf6c69a72a3989f5cULL,   534 },
+  { 0xb7dcbf5354e9beceULL,   561 },
+  { 0x88fcf317f22241e2ULL,   588 },
+  { 0xcc20ce9bd35c78a5ULL,   614 },
+  { 0x98165af37b2153dfULL,   641 },
+  { 0xe2a0b5dc971f303aULL,   667 },
+  { 0xa8d9d1535ce3b396ULL,   694 },
+  { 0xfb9b7cd9a4a7443cULL,   720 },
+  { 0xbb764c4ca7a44410ULL,   747 },
+  { 0x8bab8eefb6409c1aULL,   774 },
+  { 0xd01fef10a657842cULL,   800 },
+  { 0x9b10a4e5e9913129ULL,   827 },
+  { 0xe7109bfba19c0c9dULL,   853 },
+  { 0xac2820d9623bf429ULL,   880 },
+  { 0x80444b5e7aa7cf85ULL,   907 },
+  { 0xbf21e44003acdd2dULL,   933 },
+  { 0x8e679c2f5e44ff8fULL,   960 },
+  { 0xd433179d9c8cb841ULL,   986 },
+  { 0x9e19db92b4e31ba9ULL,  1013 },
+  { 0xeb96bf6ebadf77d9ULL,  1039 },
+  { 0xaf87023b9bf0ee6bULL,  1066 },
+};
+
+static const uint64_t powers_of_10[] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+  10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+  100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+  100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+  100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+/**
+ * @brief Product, rounded to the top 64 bits.
+ */
+static DiyFp
+diyfp_mul(DiyFp x, DiyFp y) {
+  const uint64_t mask = 0xffffffffULL;
+  uint64_t a = x.f >> 32, b = x.f & mask;
+  uint64_t c = y.f >> 32, d = y.f & mask;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  uint64_t mid = (bd >> 32) + (ad & mask) + (bc & mask) + (1ULL << 31);
+  DiyFp product = {
+    ac + (ad >> 32) + (bc >> 32) + (mid >> 32), x.e + y.e + 64
+  };
   
-  // If level_strings is NULL then create it
-  if (NULL == level_strings) {    
-    num_levels = LOG_FATAL - LOG_TRACE;
+  return product;
+}
+
+static DiyFp
+diyfp_normalize(DiyFp x) {
+  while (!(x.f & (1ULL << 63))) {
+    x.f <<= 1;
+    x.e--;
+  }
+  return x;
+}
+
+/**
+ * @brief Move the last digit down while that keeps it inside the interval
+ *        and brings it closer to the value.
+ */
+static void
+grisu_round(char *digits,
+            int len,
+            uint64_t delta,
+            uint64_t rest,
+            uint64_t ten_kappa,
+            uint64_t wp_w) {
+  while ( rest < wp_w && delta - rest >= ten_kappa &&
+          ( rest + ten_kappa < wp_w ||
+            wp_w - rest > rest + ten_kappa - wp_w ) ) {
+    digits[len - 1]--;
+    rest += ten_kappa;
+  }
+}
+
+/**
+ * @brief Generate the digits of `w`, stopping as soon as they're within
+ *        `delta` of the upper bound `mp`.
+ */
+static int
+grisu_digits(DiyFp w, DiyFp mp, uint64_t delta, char *digits, int *k) {
+  DiyFp one = { 1ULL << -mp.e, mp.e };
+  uint64_t wp_w = mp.f - w.f;
+  uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+  uint64_t p2 = mp.f & (one.f - 1);
+  int kappa = 1;
+  int len = 0;
+  
+  while (kappa < 10 && p1 >= powers_of_10[kappa]) {
+    kappa++;
+  }
+  
+  while (kappa > 0) {
+    uint32_t d = p1 / (uint32_t)powers_of_10[kappa - 1];
+    p1 %= (uint32_t)powers_of_10[kappa - 1];
     
-    level_strings = malloc(num_levels * sizeof(char *));
+    if (d != 0 || len > 0) {
+      digits[len++] = (char)('0' + d);
+    }
+    kappa--;
     
-    for(level = LOG_TRACE; level <= LOG_FATAL; level++) {
-      level_strings[ level - LOG_TRACE ] = int_to_string(level);
+    uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+    if (rest <= delta) {
+      *k += kappa;
+      grisu_round(
+        digits, len, delta, rest, powers_of_10[kappa] << -one.e, wp_w);
+      return len;
     }
   }
   
-  return level_strings;
-} // log_level_strings()
+  for (;;) {
+    p2 *= 10;
+    delta *= 10;
+    
+    char d = (char)(p2 >> -one.e);
+    if (d != 0 || len > 0) {
+      digits[len++] = (char)('0' + d);
+    }
+    p2 &= one.f - 1;
+    kappa--;
+    
+    if (p2 < delta) {
+      *k += kappa;
+      grisu_round(
+        digits, len, delta, p2, one.f,
+        -kappa < 20 ? wp_w * powers_of_10[-kappa] : 0);
+      return len;
+    }
+  }
+} // grisu_digits()
 
 /**
- * @brief Convert a level to a string.
+ * @brief The shortest digits for a finite, positive value `f * 2^e` whose
+ *        type has `mantissa_bits` explicit bits: `value = digits * 10^k`.
  * 
- * @note  **DO NOT** free() the returned string!
- *        
- *        Internally uses a pre-populated array of strings from it returns a 
- *        reference.
+ * @return int  How many digits (at most 17).
+ */
+static int
+grisu2(uint64_t f, int e, int mantissa_bits, char *digits, int *k) {
+  uint64_t hidden = 1ULL << mantissa_bits;
+  
+  // The halfway points to the neighbouring values, on the same exponent;
+  // the lower one is closer at a power of two
+  DiyFp plus = { (f << 1) + 1, e - 1 };
+  while (!(plus.f & (hidden << 1))) {
+    plus.f <<= 1;
+    plus.e--;
+  }
+  plus.f <<= 64 - mantissa_bits - 2;
+  plus.e -= 64 - mantissa_bits - 2;
+  
+  DiyFp minus = f == hidden ?
+    (DiyFp){ (f << 2) - 1, e - 2 } :
+    (DiyFp){ (f << 1) - 1, e - 1 };
+  minus.f <<= minus.e - plus.e;
+  minus.e = plus.e;
+  
+  // Scale by the cached power putting the upper bound's exponent in
+  // [-60, -32]
+  double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+  int index = (int)dk;
+  if (dk - index > 0.0) {
+    index++;
+  }
+  index = (index >> 3) + 1;
+  *k = -(-348 + index * 8);
+  
+  DiyFp c = { cached_powers[index].f, cached_powers[index].e };
+  DiyFp w = diyfp_mul(diyfp_normalize((DiyFp){ f, e }), c);
+  DiyFp wp = diyfp_mul(plus, c);
+  DiyFp wm = diyfp_mul(minus, c);
+  
+  // Stay strictly inside, since the products are rounded
+  wm.f++;
+  wp.f--;
+  
+  return grisu_digits(w, wp, wp.f - wm.f, digits, k);
+} // grisu2()
+
+/**
+ * @brief Append the shortest decimal that reads back as exactly `value` -
+ *        `0.1` rather than `0.10000000000000001` - in `%g` style: plain
+ *        from 1e-4 up to 1e15, otherwise with an exponent.
  * 
- * @return char * @parblock
- *   String version of the level integer. Again, **DO NOT EVER 
- *   free()**!
- *    
- *   If `level` is *not* a valid level returns `NULL`.
- * @endparblock
+ * @param single  Print the shortest that reads back as the same `float`.
  */
-char *
-log_level_to_string(int level) {
-  if (!log_is_level(level)) {
-    return NULL;
+static void
+buffer_append_double(Buffer *buffer, double value, bool single) {
+  uint64_t f;
+  int e;
+  
+  if (value - value != 0) {
+    // NaN or infinity
+    buffer_printf(buffer, "%g", value);
+    return;
+  }
+  
+  if (value < 0 || (value == 0 && 1 / value < 0)) {
+    buffer_append(buffer, "-", 1);
+    value = -value;
+  }
+  
+  if (value == 0) {
+    buffer_append(buffer, "0", 1);
+    return;
+  }
+  
+  if (single) {
+    float narrow = (float)value;
+    uint32_t bits;
+    
+    memcpy(&bits, &narrow, sizeof(bits));
+    f = bits & 0x7fffff;
+    e = (int)(bits >> 23);
+    if (e != 0) {
+      f |= 1ULL << 23;
+    }
+    e = (e != 0 ? e : 1) - 150;
+  } else {
+    uint64_t bits;
+    
+    memcpy(&bits, &value, sizeof(bits));
+    f = bits & 0xfffffffffffffULL;
+    e = (int)(bits >> 52);
+    if (e != 0) {
+      f |= 1ULL << 52;
+    }
+    e = (e != 0 ? e : 1) - 1075;
+  }
+  
+  char digits[20];
+  int k;
+  int len = grisu2(f, e, single ? 23 : 52, digits, &k);
+  int exp10 = len + k - 1;
+  
+  // "0.000" + 17 digits, or 15 digits + 14 zeros
+  char text[32];
+  int n = 0;
+  
+  if (exp10 >= -4 && exp10 < 15) {
+    if (k >= 0) {
+      memcpy(text, digits, (size_t)len);
+      memset(text + len, '0', (size_t)k);
+      n = len + k;
+    } else if (exp10 >= 0) {
+      memcpy(text, digits, (size_t)exp10 + 1);
+      text[exp10 + 1] = '.';
+      memcpy(text + exp10 + 2, digits + exp10 + 1, (size_t)(len - exp10 - 1));
+      n = len + 1;
+    } else {
+      memcpy(text, "0.", 2);
+      memset(text + 2, '0', (size_t)(-exp10 - 1));
+      n = 1 - exp10;
+      memcpy(text + n, digits, (size_t)len);
+      n += len;
+    }
+  } else {
+    // d[.ddd]e+XX, like printf()
+    text[n++] = digits[0];
+    if (len > 1) {
+      text[n++] = '.';
+      memcpy(text + n, digits + 1, (size_t)len - 1);
+      n += len - 1;
+    }
+    text[n++] = 'e';
+    text[n++] = exp10 < 0 ? '-' : '+';
+    
+    int magnitude = exp10 < 0 ? -exp10 : exp10;
+    if (magnitude >= 100) {
+      text[n++] = (char)('0' + magnitude / 100);
+    }
+    memcpy(text + n, digit_pairs + (magnitude % 100) * 2, 2);
+    n += 2;
+  }
+  
+  buffer_append(buffer, text, (size_t)n);
+} // buffer_append_double()
+
+/**
+ * @brief An element of a log_array() array, widened.
+ */
+typedef union {
+  int64_t i;                  ///< LOG_I32, LOG_I64
+  uint64_t u;                 ///< LOG_U32, LOG_U64
+  double d;                   ///< LOG_F32, LOG_F64
+} ArrayValue;
+
+static size_t
+array_elem_size(int type) {
+  switch (type) {
+    case LOG_I32: case LOG_U32: case LOG_F32: return 4;
+    case LOG_I64: case LOG_U64: case LOG_F64: return 8;
+    default: return 0;
+  }
+}
+
+static ArrayValue
+array_get(int type, const void *array, size_t i) {
+  ArrayValue value;
+  
+  switch (type) {
+    case LOG_I32: value.i = ((const int32_t *)array)[i]; break;
+    case LOG_I64: value.i = ((const int64_t *)array)[i]; break;
+    case LOG_U32: value.u = ((const uint32_t *)array)[i]; break;
+    case LOG_U64: value.u = ((const uint64_t *)array)[i]; break;
+    case LOG_F32: value.d = ((const float *)array)[i]; break;
+    default:      value.d = ((const double *)array)[i]; break;
+  }
+  
+  return value;
+}
+
+static bool
+array_less(int type, ArrayValue a, ArrayValue b) {
+  switch (type) {
+    case LOG_I32: case LOG_I64: return a.i < b.i;
+    case LOG_U32: case LOG_U64: return a.u < b.u;
+    default:                    return a.d < b.d;
+  }
+}
+
+static double
+array_to_double(int type, ArrayValue value) {
+  switch (type) {
+    case LOG_I32: case LOG_I64: return (double)value.i;
+    case LOG_U32: case LOG_U64: return (double)value.u;
+    default:                    return value.d;
+  }
+}
+
+static void
+buffer_append_value(Buffer *buffer, int type, ArrayValue value) {
+  switch (type) {
+    case LOG_I32: case LOG_I64: buffer_append_i64(buffer, value.i); break;
+    case LOG_U32: case LOG_U64: buffer_append_u64(buffer, value.u); break;
+    default:
+      buffer_append_double(buffer, value.d, type == LOG_F32);
+      break;
+  }
+}
+
+/**
+ * @brief Append ` min=... max=... mean=...` for `count` (> 0) elements.
+ *        NaNs are left out of the min and max.
+ */
+static void
+buffer_append_summary(Buffer *buffer,
+                      int type,
+                      const void *array,
+                      size_t count) {
+  bool is_float = type == LOG_F32 || type == LOG_F64;
+  ArrayValue min = array_get(type, array, 0);
+  ArrayValue max = min;
+  double sum = 0;
+  
+  for (size_t i = 0; i < count; i++) {
+    ArrayValue value = array_get(type, array, i);
+    
+    if (array_less(type, value, min) || (is_float && min.d != min.d)) {
+      min = value;
+    }
+    if (array_less(type, max, value) || (is_float && max.d != max.d)) {
+      max = value;
+    }
+    sum += array_to_double(type, value);
+  }
+  
+  buffer_append(buffer, " min=", 5);
+  buffer_append_value(buffer, type, min);
+  buffer_append(buffer, " max=", 5);
+  buffer_append_value(buffer, type, max);
+  buffer_printf(buffer, " mean=%g", sum / (double)count);
+} // buffer_append_summary()
+
+/**
+ * @brief Does a message byte need escaping (see log_set_escape())?
+ * 
+ * Control characters other than tab, and DEL.
+ */
+static bool
+needs_escape(unsigned char c) {
+  return (c < 0x20 && c != '\t') || c == 0x7f;
+}
+
+/**
+ * @brief Find the first byte in `str` that needs escaping, a byte at a time.
+ *        What find_escape() falls back to, and is checked against (see
+ *        tools/logcheck.c).
+ * 
+ * @return size_t Its index, or `len` if there isn't one.
+ */
+static size_t
+find_escape_scalar(const char *str, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (needs_escape((unsigned char)str[i])) {
+      return i;
+    }
+  }
+  return len;
+}
+
+/**
+ * @brief Find the first byte in `str` that needs escaping.
+ * 
+ * Checks 32 (AVX2) or 16 (SSE2) bytes at a time where available, so clean
+ * text - the common case - goes by at close to memcpy() speed. See
+ * tools/logprof.c for the measurements.
+ * 
+ * @return size_t Its index, or `len` if there isn't one.
+ */
+static size_t
+find_escape(const char *str, size_t len) {
+  size_t i = 0;
+  
+#if defined(__AVX2__)
+  const __m256i max_control = _mm256_set1_epi8(0x1f);
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i del = _mm256_set1_epi8(0x7f);
+  
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(str + i));
+    // Unsigned chunk <= 0x1f is min(chunk, 0x1f) == chunk
+    __m256i control = _mm256_cmpeq_epi8(
+      _mm256_min_epu8(chunk, max_control), chunk);
+    control = _mm256_andnot_si256(_mm256_cmpeq_epi8(chunk, tab), control);
+    control = _mm256_or_si256(control, _mm256_cmpeq_epi8(chunk, del));
+    
+    unsigned mask = (unsigned)_mm256_movemask_epi8(control);
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i max_control = _mm_set1_epi8(0x1f);
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i del = _mm_set1_epi8(0x7f);
+  
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(str + i));
+    // Unsigned chunk <= 0x1f is min(chunk, 0x1f) == chunk
+    __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(chunk, max_control), chunk);
+    control = _mm_andnot_si128(_mm_cmpeq_epi8(chunk, tab), control);
+    control = _mm_or_si128(control, _mm_cmpeq_epi8(chunk, del));
+    
+    unsigned mask = (unsigned)_mm_movemask_epi8(control);
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+#endif
+  
+  return i + find_escape_scalar(str + i, len - i);
+} // find_escape()
+
+/**
+ * @brief Append `msg` with control characters escaped: `\n`, `\r` and
+ *        `\xHH` for the rest.
+ * 
+ * @param find  find_escape(), or find_escape_scalar() to check and measure it
+ *              against. It's constant, so either way the call is direct.
+ */
+static inline void
+buffer_append_escaped(Buffer *buffer,
+                      const char *msg,
+                      size_t msg_len,
+                      size_t (*find)(const char *, size_t)) {
+  while (msg_len > 0) {
+    size_t clean = find(msg, msg_len);
+    
+    buffer_append(buffer, msg, clean);
+    if (clean == msg_len) {
+      break;
+    }
+    
+    unsigned char c = (unsigned char)msg[clean];
+    
+    if (c == '\n') {
+      buffer_append(buffer, "\\n", 2);
+    } else if (c == '\r') {
+      buffer_append(buffer, "\\r", 2);
+    } else {
+      char hex[4] = {
+        '\\', 'x', "0123456789abcdef"[c >> 4], "0123456789abcdef"[c & 0xf]
+      };
+      buffer_append(buffer, hex, 4);
+    }
+    
+    msg += clean + 1;
+    msg_len -= clean + 1;
+  }
+} // buffer_append_escaped()
+
+/**
+ * @brief Append a message body, escaping control characters if
+ *        log_set_escape() is on.
+ */
+static void
+buffer_append_body(Buffer *buffer, const char *msg, size_t msg_len) {
+  if (L.escape) {
+    buffer_append_escaped(buffer, msg, msg_len, find_escape);
+  } else {
+    buffer_append(buffer, msg, msg_len);
+  }
+}
+
+/**
+ * @brief Write out a buffer's contents in one go and flush.
+ */
+static void
+write_buffer(FILE *fp, const Buffer *buffer) {
+  fwrite(buffer->data, 1, buffer->len, fp);
+  fflush(fp);
+}
+
+/**
+ * @brief Render the timestamp strings the text outputs use.
+ */
+static void
+format_timestamp(Timestamp *ts, time_t t) {
+#ifdef LOG_HAVE_POSIX
+  // Reentrant, so it doesn't clobber (or get clobbered by) the
+  // application's localtime() results
+  struct tm tm;
+  struct tm *lt = localtime_r(&t, &tm);
+#else
+  struct tm *lt = localtime(&t);
+#endif
+  
+  ts->time[strftime(ts->time, sizeof(ts->time), "%H:%M:%S", lt)] = '\0';
+  ts->date_time[
+    strftime(ts->date_time, sizeof(ts->date_time), "%Y-%m-%d %H:%M:%S", lt)
+  ] = '\0';
+}
+
+/**
+ * @brief Read the real-time clock (the default).
+ */
+static void
+clock_realtime(struct timespec *now) {
+#ifdef LOG_HAVE_POSIX
+  clock_gettime(CLOCK_REALTIME, now);
+#else
+  now->tv_sec = time(NULL);
+  now->tv_nsec = 0;
+#endif
+}
+
+/**
+ * @brief Read the clock records are timestamped with (see log_set_clock()).
+ */
+static void
+read_clock(struct timespec *now) {
+  if (L.clock) {
+    L.clock(L.clock_udata, now);
+  } else {
+    clock_realtime(now);
+  }
+}
+
+/**
+ * @brief The rendered timestamp for second `sec`, only formatted (and
+ *        localtime()-d) when the second changes. Call with the lock held.
+ */
+static const Timestamp *
+timestamp_for(time_t sec) {
+  if (!L.ts_cache.valid || L.ts_cache.sec != sec) {
+    format_timestamp(&L.ts_cache.ts, sec);
+    L.ts_cache.sec = sec;
+    L.ts_cache.valid = true;
+  }
+  return &L.ts_cache.ts;
+}
+
+/**
+ * @brief Append a record in the stderr format -
+ *        `HH:MM:SS LEVEL file:line: message` (colored with LOG_USE_COLOR).
+ */
+static void
+append_stderr_line(Buffer *buffer,
+                   const Timestamp *ts,
+                   int level,
+                   const char *file,
+                   int line,
+                   const char *msg,
+                   size_t msg_len) {
+#ifdef LOG_USE_COLOR
+  buffer_printf(
+    buffer, "%s %s%-5s\x1b[0m \x1b[90m%s:%d:\x1b[0m ",
+    ts->time, log_level_to_color(level), log_level_to_name(level), file, line);
+#else
+  buffer_printf(  buffer,
+                  "%s %-5s %s:%d: ",
+                  ts->time,
+                  log_level_to_name(level),
+                  file,
+                  line );
+#endif
+  buffer_append_body(buffer, msg, msg_len);
+  buffer_append(buffer, "\n", 1);
+} // append_stderr_line()
+
+/**
+ * @brief Append a record in the file format -
+ *        `YYYY-mm-dd HH:MM:SS LEVEL file:line: message`.
+ */
+static void
+append_file_line(Buffer *buffer,
+                 const Timestamp *ts,
+                 int level,
+                 const char *file,
+                 int line,
+                 const char *msg,
+                 size_t msg_len) {
+  buffer_printf(
+    buffer, "%s %-5s %s:%d: ",
+    ts->date_time, log_level_to_name(level), file, line);
+  buffer_append_body(buffer, msg, msg_len);
+  buffer_append(buffer, "\n", 1);
+} // append_file_line()
+
+// Named Loggers
+// ---------------------------------------------------------------------------
+// 
+// Loggers are named with dot-separated paths ("db", "db.pool"), and inherit
+// their level from the nearest ancestor that has one set, or from L.level.
+// Rather than walk that on every record, each logger's effective level is
+// worked out whenever the configuration changes and stored in
+// L.loggers.levels, indexed by logger ID.
+// 
+
+static int
+logger_find(const char *name) {
+  for (int id = 0; id < L.loggers.count; id++) {
+    if (strcmp(L.loggers.names[id], name) == 0) {
+      return id;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Find or register a logger. Call with the lock held, and call
+ *        loggers_resolve() after.
+ * 
+ * @return int Its ID, or `-1` if the name's too long or the table's full.
+ */
+static int
+logger_add(const char *name) {
+  int id = logger_find(name);
+  
+  if (id >= 0) {
+    return id;
+  }
+  
+  if (L.loggers.count == LOG_MAX_LOGGERS ||
+      strlen(name) >= LOG_LOGGER_NAME_SIZE) {
+    return -1;
+  }
+  
+  id = L.loggers.count;
+  strcpy(L.loggers.names[id], name);
+  L.loggers.configured[id] = BAD_LEVEL;
+  L.loggers.levels[id] = L.level;
+  ATOMIC_STORE(&L.loggers.count, id + 1, RELEASE);
+  return id;
+} // logger_add()
+
+/**
+ * @brief Work out every logger's effective level. Call with the lock held.
+ */
+static void
+loggers_resolve(void) {
+  for (int id = 0; id < L.loggers.count; id++) {
+    char path[LOG_LOGGER_NAME_SIZE];
+    int level = L.level;
+    
+    strcpy(path, L.loggers.names[id]);
+    
+    for (;;) {
+      int ancestor = logger_find(path);
+      
+      if (ancestor >= 0 && L.loggers.configured[ancestor] != BAD_LEVEL) {
+        level = L.loggers.configured[ancestor];
+        break;
+      }
+      
+      char *dot = strrchr(path, '.');
+      if (dot == NULL) {
+        break;
+      }
+      *dot = '\0';
+    }
+    
+    L.loggers.levels[id] = level;
+  }
+} // loggers_resolve()
+
+// Buffered stderr
+// ---------------------------------------------------------------------------
+// 
+// A terminal wants each record as it happens, but when stderr is a pipe or
+// file flushing every record just costs a write per line. So in those cases
+// (see log_set_stderr_flush()) output is collected in L.err.pending and
+// written when it fills up, at LOG_ERROR and above, once its oldest line is
+// LOG_STDERR_MAX_AGE_MS old, on log_flush() and at exit. The age is checked
+// as records come in, and by the real-time drain thread while it's idle.
+// 
+
+#ifdef LOG_HAVE_VMSPLICE
+// When stderr is a pipe, L.err.pending is one of two page-aligned regions of
+// LOG_STDERR_BUF_SIZE bytes, and flushing hands its pages to the pipe with
+// vmsplice() rather than copying them in with write(). The pipe then refers
+// to those pages until the reader has read them, so flushing switches to the
+// other region - and only reuses that once the pipe holds fewer bytes than
+// were spliced since (FIONREAD), meaning the reader is past it. If it isn't,
+// the region is unmapped (the pipe keeps its pages) and mapped afresh.
+// 
+
+/**
+ * @brief Map a region (counted against the memory budget).
+ */
+static char *
+splice_map(void) {
+  if (!mem_reserve(LOG_STDERR_BUF_SIZE)) {
+    return NULL;
+  }
+  
+  void *pages = mmap(
+    NULL, LOG_STDERR_BUF_SIZE, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  
+  if (pages == MAP_FAILED) {
+    mem_release(LOG_STDERR_BUF_SIZE);
+    return NULL;
+  }
+  
+  return pages;
+}
+
+static void
+splice_unmap(char *region) {
+  if (region != NULL) {
+    munmap(region, LOG_STDERR_BUF_SIZE);
+    mem_release(LOG_STDERR_BUF_SIZE);
+  }
+}
+
+/**
+ * @brief Switch L.err.pending to the splicing regions.
+ */
+static bool
+splice_start(void) {
+  L.err.regions[0] = splice_map();
+  L.err.regions[1] = splice_map();
+  
+  if (L.err.regions[0] == NULL || L.err.regions[1] == NULL) {
+    splice_unmap(L.err.regions[0]);
+    splice_unmap(L.err.regions[1]);
+    return false;
+  }
+  
+  L.err.current = 0;
+  L.err.spliced = 0;
+  L.err.region_end[0] = L.err.region_end[1] = 0;
+  buffer_free(&L.err.pending);
+  buffer_init(&L.err.pending, L.err.regions[0], LOG_STDERR_BUF_SIZE);
+  
+  return true;
+}
+
+/**
+ * @brief Go back to an ordinary buffer for L.err.pending (which must be
+ *        empty).
+ */
+static void
+splice_stop(void) {
+  splice_unmap(L.err.regions[0]);
+  splice_unmap(L.err.regions[1]);
+  buffer_init(&L.err.pending, NULL, 0);
+  L.err.splice = false;
+}
+
+/**
+ * @brief Hand the pending output to the stderr pipe and switch regions. If
+ *        the pipe won't take it that way, write() the rest and go back to an
+ *        ordinary buffer.
+ */
+static void
+splice_flush(void) {
+  struct iovec iov = { L.err.pending.data, L.err.pending.len };
+  int fd = fileno(stderr);
+  
+  fflush(stderr);
+  
+  while (iov.iov_len > 0) {
+    ssize_t n = syscall(SYS_vmsplice, fd, &iov, 1UL, 0U);
+    
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    
+    if (n <= 0) {
+      // Not a pipe after all, or no vmsplice() here
+      fwrite(iov.iov_base, 1, iov.iov_len, stderr);
+      fflush(stderr);
+      splice_stop();
+      return;
+    }
+    
+    iov.iov_base = (char *)iov.iov_base + n;
+    iov.iov_len -= (size_t)n;
+    L.err.spliced += (uint64_t)n;
+  }
+  
+  L.err.region_end[L.err.current] = L.err.spliced;
+  L.err.current ^= 1;
+  
+  // Has the reader got past what was spliced from the next region? Other
+  // writers to the pipe only make it look like less has been read - unless
+  // there's more queued than was ever spliced, and then there's no telling.
+  int queued;
+  int next = L.err.current;
+  
+  if (ioctl(fd, FIONREAD, &queued) != 0 ||
+      queued < 0 ||
+      (uint64_t)queued > L.err.spliced ||
+      L.err.spliced - (uint64_t)queued < L.err.region_end[next]) {
+    splice_unmap(L.err.regions[next]);
+    L.err.regions[next] = splice_map();
+    
+    if (L.err.regions[next] == NULL) {
+      splice_stop();
+      return;
+    }
+  }
+  
+  buffer_init(&L.err.pending, L.err.regions[next], LOG_STDERR_BUF_SIZE);
+} // splice_flush()
+
+#endif // #ifdef LOG_HAVE_VMSPLICE
+
+/**
+ * @brief Write out buffered stderr output. Call with the lock held.
+ */
+static void
+stderr_flush(void) {
+  if (L.err.pending.len == 0) {
+    return;
+  }
+  
+#ifdef LOG_HAVE_VMSPLICE
+  if (L.err.splice) {
+    splice_flush();
+    return;
+  }
+#endif
+  
+  write_buffer(stderr, &L.err.pending);
+  L.err.pending.len = 0;
+}
+
+/**
+ * @brief Write out buffered stderr output if it's been held back
+ *        LOG_STDERR_MAX_AGE_MS. Call with the lock held.
+ */
+static void
+stderr_flush_stale(void) {
+  if (L.err.pending.len > 0 &&
+      monotonic_ms() - L.err.pending_since_ms >= LOG_STDERR_MAX_AGE_MS) {
+    stderr_flush();
+  }
+}
+
+static void
+stderr_at_exit(void) {
+  log_flush();
+}
+
+/**
+ * @brief Work out whether to buffer stderr, under LOG_FLUSH_AUTO from what
+ *        it's writing to.
+ */
+static void
+stderr_resolve(void) {
+  bool buffered = L.err.policy == LOG_FLUSH_BUFFERED;
+  
+#ifdef LOG_HAVE_POSIX
+  if (L.err.policy == LOG_FLUSH_AUTO) {
+    int fd = fileno(stderr);
+    struct stat st;
+    
+    buffered =  !isatty(fd) &&
+                fstat(fd, &st) == 0 &&
+                ( S_ISFIFO(st.st_mode) ||
+                  S_ISREG(st.st_mode) ||
+                  S_ISSOCK(st.st_mode) );
+  }
+#endif
+  
+#ifdef LOG_HAVE_VMSPLICE
+  {
+    struct stat st;
+    bool pipe =   buffered &&
+                  fstat(fileno(stderr), &st) == 0 &&
+                  S_ISFIFO(st.st_mode);
+    
+    if (pipe && !L.err.splice) {
+      L.err.splice = splice_start();
+    } else if (!pipe && L.err.splice) {
+      splice_stop();
+    }
+  }
+#endif
+  
+  if (buffered && !L.err.at_exit_registered) {
+    atexit(stderr_at_exit);
+    L.err.at_exit_registered = true;
+  }
+  
+  L.err.buffered = buffered;
+  L.err.resolved = true;
+} // stderr_resolve()
+
+/**
+ * @brief Write records at `level` (already formatted) to stderr, or buffer
+ *        them. Call with the lock held.
+ */
+static void
+write_stderr_buffer(const Buffer *buffer, int level) {
+  if (!L.err.resolved) {
+    stderr_resolve();
+  }
+  
+  if (!L.err.buffered) {
+    write_buffer(stderr, buffer);
+    return;
+  }
+  
+  if (L.err.pending.len + buffer->len > LOG_STDERR_BUF_SIZE) {
+    stderr_flush();
+  }
+  
+  if (buffer->len > LOG_STDERR_BUF_SIZE ||
+      !buffer_reserve(&L.err.pending, buffer->len)) {
+    stderr_flush();
+    write_buffer(stderr, buffer);
+    return;
+  }
+  
+  if (L.err.pending.len == 0) {
+    L.err.pending_since_ms = monotonic_ms();
+  }
+  
+  buffer_append(&L.err.pending, buffer->data, buffer->len);
+  
+  if (level >= LOG_ERROR) {
+    stderr_flush();
+  } else {
+    stderr_flush_stale();
+  }
+} // write_stderr_buffer()
+
+// Stall Watchdog
+// ---------------------------------------------------------------------------
+// 
+// There's no watchdog thread. With a stall timeout set (see
+// log_set_stall_timeout()) the file output is written outside the lock, so a
+// write that hangs only holds up the thread doing it. A thread that finds no
+// write in progress becomes the writer: it queues its line, and once it has
+// released the lock writes the queue out - along with whatever other threads
+// queue meanwhile - until it's empty. Threads that find the write in progress
+// has been going longer than the timeout send their line to the fallback
+// stream (or drop it) rather than queue it. Either way stderr, the shared
+// memory ring, MessagePack and OTLP carry on as normal.
+// 
+
+/**
+ * @brief Is the write in progress past the timeout? Reports the start of a
+ *        stall to stderr, after any records buffered for it. Called with the
+ *        lock held.
+ */
+static bool
+stall_detected(void) {
+#ifdef LOG_HAVE_POSIX
+  if (  L.stall.write_start_ms == 0 ||
+        monotonic_ms() - L.stall.write_start_ms < L.stall.timeout_ms ) {
+    return false;
+  }
+  
+  if (!L.stall.stalled && !L.fp_is_stderr) {
+    // Records still buffered for stderr came first
+    stderr_flush();
+    fprintf(
+      stderr, "log.c: log file write stalled for over %d ms; %s records\n",
+      L.stall.timeout_ms, L.stall.fallback ? "diverting" : "dropping");
+    fflush(stderr);
+  }
+  L.stall.stalled = true;
+  
+  return true;
+#else
+  return false;
+#endif
+} // stall_detected()
+
+/**
+ * @brief Write to the file output. With a stall timeout set, queue for the
+ *        writer instead, or divert if it's stuck. Called with the lock held.
+ * 
+ * @return bool Whether the caller is now the writer, and has to call
+ *              write_file_queue() once it has released the lock.
+ */
+static bool
+write_file_buffer(const Buffer *buffer) {
+#ifdef LOG_HAVE_POSIX
+  if (L.stall.timeout_ms > 0) {
+    if (stall_detected()) {
+      L.stall.count++;
+      if (L.stall.fallback != NULL) {
+        write_buffer(L.stall.fallback, buffer);
+      }
+      return false;
+    }
+    
+    if (!buffer_reserve(&L.stall.queue, buffer->len)) {
+      ATOMIC_ADD(&L.mem.dropped, 1, RELAXED);
+      return false;
+    }
+    buffer_append(&L.stall.queue, buffer->data, buffer->len);
+    
+    if (L.stall.writing) {
+      return false;
+    }
+    L.stall.writing = true;
+    return true;
+  }
+#endif
+  write_buffer(L.fp, buffer);
+  return false;
+} // write_file_buffer()
+
+/**
+ * @brief Write the queue to the file output until it's empty, taking the
+ *        lock only to swap buffers. Called without the lock, by the thread
+ *        write_file_buffer() made the writer.
+ */
+static void
+write_file_queue(void) {
+#ifdef LOG_HAVE_POSIX
+  lock();
+  
+  while (L.stall.queue.len > 0 && L.fp != NULL) {
+    Buffer swap = L.stall.out;
+    FILE *fp = L.fp;
+    
+    L.stall.out = L.stall.queue;
+    L.stall.queue = swap;
+    L.stall.queue.len = 0;
+    L.stall.write_start_ms = monotonic_ms();
+    unlock();
+    
+    write_buffer(fp, &L.stall.out);
+    
+    lock();
+    L.stall.write_start_ms = 0;
+    L.stall.out.len = 0;
+    
+    if (L.stall.stalled) {
+      if (!L.fp_is_stderr) {
+        stderr_flush();
+        fprintf(
+          stderr, "log.c: log file writes resumed; %lu records %s\n",
+          L.stall.count, L.stall.fallback ? "diverted" : "dropped");
+        fflush(stderr);
+      }
+      L.stall.stalled = false;
+      L.stall.count = 0;
+    }
+  }
+  
+  // Don't hang on to a big queue from a slow stretch
+  if (L.stall.out.cap > LOG_BATCH_KEEP_SIZE) {
+    buffer_free(&L.stall.out);
+  }
+  if (L.stall.queue.cap > LOG_BATCH_KEEP_SIZE) {
+    buffer_free(&L.stall.queue);
+  }
+  L.stall.queue.len = 0;
+  L.stall.writing = false;
+  
+  unlock();
+#endif
+} // write_file_queue()
+
+/**
+ * @brief Wait for the writer to finish, so the file output can be switched.
+ *        Called with the lock held, which is released while waiting.
+ */
+static void
+wait_file_queue(void) {
+#ifdef LOG_HAVE_POSIX
+  struct timespec pause = { 0, 1000000 };
+  
+  while (L.stall.writing) {
+    unlock();
+    nanosleep(&pause, NULL);
+    lock();
+  }
+#endif
+}
+
+// Bloom Filter Index
+// ---------------------------------------------------------------------------
+// 
+// When the file output is indexed (see log_set_fp_indexed()) the tokens in
+// each record written to it - runs of letters, digits and `_-.:@`, or just
+// those following the configured keys - are added to a Bloom filter, which is
+// saved next to the segment for log_bloom_check() (and tools/loggrep.c) to
+// rule segments out without reading them.
+// 
+// It's only saved now and then (see log_set_fp_indexed()), so the header
+// records how much of the segment it covers; what's been written since has
+// to be read. A process that picks up an existing segment indexes whatever
+// the last one wrote after its final save before adding to the filter.
+// 
+
+static bool
+bloom_is_token_char(unsigned char c) {
+  return  (c >= 'a' && c <= 'z') ||
+          (c >= 'A' && c <= 'Z') ||
+          (c >= '0' && c <= '9') ||
+          c == '_' || c == '-' || c == '.' || c == ':' || c == '@';
+}
+
+/**
+ * @brief Length of the token at the start of `str`, without trailing
+ *        punctuation (`id=abc123.` is `abc123`).
+ */
+static size_t
+bloom_token_len(const char *str, size_t len) {
+  size_t n = 0;
+  
+  while (n < len && bloom_is_token_char((unsigned char)str[n])) {
+    n++;
+  }
+  while (n > 0 && (str[n - 1] == '.' || str[n - 1] == ':' ||
+                   str[n - 1] == '-')) {
+    n--;
+  }
+  
+  return n;
+}
+
+/**
+ * @brief FNV-1a.
+ */
+static uint64_t
+bloom_hash(const char *token, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)token[i]) * 0x100000001b3ULL;
+  }
+  
+  return hash;
+}
+
+/**
+ * @brief The bit for hash number `i` of a token, by double hashing: the
+ *        second hash is the first run through a mixer, made odd so every
+ *        step visits a different bit.
+ */
+static uint64_t
+bloom_bit(uint64_t hash, int i, uint64_t num_bits) {
+  uint64_t step = hash ^ (hash >> 31);
+  step *= 0x7fb5d329728ea185ULL;
+  step ^= step >> 27;
+  
+  return (hash + (uint64_t)i * (step | 1)) & (num_bits - 1);
+}
+
+static bool
+bloom_add_token(const char *token, size_t len, void *udata) {
+  uint64_t hash = bloom_hash(token, len);
+  
+  (void)udata;
+  for (int i = 0; i < BLOOM_HASHES; i++) {
+    uint64_t bit = bloom_bit(hash, i, LOG_BLOOM_BITS);
+    L.bloom.bits[bit / 8] |= (unsigned char)(1 << (bit % 8));
+  }
+  
+  L.bloom.dirty = true;
+  return true;
+}
+
+/**
+ * @brief Call `fn` on each token in `msg` that's indexed: all of them, or
+ *        with keys, each one directly following a key.
+ * 
+ * @return bool `false` if `fn` stopped it.
+ */
+static bool
+bloom_each_token(const char *msg,
+                 size_t len,
+                 int num_keys,
+                 const char (*keys)[BLOOM_KEY_SIZE],
+                 BloomTokenFn fn,
+                 void *udata) {
+  if (num_keys == 0) {
+    size_t i = 0;
+    
+    while (i < len) {
+      size_t n = bloom_token_len(msg + i, len - i);
+      
+      if (n > 0 && !fn(msg + i, n, udata)) {
+        return false;
+      }
+      
+      // Skip the rest of the token (and any trimmed punctuation), or the
+      // character that isn't one
+      while (i < len && bloom_is_token_char((unsigned char)msg[i])) {
+        i++;
+      }
+      if (n == 0) {
+        i++;
+      }
+    }
+    return true;
+  }
+  
+  for (int k = 0; k < num_keys; k++) {
+    const char *key = keys[k];
+    size_t key_len = strlen(key);
+    
+    for (size_t i = 0; i + key_len <= len; i++) {
+      if (msg[i] == key[0] && memcmp(msg + i, key, key_len) == 0) {
+        size_t n = bloom_token_len(msg + i + key_len, len - i - key_len);
+        
+        if (n > 0 && !fn(msg + i + key_len, n, udata)) {
+          return false;
+        }
+        i += key_len - 1;
+      }
+    }
+  }
+  return true;
+} // bloom_each_token()
+
+/**
+ * @brief Add the tokens in a message to the filter. Call with the lock held.
+ */
+static void
+bloom_add_message(const char *msg, size_t len) {
+  bloom_each_token(
+    msg, len, L.bloom.num_keys, (const char (*)[BLOOM_KEY_SIZE])L.bloom.keys,
+    bloom_add_token, NULL);
+}
+
+/**
+ * @brief Add the tokens in `path` from byte `from` on - what was written
+ *        after the filter covering the rest was saved. Call with the lock
+ *        held.
+ * 
+ * Read a line at a time, so keys stay with their values (the timestamps and
+ * such get added too, which only costs some accuracy).
+ */
+static void
+bloom_add_file(const char *path, uint64_t from) {
+  FILE *fp = fopen(path, "rb");
+  char chunk[4096];
+  size_t len = 0;
+  
+  if (fp == NULL) {
+    return;
+  }
+  if (fseek(fp, (long)from, SEEK_SET) != 0) {
+    fclose(fp);
+    return;
+  }
+  
+  for (;;) {
+    size_t n = fread(chunk + len, 1, sizeof(chunk) - len, fp);
+    size_t cut;
+    
+    len += n;
+    if (n == 0) {
+      bloom_add_message(chunk, len);
+      break;
+    }
+    
+    // Up to the last whole line, or for a line longer than the chunk, the
+    // last character that can't be in a token
+    for (cut = len; cut > 0 && chunk[cut - 1] != '\n'; cut--) {
+    }
+    if (cut == 0) {
+      for (cut = len;
+           cut > 0 && bloom_is_token_char((unsigned char)chunk[cut - 1]);
+           cut--) {
+      }
+    }
+    if (cut == 0) {
+      cut = len;
+    }
+    
+    bloom_add_message(chunk, cut);
+    memmove(chunk, chunk + cut, len - cut);
+    len -= cut;
+  }
+  
+  fclose(fp);
+} // bloom_add_file()
+
+static void
+bloom_put_le(unsigned char *p, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    p[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+static uint64_t
+bloom_get_le(const unsigned char *p, int bytes) {
+  uint64_t value = 0;
+  
+  for (int i = bytes - 1; i >= 0; i--) {
+    value = (value << 8) | p[i];
+  }
+  
+  return value;
+}
+
+/**
+ * @brief Read a filter file's header.
+ * 
+ * @return bool `false` if it isn't one.
+ */
+static bool
+bloom_read_header(FILE *fp, BloomHeader *header) {
+  unsigned char data[BLOOM_HEADER_SIZE];
+  
+  if (fread(data, 1, sizeof(data), fp) != sizeof(data) ||
+      memcmp(data, BLOOM_MAGIC, 8) != 0) {
+    return false;
+  }
+  
+  header->num_hashes = (uint32_t)bloom_get_le(data + 8, 4);
+  header->num_bits = bloom_get_le(data + 12, 8);
+  header->covered = bloom_get_le(data + 20, 8);
+  header->num_keys = (int)bloom_get_le(data + 28, 4);
+  memcpy(header->keys, data + 32, sizeof(header->keys));
+  
+  for (int k = 0; k < BLOOM_MAX_KEYS; k++) {
+    header->keys[k][BLOOM_KEY_SIZE - 1] = '\0';
+  }
+  
+  return  header->num_bits >= 8 &&
+          (header->num_bits & (header->num_bits - 1)) == 0 &&
+          header->num_hashes > 0 &&
+          header->num_keys >= 0 &&
+          header->num_keys <= BLOOM_MAX_KEYS;
+} // bloom_read_header()
+
+/**
+ * @brief Is `token` (a whole one) in the filter? Reads just the bits needed
+ *        from `fp`, which has had its header read into `header`.
+ * 
+ * @return int `0` if not, `1` if it may be, `-1` if it couldn't be read.
+ */
+static int
+bloom_lookup(FILE *fp, const BloomHeader *header, const char *token) {
+  uint64_t hash = bloom_hash(token, strlen(token));
+  
+  for (uint32_t i = 0; i < header->num_hashes; i++) {
+    uint64_t bit = bloom_bit(hash, (int)i, header->num_bits);
+    int byte;
+    
+    if (fseek(fp, (long)(BLOOM_HEADER_SIZE + bit / 8), SEEK_SET) != 0 ||
+        (byte = fgetc(fp)) == EOF) {
+      return -1;
+    }
+    if (!(byte & (1 << (bit % 8)))) {
+      return 0;
+    }
+  }
+  
+  return 1;
+} // bloom_lookup()
+
+/**
+ * @brief How many bytes have been written to the file output (so far as the
+ *        filter's concerned - the tokens of every record are added before
+ *        it's written).
+ */
+static uint64_t
+bloom_segment_size(void) {
+#ifdef LOG_HAVE_POSIX
+  struct stat st;
+  
+  return fstat(fileno(L.fp), &st) == 0 ? (uint64_t)st.st_size : 0;
+#else
+  long size = ftell(L.fp);
+  
+  return size > 0 ? (uint64_t)size : 0;
+#endif
+}
+
+/**
+ * @brief Pick up the filter already saved for `segment`, if it was made the
+ *        same way, so a restarted process appending to the segment adds to
+ *        it rather than replacing it. Either way, index what the filter
+ *        doesn't cover.
+ */
+static void
+bloom_load(const char *segment) {
+  FILE *fp = fopen(L.bloom.path, "rb");
+  BloomHeader header;
+  bool same = false;
+  
+  if (fp != NULL &&
+      bloom_read_header(fp, &header) &&
+      header.num_hashes == BLOOM_HASHES &&
+      header.num_bits == LOG_BLOOM_BITS &&
+      header.num_keys == L.bloom.num_keys) {
+    same = true;
+    for (int k = 0; k < header.num_keys; k++) {
+      same = same && strcmp(header.keys[k], L.bloom.keys[k]) == 0;
+    }
+  }
+  
+  if (same &&
+      fread(L.bloom.bits, 1, LOG_BLOOM_BITS / 8, fp) == LOG_BLOOM_BITS / 8) {
+    L.bloom.covered = header.covered;
+  } else {
+    memset(L.bloom.bits, 0, LOG_BLOOM_BITS / 8);
+    L.bloom.covered = 0;
+  }
+  
+  if (fp != NULL) {
+    fclose(fp);
+  }
+  
+  if (bloom_segment_size() > L.bloom.covered) {
+    bloom_add_file(segment, L.bloom.covered);
+  }
+} // bloom_load()
+
+/**
+ * @brief Write the filter out, if it's changed. Call with the lock held.
+ */
+static void
+bloom_save(void) {
+  if (L.bloom.bits == NULL) {
+    return;
+  }
+  
+  uint64_t covered = bloom_segment_size();
+  
+  if (!L.bloom.dirty && covered == L.bloom.covered) {
+    return;
+  }
+  
+  FILE *fp = fopen(L.bloom.tmp_path, "wb");
+  unsigned char header[BLOOM_HEADER_SIZE];
+  bool ok;
+  
+  if (fp == NULL) {
+    return;
+  }
+  
+  memset(header, 0, sizeof(header));
+  memcpy(header, BLOOM_MAGIC, 8);
+  bloom_put_le(header + 8, BLOOM_HASHES, 4);
+  bloom_put_le(header + 12, LOG_BLOOM_BITS, 8);
+  bloom_put_le(header + 20, covered, 8);
+  bloom_put_le(header + 28, (uint64_t)L.bloom.num_keys, 4);
+  memcpy(header + 32, L.bloom.keys, sizeof(L.bloom.keys));
+  
+  ok =  fwrite(header, 1, sizeof(header), fp) == sizeof(header) &&
+        fwrite(L.bloom.bits, 1, LOG_BLOOM_BITS / 8, fp) == LOG_BLOOM_BITS / 8;
+  ok = fclose(fp) == 0 && ok;
+  
+#ifndef LOG_HAVE_POSIX
+  // rename() won't replace a file everywhere
+  remove(L.bloom.path);
+#endif
+  
+  if (ok && rename(L.bloom.tmp_path, L.bloom.path) == 0) {
+    L.bloom.dirty = false;
+    L.bloom.covered = covered;
+  } else {
+    remove(L.bloom.tmp_path);
+  }
+} // bloom_save()
+
+/**
+ * @brief Save the filter and stop indexing. Call with the lock held.
+ */
+static void
+bloom_stop(void) {
+  if (L.bloom.bits == NULL) {
+    return;
+  }
+  
+  bloom_save();
+  mem_free(L.bloom.bits);
+  mem_free(L.bloom.path);
+  L.bloom.bits = NULL;
+  L.bloom.path = NULL;
+  L.bloom.tmp_path = NULL;
+}
+
+static void
+bloom_at_exit(void) {
+  lock();
+  bloom_save();
+  unlock();
+}
+
+#ifdef LOG_USE_MSGPACK
+// MessagePack Encoding
+// ---------------------------------------------------------------------------
+// 
+// Just the handful of types a record needs. Each mp_put_*() writes at `p`
+// and returns the position after what it wrote; callers make sure there's
+// room (see msgpack_record_max_size()).
+// 
+
+static unsigned char *
+mp_put_be(unsigned char *p, uint64_t value, int bytes) {
+  for (int i = bytes - 1; i >= 0; i--) {
+    *p++ = (unsigned char)(value >> (8 * i));
+  }
+  return p;
+}
+
+static unsigned char *
+mp_put_int(unsigned char *p, int64_t value) {
+  if (value >= 0 && value <= 0x7f) {
+    *p++ = (unsigned char)value;
+  } else if (value < 0 && value >= -32) {
+    *p++ = (unsigned char)(0xe0 | (value + 32));
+  } else if (value >= INT32_MIN && value <= INT32_MAX) {
+    *p++ = 0xd2;
+    p = mp_put_be(p, (uint32_t)(int32_t)value, 4);
+  } else {
+    *p++ = 0xd3;
+    p = mp_put_be(p, (uint64_t)value, 8);
+  }
+  return p;
+}
+
+static unsigned char *
+mp_put_str(unsigned char *p, const char *str, size_t len) {
+  if (len < 32) {
+    *p++ = (unsigned char)(0xa0 | len);
+  } else if (len <= 0xff) {
+    *p++ = 0xd9;
+    p = mp_put_be(p, len, 1);
+  } else if (len <= 0xffff) {
+    *p++ = 0xda;
+    p = mp_put_be(p, len, 2);
+  } else {
+    *p++ = 0xdb;
+    p = mp_put_be(p, len, 4);
+  }
+  memcpy(p, str, len);
+  return p + len;
+}
+
+/**
+ * @brief Write a timestamp extension - the 64-bit form when the seconds fit
+ *        in 34 unsigned bits (until the year 2514), otherwise the 96-bit form.
+ */
+static unsigned char *
+mp_put_time(unsigned char *p, int64_t sec, long nsec) {
+  if (sec >= 0 && sec < ((int64_t)1 << 34)) {
+    *p++ = 0xd7;
+    *p++ = (unsigned char)MSGPACK_EXT_TIMESTAMP;
+    p = mp_put_be(p, ((uint64_t)nsec << 34) | (uint64_t)sec, 8);
+  } else {
+    *p++ = 0xc7;
+    *p++ = 12;
+    *p++ = (unsigned char)MSGPACK_EXT_TIMESTAMP;
+    p = mp_put_be(p, (uint32_t)nsec, 4);
+    p = mp_put_be(p, (uint64_t)sec, 8);
+  }
+  return p;
+}
+
+/**
+ * @brief Upper bound on the encoded size of a record, *including* the 4 byte
+ *        length prefix.
+ */
+static size_t
+msgpack_record_max_size(size_t file_len, size_t msg_len) {
+  // prefix + map header + 5 keys (each <= 5 bytes) + time (<= 15) +
+  // level (<= 9) + line (<= 9) + 2 string headers (<= 5 each)
+  return 4 + 1 + 25 + 15 + 9 + 9 + 10 + file_len + msg_len;
+}
+
+/**
+ * @brief Upper bound on the encoded size of a string definition, *including*
+ *        the 4 byte length prefix.
+ */
+static size_t
+msgpack_def_max_size(size_t str_len) {
+  // prefix + map header + 2 keys (4 bytes each) + id (<= 9) + string header
+  return 4 + 1 + 8 + 9 + 5 + str_len;
+}
+
+/**
+ * @brief FNV-1a hash of the `len` bytes at `str`.
+ */
+static uint32_t
+msgpack_hash(const char *str, size_t len) {
+  uint32_t hash = 2166136261u;
+  
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * @brief Find the intern ID for a file name, assigning the next one if it's
+ *        new.
+ * 
+ * Keyed by address and a hash of the contents. The log_*() macros pass
+ * `__FILE__` literals, so the address alone almost always identifies the
+ * name, but a library that's unloaded and another loaded in its place can
+ * reuse it for a different one. When the address matches but the hash
+ * doesn't the ID is defined again with the new name.
+ * 
+ * @param is_new Set `true` when the ID was just assigned (or reassigned),
+ *               meaning the string needs defining in the stream before it's
+ *               referenced.
+ * 
+ * @return int64_t The ID, or `-1` when the table is full.
+ */
+static int64_t
+msgpack_intern(const char *str, size_t len, bool *is_new) {
+  size_t mask = LOG_MSGPACK_INTERN_SLOTS - 1;
+  size_t i = (size_t)(((uintptr_t)str >> 3) * 2654435761u) & mask;
+  uint32_t hash = msgpack_hash(str, len);
+  
+  while (L.msgpack_interned[i].str != NULL) {
+    if (L.msgpack_interned[i].str == str) {
+      *is_new = L.msgpack_interned[i].hash != hash;
+      L.msgpack_interned[i].hash = hash;
+      return L.msgpack_interned[i].id;
+    }
+    i = (i + 1) & mask;
+  }
+  
+  if (L.msgpack_num_interned >= LOG_MSGPACK_INTERN_SLOTS / 4 * 3) {
+    return -1;
+  }
+  
+  L.msgpack_interned[i].str = str;
+  L.msgpack_interned[i].hash = hash;
+  L.msgpack_interned[i].id = L.msgpack_num_interned++;
+  *is_new = true;
+  return L.msgpack_interned[i].id;
+} // msgpack_intern()
+
+/**
+ * @brief Forget all interned strings, for when they need defining again
+ *        (a new stream).
+ */
+static void
+msgpack_intern_reset(void) {
+  memset(L.msgpack_interned, 0, sizeof(L.msgpack_interned));
+  L.msgpack_num_interned = 0;
+}
+
+/**
+ * @brief Fill in the length prefix of the frame starting at `frame` and
+ *        ending at `end`.
+ */
+static void
+msgpack_end_frame(unsigned char *frame, unsigned char *end) {
+  mp_put_be(frame, (uint64_t)(end - frame - 4), 4);
+}
+
+/**
+ * @brief Write a record as a length-prefixed MessagePack map (without
+ *        flushing).
+ * 
+ * The frame is a 4 byte big-endian payload length followed by a map of
+ * 
+ * -   `"t"`    - timestamp (extension type -1)
+ * -   `"lvl"`  - level integer
+ * -   `"file"` - source file string, or intern ID integer
+ * -   `"line"` - source line integer
+ * -   `"msg"`  - formatted message string
+ * 
+ * When interning is on (log_set_msgpack_intern()) the first record from a
+ * file is preceded by a definition frame, a map of `"def"` (the ID) and
+ * `"str"` (the file name), and that record and every later one from the file
+ * carry the ID.
+ * 
+ * Readers should skip keys they don't know.
+ */
+static void
+write_msgpack_record(FILE *fp,
+                     time_t sec,
+                     long nsec,
+                     int level,
+                     const char *file,
+                     int line,
+                     const char *msg,
+                     size_t msg_len) {
+  unsigned char stack_buf[LOG_MSG_BUF_SIZE];
+  unsigned char *buf = stack_buf;
+  size_t file_len = strlen(file);
+  size_t max_size = msgpack_def_max_size(file_len) +
+                    msgpack_record_max_size(file_len, msg_len);
+  int64_t file_id = -1;
+  bool is_new = false;
+  
+  if (max_size > sizeof(stack_buf)) {
+    buf = mem_alloc(max_size);
+    if (buf == NULL) {
+      return;
+    }
+  }
+  
+  // Only once the frame is sure to be written, or a new ID could go
+  // undefined
+  if (L.msgpack_intern) {
+    file_id = msgpack_intern(file, file_len, &is_new);
+  }
+  
+  unsigned char *frame = buf;
+  unsigned char *p = frame + 4;
+  
+  if (is_new) {
+    *p++ = 0x80 | 2;
+    p = mp_put_str(p, "def", 3);
+    p = mp_put_int(p, file_id);
+    p = mp_put_str(p, "str", 3);
+    p = mp_put_str(p, file, file_len);
+    msgpack_end_frame(frame, p);
+    
+    frame = p;
+    p = frame + 4;
+  }
+  
+  *p++ = 0x80 | 5;
+  p = mp_put_str(p, "t", 1);
+  p = mp_put_time(p, (int64_t)sec, nsec);
+  p = mp_put_str(p, "lvl", 3);
+  p = mp_put_int(p, level);
+  p = mp_put_str(p, "file", 4);
+  if (file_id >= 0) {
+    p = mp_put_int(p, file_id);
+  } else {
+    p = mp_put_str(p, file, file_len);
+  }
+  p = mp_put_str(p, "line", 4);
+  p = mp_put_int(p, line);
+  p = mp_put_str(p, "msg", 3);
+  p = mp_put_str(p, msg, msg_len);
+  msgpack_end_frame(frame, p);
+  
+  fwrite(buf, 1, (size_t)(p - buf), fp);
+  
+  if (buf != stack_buf) {
+    mem_free(buf);
+  }
+} // write_msgpack_record()
+
+#endif // #ifdef LOG_USE_MSGPACK ********************************************
+
+
+#ifdef LOG_USE_OTLP
+// OTLP Export
+// ---------------------------------------------------------------------------
+// 
+// Records are encoded as OpenTelemetry `LogRecord` protobuf messages as they
+// arrive and appended to a pending buffer. When it's big or old enough the
+// buffer is wrapped in an `ExportLogsServiceRequest` and POST-ed to the
+// collector's OTLP/HTTP endpoint (`/v1/logs`).
+// 
+// All the fields used have numbers under 16, so every tag is one byte.
+// 
+
+static size_t
+pb_varint_size(uint64_t value) {
+  size_t size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    size++;
+  }
+  return size;
+}
+
+/**
+ * @brief Size of a length-delimited field with a `len` byte payload.
+ */
+static size_t
+pb_field_size(size_t len) {
+  return 1 + pb_varint_size(len) + len;
+}
+
+static void
+pb_put_varint(Buffer *buffer, uint64_t value) {
+  char bytes[10];
+  size_t n = 0;
+  
+  while (value >= 0x80) {
+    bytes[n++] = (char)(value | 0x80);
+    value >>= 7;
+  }
+  bytes[n++] = (char)value;
+  buffer_append(buffer, bytes, n);
+}
+
+static void
+pb_put_tag(Buffer *buffer, int field, int wire_type) {
+  char tag = (char)((field << 3) | wire_type);
+  buffer_append(buffer, &tag, 1);
+}
+
+static void
+pb_put_fixed64(Buffer *buffer, int field, uint64_t value) {
+  char bytes[8];
+  
+  for (int i = 0; i < 8; i++) {
+    bytes[i] = (char)(value >> (8 * i));
+  }
+  pb_put_tag(buffer, field, 1);
+  buffer_append(buffer, bytes, 8);
+}
+
+/**
+ * @brief Start a length-delimited field whose `len` byte payload the caller
+ *        appends next.
+ */
+static void
+pb_put_len(Buffer *buffer, int field, size_t len) {
+  pb_put_tag(buffer, field, 2);
+  pb_put_varint(buffer, len);
+}
+
+static void
+pb_put_bytes(Buffer *buffer, int field, const char *data, size_t len) {
+  pb_put_len(buffer, field, len);
+  buffer_append(buffer, data, len);
+}
+
+/**
+ * @brief OpenTelemetry `SeverityNumber` for a level (the first of each
+ *        range - TRACE is 1, DEBUG 5, ... FATAL 21).
+ */
+static int
+otlp_severity(int level) {
+  return 1 + 4 * (level - LOG_TRACE);
+}
+
+/**
+ * @brief Drop the oldest pending record. Each one is a `log_records` field
+ *        (tag 0x12, varint length, payload), so its extent can be read off
+ *        the front of the buffer.
+ */
+static void
+otlp_drop_oldest(void) {
+  const unsigned char *p = (const unsigned char *)L.otlp.pending.data + 1;
+  const unsigned char *end =
+    (const unsigned char *)L.otlp.pending.data + L.otlp.pending.len;
+  uint64_t len = 0;
+  int shift = 0;
+  
+  while (p < end && (*p & 0x80)) {
+    len |= (uint64_t)(*p++ & 0x7f) << shift;
+    shift += 7;
+  }
+  len |= (uint64_t)(*p++ & 0x7f) << shift;
+  
+  size_t size = (size_t)((p + len) - (const unsigned char *)L.otlp.pending.data);
+  
+  memmove(
+    L.otlp.pending.data, L.otlp.pending.data + size,
+    L.otlp.pending.len - size);
+  L.otlp.pending.len -= size;
+  L.otlp.pending_count--;
+  L.otlp.dropped++;
+} // otlp_drop_oldest()
+
+/**
+ * @brief Discard everything pending (counting it as dropped).
+ */
+static void
+otlp_drop_all(void) {
+  L.otlp.dropped += L.otlp.pending_count;
+  L.otlp.pending.len = 0;
+  L.otlp.pending_count = 0;
+}
+
+/**
+ * @brief Send all of `iov` on a socket, handling partial writes.
+ */
+static bool
+send_all(int fd, struct iovec *iov, int iov_count) {
+  struct msghdr msg;
+  int flags = 0;
+  
+#ifdef MSG_NOSIGNAL
+  flags = MSG_NOSIGNAL;
+#endif
+  
+  while (iov_count > 0) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov_count;
+    
+    ssize_t sent = sendmsg(fd, &msg, flags);
+    
+    if (sent < 0) {
+      return false;
+    }
+    
+    while (iov_count > 0 && (size_t)sent >= iov->iov_len) {
+      sent -= iov->iov_len;
+      iov++;
+      iov_count--;
+    }
+    if (iov_count > 0) {
+      iov->iov_base = (char *)iov->iov_base + sent;
+      iov->iov_len -= sent;
+    }
+  }
+  return true;
+} // send_all()
+
+/**
+ * @brief Connect to the collector, with LOG_OTLP_TIMEOUT_SEC on sends and
+ *        receives.
+ * 
+ * @return int Socket, or `-1`.
+ */
+static int
+otlp_connect(void) {
+  struct addrinfo hints, *addrs, *addr;
+  struct timeval timeout = { LOG_OTLP_TIMEOUT_SEC, 0 };
+  int fd = -1;
+  
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  
+  if (getaddrinfo(L.otlp.host, L.otlp.port, &hints, &addrs) != 0) {
+    return -1;
+  }
+  
+  for (addr = addrs; addr != NULL; addr = addr->ai_next) {
+    fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  
+  freeaddrinfo(addrs);
+  return fd;
+} // otlp_connect()
+
+/**
+ * @brief Read the status code off an HTTP response.
+ * 
+ * @return int Status code, or `-1` if none could be read.
+ */
+static int
+read_http_status(int fd) {
+  char response[256];
+  size_t len = 0;
+  int status;
+  
+  while (len < sizeof(response) - 1) {
+    ssize_t got = recv(fd, response + len, sizeof(response) - 1 - len, 0);
+    
+    if (got <= 0) {
+      break;
+    }
+    len += (size_t)got;
+    response[len] = '\0';
+    
+    if (strstr(response, "\r\n") != NULL) {
+      break;
+    }
+  }
+  response[len] = '\0';
+  
+  if (sscanf(response, "HTTP/%*d.%*d %d", &status) != 1) {
+    return -1;
+  }
+  return status;
+} // read_http_status()
+
+#ifdef LOG_USE_ZLIB
+
+/**
+ * @brief zlib's allocation hooks, so its state comes from the logger's
+ *        allocator too.
+ */
+static voidpf
+zlib_alloc(voidpf opaque, uInt items, uInt size) {
+  (void)opaque;
+  return mem_alloc((size_t)items * size);
+}
+
+static void
+zlib_free(voidpf opaque, voidpf ptr) {
+  (void)opaque;
+  mem_free(ptr);
+}
+
+/**
+ * @brief gzip `count` pieces of data into `out`.
+ */
+static bool
+gzip_pieces(Buffer *out, const struct iovec *pieces, int count) {
+  z_stream z;
+  
+  memset(&z, 0, sizeof(z));
+  z.zalloc = zlib_alloc;
+  z.zfree = zlib_free;
+  
+  // 15 window bits + 16 for a gzip (rather than zlib) wrapper
+  if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+  
+  uLong total = 0;
+  for (int i = 0; i < count; i++) {
+    total += pieces[i].iov_len;
+  }
+  
+  out->len = 0;
+  if (!buffer_reserve(out, deflateBound(&z, total))) {
+    deflateEnd(&z);
+    return false;
+  }
+  
+  z.next_out = (Bytef *)out->data;
+  z.avail_out = (uInt)out->cap;
+  
+  for (int i = 0; i < count; i++) {
+    z.next_in = (Bytef *)pieces[i].iov_base;
+    z.avail_in = (uInt)pieces[i].iov_len;
+    
+    if (deflate(&z, i == count - 1 ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR) {
+      deflateEnd(&z);
+      return false;
+    }
+  }
+  
+  out->len = z.total_out;
+  deflateEnd(&z);
+  return true;
+} // gzip_pieces()
+
+#endif // #ifdef LOG_USE_ZLIB
+
+/**
+ * @brief POST encoded `LogRecord` fields to the collector, wrapped in an
+ *        `ExportLogsServiceRequest`.
+ * 
+ * @return int The HTTP status, or `-1` if the collector couldn't be reached.
+ */
+static int
+otlp_post(const char *records, size_t records_len) {
+  char prefix_storage[64];
+  char header[512];
+  Buffer prefix;
+  struct iovec iov[3];
+  int iov_count;
+  size_t body_len;
+  
+  // ExportLogsServiceRequest { resource_logs: ResourceLogs {
+  //   scope_logs: ScopeLogs { scope: { name, version }, log_records... } } }
+  size_t version_len = strlen(LOG_VERSION);
+  size_t scope_len = pb_field_size(5) + pb_field_size(version_len);
+  size_t scope_logs_len = pb_field_size(scope_len) + records_len;
+  size_t resource_logs_len = pb_field_size(scope_logs_len);
+  
+  buffer_init(&prefix, prefix_storage, sizeof(prefix_storage));
+  pb_put_len(&prefix, 1, resource_logs_len);
+  pb_put_len(&prefix, 2, scope_logs_len);
+  pb_put_len(&prefix, 1, scope_len);
+  pb_put_bytes(&prefix, 1, "log.c", 5);
+  pb_put_bytes(&prefix, 2, LOG_VERSION, version_len);
+  
+  iov[1].iov_base = prefix.data;
+  iov[1].iov_len = prefix.len;
+  iov[2].iov_base = (char *)records;
+  iov[2].iov_len = records_len;
+  iov_count = 3;
+  body_len = prefix.len + records_len;
+  
+  const char *encoding = "";
+  
+#ifdef LOG_USE_ZLIB
+  Buffer gzipped;
+  buffer_init(&gzipped, NULL, 0);
+  
+  if (gzip_pieces(&gzipped, iov + 1, 2)) {
+    iov[1].iov_base = gzipped.data;
+    iov[1].iov_len = gzipped.len;
+    iov_count = 2;
+    body_len = gzipped.len;
+    encoding = "Content-Encoding: gzip\r\n";
+  }
+#endif
+  
+  iov[0].iov_base = header;
+  iov[0].iov_len = (size_t)snprintf(
+    header, sizeof(header),
+    "POST /v1/logs HTTP/1.1\r\n"
+    "Host: %s:%s\r\n"
+    "Content-Type: application/x-protobuf\r\n"
+    "%s"
+    "Content-Length: %zu\r\n"
+    "Connection: close\r\n"
+    "\r\n",
+    L.otlp.host, L.otlp.port, encoding, body_len);
+  
+  int status = -1;
+  int fd = otlp_connect();
+  
+  if (fd >= 0) {
+    if (send_all(fd, iov, iov_count)) {
+      status = read_http_status(fd);
+    }
+    close(fd);
+  }
+  
+#ifdef LOG_USE_ZLIB
+  buffer_free(&gzipped);
+#endif
+  buffer_free(&prefix);
+  
+  return status;
+} // otlp_post()
+
+/**
+ * @brief Is a otlp_post() result worth retrying? Connection failures and the
+ *        statuses the OTLP spec calls retryable (429, 502, 503, 504) are.
+ */
+static bool
+otlp_is_retryable(int status) {
+  return  status < 0 || status == 429 || status == 502 || status == 503 ||
+          status == 504;
+}
+
+/**
+ * @brief Push the next attempt back, doubling the delay each failure.
+ */
+static void
+otlp_back_off(void) {
+  L.otlp.backoff_ms = L.otlp.backoff_ms == 0
+    ? OTLP_MIN_BACKOFF_MS
+    : L.otlp.backoff_ms * 2;
+  if (L.otlp.backoff_ms > OTLP_MAX_BACKOFF_MS) {
+    L.otlp.backoff_ms = OTLP_MAX_BACKOFF_MS;
+  }
+  L.otlp.retry_at_ms = monotonic_ms() + L.otlp.backoff_ms;
+}
+
+/**
+ * @brief Forget the pending records, once they're sent or spooled.
+ */
+static void
+otlp_clear_pending(void) {
+  L.otlp.pending.len = 0;
+  L.otlp.pending_count = 0;
+  
+  // Free a buffer that grew past the batch size while retrying
+  if (L.otlp.pending.cap > 2 * LOG_OTLP_BATCH_SIZE) {
+    buffer_free(&L.otlp.pending);
+  }
+}
+
+/**
+ * @brief Path of spool segment number `seq`.
+ */
+static void
+spool_path(char *path, size_t size, uint64_t seq) {
+  snprintf(
+    path, size, "%s/otlp-%020llu.spool",
+    L.otlp.spool_dir, (unsigned long long)seq);
+}
+
+/**
+ * @brief Any records on disk waiting to be replayed?
+ */
+static bool
+spool_has_records(void) {
+  return L.otlp.spool_bytes > (size_t)L.otlp.spool_read_offset;
+}
+
+/**
+ * @brief Count the records in a segment from `offset` on, by walking the
+ *        frame headers.
+ */
+static size_t
+spool_count_records(uint64_t seq, off_t offset) {
+  char path[1024];
+  uint32_t frame[2];
+  size_t count = 0;
+  
+  spool_path(path, sizeof(path), seq);
+  
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  
+  while (pread(fd, frame, sizeof(frame), offset) == sizeof(frame)) {
+    count += frame[1];
+    offset += sizeof(frame) + frame[0];
+  }
+  
+  close(fd);
+  return count;
+} // spool_count_records()
+
+/**
+ * @brief Delete the oldest segment (replayed or not) and move on to the next.
+ */
+static void
+spool_remove_oldest(void) {
+  char path[1024];
+  struct stat st;
+  
+  spool_path(path, sizeof(path), L.otlp.spool_first);
+  
+  if (stat(path, &st) == 0) {
+    L.otlp.spool_bytes -= (size_t)st.st_size;
+  }
+  unlink(path);
+  
+  if (L.otlp.spool_first == L.otlp.spool_next) {
+    // That was the one being written too
+    if (L.otlp.spool_fd >= 0) {
+      close(L.otlp.spool_fd);
+      L.otlp.spool_fd = -1;
+    }
+    L.otlp.spool_next++;
+    L.otlp.spool_bytes = 0;
+  }
+  
+  L.otlp.spool_first++;
+  L.otlp.spool_read_offset = 0;
+} // spool_remove_oldest()
+
+/**
+ * @brief Append the pending records to the spool as one frame - a
+ *        `uint32_t` byte length and `uint32_t` record count, then the encoded
+ *        records - and clear them.
+ * 
+ * Segments are append-only and roll over at LOG_OTLP_SPOOL_SEGMENT_SIZE. If
+ * the spool would pass its size limit, the oldest segments are deleted (and
+ * their records counted as dropped) to make room.
+ */
+static void
+spool_append_pending(void) {
+  char path[1024];
+  size_t frame_size = 8 + L.otlp.pending.len;
+  
+  if (L.otlp.pending_count == 0) {
+    return;
+  }
+  
+  while (L.otlp.spool_bytes + frame_size > L.otlp.spool_max &&
+         L.otlp.spool_bytes > 0) {
+    L.otlp.dropped +=
+      spool_count_records(L.otlp.spool_first, L.otlp.spool_read_offset);
+    spool_remove_oldest();
+  }
+  
+  if (frame_size > L.otlp.spool_max) {
+    otlp_drop_all();
+    otlp_clear_pending();
+    return;
+  }
+  
+  if (L.otlp.spool_fd >= 0 &&
+      L.otlp.spool_fd_size >= LOG_OTLP_SPOOL_SEGMENT_SIZE) {
+    close(L.otlp.spool_fd);
+    L.otlp.spool_fd = -1;
+    L.otlp.spool_next++;
+  }
+  
+  if (L.otlp.spool_fd < 0) {
+    struct stat st;
+    
+    spool_path(path, sizeof(path), L.otlp.spool_next);
+    L.otlp.spool_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    L.otlp.spool_fd_size =
+      (L.otlp.spool_fd >= 0 && fstat(L.otlp.spool_fd, &st) == 0)
+        ? (size_t)st.st_size
+        : 0;
+  }
+  
+  uint32_t frame[2] = {
+    (uint32_t)L.otlp.pending.len, (uint32_t)L.otlp.pending_count
+  };
+  struct iovec iov[2] = {
+    { frame, sizeof(frame) },
+    { L.otlp.pending.data, L.otlp.pending.len },
+  };
+  
+  if (L.otlp.spool_fd >= 0 &&
+      writev(L.otlp.spool_fd, iov, 2) == (ssize_t)frame_size) {
+    L.otlp.spool_fd_size += frame_size;
+    L.otlp.spool_bytes += frame_size;
+  } else {
+    otlp_drop_all();
+  }
+  
+  otlp_clear_pending();
+} // spool_append_pending()
+
+/**
+ * @brief Replay up to LOG_OTLP_SPOOL_REPLAY_FRAMES frames from the spool,
+ *        oldest first, deleting segments as they're finished.
+ * 
+ * Capped so a long outage's backlog trickles out over successive sends
+ * rather than all at once with the lock held.
+ * 
+ * @return bool `false` if the collector failed in a retryable way (and the
+ *         backoff was pushed back); the failed frame stays spooled.
+ */
+static bool
+spool_replay(void) {
+  char path[1024];
+  Buffer frame_data;
+  bool ok = true;
+  int fd = -1;
+  uint64_t fd_seq = 0;
+  
+  buffer_init(&frame_data, NULL, 0);
+  
+  for (int i = 0; i < LOG_OTLP_SPOOL_REPLAY_FRAMES && spool_has_records();) {
+    uint32_t frame[2];
+    
+    if (fd < 0 || fd_seq != L.otlp.spool_first) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      fd_seq = L.otlp.spool_first;
+      spool_path(path, sizeof(path), fd_seq);
+      fd = open(path, O_RDONLY);
+    }
+    
+    off_t offset = L.otlp.spool_read_offset;
+    
+    if (  fd < 0 ||
+          pread(fd, frame, sizeof(frame), offset) != sizeof(frame) ||
+          frame[0] > LOG_OTLP_MAX_PENDING ||
+          !buffer_reserve(&frame_data, frame[0]) ||
+          pread(fd, frame_data.data, frame[0], offset + 8) !=
+            (ssize_t)frame[0] ) {
+      // Missing or unreadable segment, or a torn frame at its end
+      if (fd >= 0) {
+        close(fd);
+        fd = -1;
+      }
+      spool_remove_oldest();
+      continue;
+    }
+    
+    int status = otlp_post(frame_data.data, frame[0]);
+    
+    if (status < 200 || status >= 300) {
+      if (otlp_is_retryable(status)) {
+        otlp_back_off();
+        ok = false;
+        break;
+      }
+      L.otlp.dropped += frame[1];
+    }
+    
+    L.otlp.spool_read_offset += 8 + frame[0];
+    i++;
+    
+    struct stat st;
+    
+    if (fstat(fd, &st) == 0 && L.otlp.spool_read_offset >= st.st_size) {
+      // Finished the segment
+      close(fd);
+      fd = -1;
+      spool_remove_oldest();
+    }
+  }
+  
+  if (fd >= 0) {
+    close(fd);
+  }
+  buffer_free(&frame_data);
+  
+  if (ok) {
+    L.otlp.backoff_ms = 0;
+  }
+  return ok;
+} // spool_replay()
+
+/**
+ * @brief Send the pending records to the collector.
+ * 
+ * On success (2xx) the pending records are cleared. On a retryable failure
+ * the next attempt is pushed back and the records are spooled to disk if
+ * there's a spool (log_otlp_set_spool()), otherwise kept in memory. On any
+ * other status they're dropped, as resending won't help.
+ * 
+ * While the spool holds anything, it's replayed first and new batches are
+ * added to its end, so records reach the collector in order.
+ */
+static void
+otlp_send(void) {
+  if (L.otlp.spool_dir != NULL && spool_has_records()) {
+    if (!spool_replay() || spool_has_records()) {
+      // Collector still down, or more spool left than one go replays
+      spool_append_pending();
+      return;
+    }
+  }
+  
+  if (L.otlp.pending_count == 0) {
+    return;
+  }
+  
+  int status = otlp_post(L.otlp.pending.data, L.otlp.pending.len);
+  
+  if (status >= 200 && status < 300) {
+    otlp_clear_pending();
+    L.otlp.backoff_ms = 0;
+  } else if (otlp_is_retryable(status)) {
+    otlp_back_off();
+    if (L.otlp.spool_dir != NULL) {
+      spool_append_pending();
+    } else {
+      L.otlp.batch_start_ms = monotonic_ms();
+    }
+  } else {
+    otlp_drop_all();
+    otlp_clear_pending();
+    L.otlp.backoff_ms = 0;
+  }
+} // otlp_send()
+
+/**
+ * @brief Send the pending batch if it's full or old enough, and not backing
+ *        off after a failure. While backing off, full batches go to the spool
+ *        (if there is one) rather than piling up in memory.
+ * 
+ * @param force Send whatever is pending (and replay the spool) regardless of
+ *              size and age, still respecting the backoff.
+ */
+static void
+otlp_maybe_send(bool force) {
+  bool spooled = L.otlp.spool_dir != NULL && spool_has_records();
+  
+  if (L.otlp.pending_count == 0 && !(force && spooled)) {
+    return;
+  }
+  
+  int64_t now = monotonic_ms();
+  
+  if (now < L.otlp.retry_at_ms) {
+    if (L.otlp.spool_dir != NULL &&
+        L.otlp.pending.len >= LOG_OTLP_BATCH_SIZE) {
+      spool_append_pending();
+    }
+    return;
+  }
+  
+  if (  force ||
+        L.otlp.pending.len >= LOG_OTLP_BATCH_SIZE ||
+        now - L.otlp.batch_start_ms >= LOG_OTLP_BATCH_INTERVAL_MS ) {
+    otlp_send();
+  }
+} // otlp_maybe_send()
+
+/**
+ * @brief Encode a record as a `LogRecord` and add it to the pending batch,
+ *        sending the batch if that fills it.
+ */
+static void
+otlp_add_record(time_t sec,
+                long nsec,
+                int level,
+                const char *file,
+                int line,
+                const char *msg,
+                size_t msg_len) {
+  uint64_t time_ns = (uint64_t)sec * 1000000000u + (uint64_t)nsec;
+  const char *severity_text = log_level_to_name(level);
+  size_t severity_text_len = strlen(severity_text);
+  size_t file_len = strlen(file);
+  
+  // Sizes of the nested messages, innermost first
+  size_t body_len = pb_field_size(msg_len);       // AnyValue.string_value
+  size_t file_value_len = pb_field_size(file_len);
+  size_t file_attr_len =                          // KeyValue
+    pb_field_size(sizeof("code.filepath") - 1) + pb_field_size(file_value_len);
+  size_t line_value_len = 1 + pb_varint_size(line); // AnyValue.int_value
+  size_t line_attr_len =
+    pb_field_size(sizeof("code.lineno") - 1) + pb_field_size(line_value_len);
+  size_t record_len =
+    9 +                                           // time_unix_nano
+    1 + pb_varint_size(otlp_severity(level)) +    // severity_number
+    pb_field_size(severity_text_len) +            // severity_text
+    pb_field_size(body_len) +                     // body
+    pb_field_size(file_attr_len) +                // attributes
+    pb_field_size(line_attr_len) +
+    9;                                            // observed_time_unix_nano
+  size_t size = pb_field_size(record_len);
+  
+  if (size > LOG_OTLP_MAX_PENDING) {
+    L.otlp.dropped++;
+    return;
+  }
+  
+  while (L.otlp.pending.len + size > LOG_OTLP_MAX_PENDING) {
+    otlp_drop_oldest();
+  }
+  
+  // Over the memory budget, make room in what's already allocated
+  while (!buffer_reserve(&L.otlp.pending, size)) {
+    if (L.otlp.pending_count == 0) {
+      L.otlp.dropped++;
+      return;
+    }
+    otlp_drop_oldest();
+  }
+  
+  Buffer *b = &L.otlp.pending;
+  
+  if (L.otlp.pending_count == 0) {
+    L.otlp.batch_start_ms = monotonic_ms();
+  }
+  
+  pb_put_len(b, 2, record_len);                   // ScopeLogs.log_records
+  pb_put_fixed64(b, 1, time_ns);
+  pb_put_tag(b, 2, 0);
+  pb_put_varint(b, otlp_severity(level));
+  pb_put_bytes(b, 3, severity_text, severity_text_len);
+  pb_put_len(b, 5, body_len);
+  pb_put_bytes(b, 1, msg, msg_len);
+  pb_put_len(b, 6, file_attr_len);
+  pb_put_bytes(b, 1, "code.filepath", sizeof("code.filepath") - 1);
+  pb_put_len(b, 2, file_value_len);
+  pb_put_bytes(b, 1, file, file_len);
+  pb_put_len(b, 6, line_attr_len);
+  pb_put_bytes(b, 1, "code.lineno", sizeof("code.lineno") - 1);
+  pb_put_len(b, 2, line_value_len);
+  pb_put_tag(b, 3, 0);
+  pb_put_varint(b, line);
+  pb_put_fixed64(b, 11, time_ns);
+  
+  L.otlp.pending_count++;
+  
+  otlp_maybe_send(false);
+} // otlp_add_record()
+
+#endif // #ifdef LOG_USE_OTLP ***********************************************
+
+
+#ifdef LOG_USE_SHM
+// Shared Memory Ring
+// ---------------------------------------------------------------------------
+// 
+// Layout and protocol are documented with log_ShmHeader in log.h. The
+// producer side runs with the lock held, so there's one producer per process.
+// 
+
+/**
+ * @brief Round up to the 8 byte alignment records are kept at.
+ */
+#define SHM_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+static long
+futex(volatile uint32_t *addr, int op, uint32_t value,
+      const struct timespec *timeout) {
+  return syscall(SYS_futex, addr, op, value, timeout, NULL, 0);
+}
+
+static char *
+shm_data(log_ShmHeader *header) {
+  return (char *)header + LOG_SHM_DATA_OFFSET;
+}
+
+/**
+ * @brief Publish a record into the ring, or count it as dropped if the
+ *        reader is too far behind for it to fit.
+ * 
+ * No syscalls, unless the reader is asleep waiting for records.
+ */
+static void
+shm_write(log_ShmHeader *header, const char *data, size_t len) {
+  uint64_t capacity = header->capacity;
+  uint64_t head = header->head;
+  uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+  uint64_t need = SHM_ALIGN(4 + len);
+  uint64_t offset = head & (capacity - 1);
+  uint64_t pad = (offset + need > capacity) ? capacity - offset : 0;
+  char *base = shm_data(header);
+  
+  if (need > capacity || (head - tail) + pad + need > capacity) {
+    __atomic_add_fetch(&header->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  
+  if (pad > 0) {
+    // Not enough room before the end; mark the rest as skipped and wrap
+    uint32_t skip = LOG_SHM_WRAP;
+    memcpy(base + offset, &skip, 4);
+    offset = 0;
+  }
+  
+  uint32_t record_len = (uint32_t)len;
+  memcpy(base + offset, &record_len, 4);
+  memcpy(base + offset + 4, data, len);
+  
+  __atomic_store_n(&header->head, head + pad + need, __ATOMIC_RELEASE);
+  
+  if (__atomic_exchange_n(&header->reader_waiting, 0, __ATOMIC_ACQ_REL)) {
+    __atomic_add_fetch(&header->wake_seq, 1, __ATOMIC_RELEASE);
+    futex(&header->wake_seq, FUTEX_WAKE, 1, NULL);
+  }
+} // shm_write()
+
+#endif // #ifdef LOG_USE_SHM ************************************************
+
+
+#ifdef LOG_USE_RT
+// Real-Time Rings
+// ---------------------------------------------------------------------------
+// 
+// log_rt_log() doesn't format anything. It walks the format string to find
+// what arguments it takes, copies them (and the bytes of any strings) into
+// the next slot of the thread's ring, and that's it. The drain thread walks
+// the format string again, and formats each conversion with the argument
+// that was captured for it.
+// 
+
+/**
+ * @brief The kinds of argument a printf conversion can take.
+ */
+enum {
+  RT_ARG_NONE,              ///< `%%`
+  RT_ARG_INT,
+  RT_ARG_LONG,
+  RT_ARG_LLONG,
+  RT_ARG_INTMAX,
+  RT_ARG_SIZE,
+  RT_ARG_PTRDIFF,
+  RT_ARG_DOUBLE,
+  RT_ARG_LDOUBLE,           ///< Captured as a `double`.
+  RT_ARG_STR,
+  RT_ARG_PTR,
+  RT_ARG_SKIP,              ///< `%n`, `%ls` - not written.
+  RT_ARG_UNKNOWN            ///< Can't tell, so stop there.
+};
+
+/**
+ * @brief Parse the printf conversion at `p` (on its `%`).
+ * 
+ * @param type      Set to the RT_ARG_* it takes.
+ * @param stars     Set to how many `*` widths / precisions it takes (as
+ *                  `int`s, before the argument).
+ * @param precision Set to the precision, `-1` if there isn't one, or `-2`
+ *                  if it's a `*` argument. Can be `NULL`.
+ * 
+ * @return const char * Just past the conversion.
+ */
+static const char *
+rt_parse(const char *p, int *type, int *stars, int *precision) {
+  char length = 0;
+  int ignored;
+  
+  if (precision == NULL) {
+    precision = &ignored;
+  }
+  *stars = 0;
+  *precision = -1;
+  p++;
+  
+  while (*p != '\0' && strchr("-+ #0'", *p) != NULL) {
+    p++;
+  }
+  
+  for (int i = 0; i < 2; i++) {
+    if (i == 1) {
+      if (*p != '.') {
+        break;
+      }
+      p++;
+    }
+    if (*p == '*') {
+      (*stars)++;
+      p++;
+      if (i == 1) {
+        *precision = -2;
+      }
+    } else {
+      int value = 0;
+      
+      while (isdigit((unsigned char)*p)) {
+        if (value < 100000) {
+          value = value * 10 + (*p - '0');
+        }
+        p++;
+      }
+      if (i == 1) {
+        *precision = value;
+      }
+    }
+  }
+  
+  // 'H' for hh and 'q' for ll
+  if (*p == 'h' || *p == 'l') {
+    length = *p++;
+    if (*p == length) {
+      length = length == 'h' ? 'H' : 'q';
+      p++;
+    }
+  } else if (*p != '\0' && strchr("qLjzt", *p) != NULL) {
+    length = *p++;
+  }
+  
+  char conversion = *p;
+  
+  if (conversion != '\0') {
+    p++;
+  }
+  
+  switch (conversion) {
+    case '%':
+      *type = RT_ARG_NONE;
+      break;
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+      switch (length) {
+        case 0: case 'h': case 'H': *type = RT_ARG_INT; break;
+        case 'l': *type = RT_ARG_LONG; break;
+        case 'q': *type = RT_ARG_LLONG; break;
+        case 'j': *type = RT_ARG_INTMAX; break;
+        case 'z': *type = RT_ARG_SIZE; break;
+        case 't': *type = RT_ARG_PTRDIFF; break;
+        default: *type = RT_ARG_UNKNOWN; break;
+      }
+      break;
+    case 'c':
+      // Including %lc, whose wint_t is promoted to an int's size
+      *type = RT_ARG_INT;
+      break;
+    case 'f': case 'F': case 'e': case 'E':
+    case 'g': case 'G': case 'a': case 'A':
+      *type = length == 'L' ? RT_ARG_LDOUBLE : RT_ARG_DOUBLE;
+      break;
+    case 's':
+      *type = length == 'l' ? RT_ARG_SKIP : RT_ARG_STR;
+      break;
+    case 'p':
+      *type = RT_ARG_PTR;
+      break;
+    case 'n':
+      *type = RT_ARG_SKIP;
+      break;
+    default:
+      *type = RT_ARG_UNKNOWN;
+      break;
+  }
+  
+  return p;
+} // rt_parse()
+
+/**
+ * @brief Copy the arguments `fmt` takes into `slot`. Strings are copied into
+ *        `slot->strs` (as much as fits, and no further than their precision,
+ *        as printf() would read them), and their arguments are offsets into
+ *        it, or `-1` for `NULL` and `-2` if there was no room left.
+ */
+static void
+rt_capture(RtSlot *slot, const char *fmt, va_list args) {
+  size_t strs_len = 0;
+  int n = 0;
+  
+  for (const char *p = fmt; (p = strchr(p, '%')) != NULL; ) {
+    int type, stars, precision;
+    
+    p = rt_parse(p, &type, &stars, &precision);
+    
+    if (type == RT_ARG_NONE) {
+      continue;
+    }
+    if (type == RT_ARG_UNKNOWN || n + stars + 1 > LOG_RT_MAX_ARGS) {
+      break;
+    }
+    
+    for (int i = 0; i < stars; i++) {
+      slot->args[n++].i = va_arg(args, int);
+    }
+    if (precision == -2) {
+      // From the argument; negative counts as no precision
+      precision = (int)slot->args[n - 1].i;
+    }
+    
+    RtArg *arg = &slot->args[n++];
+    
+    switch (type) {
+      case RT_ARG_INT:      arg->i = va_arg(args, int); break;
+      case RT_ARG_LONG:     arg->i = va_arg(args, long); break;
+      case RT_ARG_LLONG:    arg->i = va_arg(args, long long); break;
+      case RT_ARG_INTMAX:   arg->i = va_arg(args, intmax_t); break;
+      case RT_ARG_SIZE:     arg->i = (int64_t)va_arg(args, size_t); break;
+      case RT_ARG_PTRDIFF:  arg->i = va_arg(args, ptrdiff_t); break;
+      case RT_ARG_DOUBLE:   arg->d = va_arg(args, double); break;
+      case RT_ARG_LDOUBLE:  arg->d = (double)va_arg(args, long double); break;
+      case RT_ARG_PTR:
+      case RT_ARG_SKIP:     arg->p = va_arg(args, void *); break;
+      case RT_ARG_STR: {
+        const char *str = va_arg(args, const char *);
+        size_t room = sizeof(slot->strs) - strs_len;
+        
+        if (str == NULL) {
+          arg->i = -1;
+        } else if (room == 0) {
+          arg->i = -2;
+        } else {
+          size_t len = 0;
+          size_t max = room - 1;
+          
+          if (precision >= 0 && (size_t)precision < max) {
+            max = (size_t)precision;
+          }
+          while (len < max && str[len] != '\0') {
+            slot->strs[strs_len + len] = str[len];
+            len++;
+          }
+          slot->strs[strs_len + len] = '\0';
+          arg->i = (int64_t)strs_len;
+          strs_len += len + 1;
+        }
+        break;
+      }
+    }
+  }
+  
+  slot->num_args = n;
+} // rt_capture()
+
+/**
+ * @brief Format a captured record's message, the way vsnprintf() would have.
+ *        Conversions past the captured arguments are written out as-is.
+ */
+static void
+rt_format(Buffer *msg, const RtSlot *slot) {
+  const char *p = slot->fmt;
+  int n = 0;
+  
+// Print `value` with the conversion in `spec`, and any `*` arguments
+#define RT_PRINTF(value)                                                    \
+  ( stars == 0 ? buffer_printf(msg, spec, value)                            \
+  : stars == 1 ? buffer_printf(msg, spec, width, value)                     \
+  : buffer_printf(msg, spec, width, precision, value) )
+  
+  for (;;) {
+    const char *pct = strchr(p, '%');
+    
+    if (pct == NULL) {
+      buffer_append(msg, p, strlen(p));
+      return;
+    }
+    
+    buffer_append(msg, p, (size_t)(pct - p));
+    
+    int type, stars;
+    const char *end = rt_parse(pct, &type, &stars, NULL);
+    char spec[32];
+    size_t spec_len = (size_t)(end - pct);
+    
+    if (type == RT_ARG_NONE) {
+      buffer_append(msg, "%", 1);
+      p = end;
+      continue;
+    }
+    
+    if (type == RT_ARG_UNKNOWN ||
+        n + stars + 1 > slot->num_args ||
+        spec_len >= sizeof(spec)) {
+      buffer_append(msg, pct, strlen(pct));
+      return;
+    }
+    
+    memcpy(spec, pct, spec_len);
+    spec[spec_len] = '\0';
+    
+    int width = stars > 0 ? (int)slot->args[n++].i : 0;
+    int precision = stars > 1 ? (int)slot->args[n++].i : 0;
+    RtArg arg = slot->args[n++];
+    
+    switch (type) {
+      case RT_ARG_INT:      RT_PRINTF((int)arg.i); break;
+      case RT_ARG_LONG:     RT_PRINTF((long)arg.i); break;
+      case RT_ARG_LLONG:    RT_PRINTF((long long)arg.i); break;
+      case RT_ARG_INTMAX:   RT_PRINTF((intmax_t)arg.i); break;
+      case RT_ARG_SIZE:     RT_PRINTF((size_t)arg.i); break;
+      case RT_ARG_PTRDIFF:  RT_PRINTF((ptrdiff_t)arg.i); break;
+      case RT_ARG_DOUBLE:   RT_PRINTF(arg.d); break;
+      case RT_ARG_LDOUBLE:  RT_PRINTF((long double)arg.d); break;
+      case RT_ARG_PTR:      RT_PRINTF(arg.p); break;
+      case RT_ARG_STR:
+        RT_PRINTF(
+          arg.i == -1 ? "(null)" :
+          arg.i == -2 ? "..." :
+          slot->strs + arg.i);
+        break;
+      case RT_ARG_SKIP:
+        if (end[-1] != 'n') {
+          buffer_append(msg, "?", 1);
+        }
+        break;
+    }
+    
+    p = end;
+  }
+  
+#undef RT_PRINTF
+} // rt_format()
+
+/**
+ * @brief Give the calling thread a ring from the pool.
+ * 
+ * @return RtRing * `NULL` if they've all been handed out.
+ */
+static RtRing *
+rt_claim(void) {
+  if (rt_thread_ringless) {
+    return NULL;
+  }
+  
+  unsigned index = __atomic_fetch_add(&L.rt.num_rings, 1, __ATOMIC_ACQ_REL);
+  
+  if (index >= LOG_RT_THREADS) {
+    rt_thread_ringless = true;
+    return NULL;
+  }
+  
+  rt_thread_ring = &rt_rings[index];
+  return rt_thread_ring;
+} // rt_claim()
+
+/**
+ * @brief Copy the next record out of `ring` and consume it, skipping (and
+ *        counting) any that were overwritten before the drain got to them.
+ * 
+ * @return bool `false` if there isn't one.
+ */
+static bool
+rt_read(RtRing *ring, RtSlot *record) {
+  uint64_t tail = ring->tail;
+  
+  for (;;) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    
+    if (tail == head) {
+      __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+      return false;
+    }
+    
+    if (head - tail > LOG_RT_SLOTS) {
+      __atomic_add_fetch(
+        &L.rt.lost, head - tail - LOG_RT_SLOTS, __ATOMIC_RELAXED);
+      tail = head - LOG_RT_SLOTS;
+    }
+    
+    RtSlot *slot = &ring->slots[tail & (LOG_RT_SLOTS - 1)];
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    
+    if (seq == 2 * tail + 2) {
+      memcpy(record, slot, sizeof(*record));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      
+      if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        return true;
+      }
+    }
+    
+    // Overwritten by a later record (maybe while it was being copied)
+    __atomic_add_fetch(&L.rt.lost, 1, __ATOMIC_RELAXED);
+    tail++;
+  }
+} // rt_read()
+
+static bool
+timespec_before(const struct timespec *a, const struct timespec *b) {
+  return  a->tv_sec < b->tv_sec ||
+          (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+#endif // #ifdef LOG_USE_RT *************************************************
+
+
+// Functional Utilties
+// ---------------------------------------------------------------------------
+// 
+// Don't depend on no state.
+// 
+
+/**
+ * @brief Is a `level` valid?
+ */
+bool
+log_is_level(int level) {
+  return level >= LOG_TRACE && level <= LOG_FATAL;
+}
+
+#ifdef LOG_USE_COLOR
+
+/**
+ * @brief Get the shell color string for a level.
+ * 
+ * @param level 
+ * @return const char * String (`NULL`-termianted). *DO NOT* free()!
+ * @return NULL When level is not valid.
+ */
+const char *
+log_level_to_color(int level) {
+  if (!log_is_level(level)) {
+    return NULL;
+  }
+  
+  return level_colors[level - LOG_TRACE];
+} // log_level_to_color()
+
+#endif // #ifdef LOG_USE_COLOR
+
+/**
+ * @brief Get the string name for a level.
+ * 
+ * @note  **DO NOT free()** the returned strings! They're elements of an
+ *        internal array, and we need them around.
+ * 
+ * @return char * String like "DEBUG" (`NULL`-termianted). **DO NOT** free()
+ *                them!
+ * @return char * `NULL` when `level` is not valid.
+ */
+const char *
+log_level_to_name(int level) {
+  if (!log_is_level(level)) {
+    return NULL;
+  }
+  
+  return level_names[ level - LOG_TRACE ];
+} // log_level_to_name()
+
+/**
+ * @brief Convert log level name to level integer (that you can use in in
+ * log_set_level()).
+ * 
+ * @param name 
+ *    When up-cased, should be one of level_names.
+ * 
+ * @return int 
+ *    Log level integer, or BAD_LEVEL on error (logs an error as well).
+ */
+int
+log_name_to_level(char* name) {
+  // Iterate through each level name, checking if it's the same as `name`
+  // up-cased (a character at a time, so nothing's allocated), and return the
+  // level if it is.
+  for (int level = LOG_TRACE; level <= LOG_FATAL; level++) {
+    const char *level_name = log_level_to_name(level);
+    size_t i = 0;
+    
+    while ( level_name[i] != '\0' &&
+            level_name[i] == toupper((unsigned char)name[i]) ) {
+      i++;
+    }
+    
+    if (level_name[i] == '\0' && name[i] == '\0') {
+      return level;
+    }
+  }
+  
+  log_error("Level name '%s' not found", name);
+  return BAD_LEVEL;
+} // log_name_to_level()
+
+/**
+ * @brief Accessor for the string versions of level integers. Used for comparing
+ *        inputs.
+ * 
+ * @return char **  Array of pointers to strings, indexed by
+ *                  `level - LOG_TRACE`. **DO NOT** free() or modify!
+ */
+char **
+log_level_strings() {  
+  return level_strings;
+} // log_level_strings()
+
+/**
+ * @brief Convert a level to a string.
+ * 
+ * @note  **DO NOT** free() the returned string!
+ *        
+ *        Internally uses a pre-populated array of strings from it returns a 
+ *        reference.
+ * 
+ * @return char * @parblock
+ *   String version of the level integer. Again, **DO NOT EVER 
+ *   free()**!
+ *    
+ *   If `level` is *not* a valid level returns `NULL`.
+ * @endparblock
+ */
+char *
+log_level_to_string(int level) {
+  if (!log_is_level(level)) {
+    return NULL;
+  }
+  
+  return log_level_strings()[level - LOG_TRACE];
+} // log_level_to_string()
+
+/**
+ * @brief Could a log segment contain `token`? Checks the Bloom filter saved
+ *        alongside it by log_set_fp_indexed(), reading just the bits needed.
+ * 
+ * The filter is saved now and then, not with every record, so it's only
+ * used if it covers the whole segment - which it does once the logger has
+ * moved on to the next one, or exited. (tools/loggrep.c reads just what it
+ * doesn't cover instead.)
+ * 
+ * @param path  The filter, `<segment>.bloom`.
+ * @param token A whole token, as log_set_fp_indexed() splits them. Anything
+ *              that isn't one can't be ruled out.
+ * 
+ * @return int  `0` if the segment definitely doesn't contain it, `1` if it
+ *              may, `-1` if there's no usable filter (so scan the segment).
+ */
+int
+log_bloom_check(const char *path, const char *token) {
+  size_t len = strlen(token);
+  size_t path_len = strlen(path);
+  
+  if (len == 0 || bloom_token_len(token, len) != len) {
+    return 1;
+  }
+  
+  if (path_len <= 6 || strcmp(path + path_len - 6, ".bloom") != 0) {
+    return -1;
+  }
+  
+  // The segment, to see whether it's grown since
+  char *segment = mem_alloc(path_len - 5);
+  FILE *segment_fp;
+  long size = -1;
+  
+  if (segment == NULL) {
+    return -1;
+  }
+  memcpy(segment, path, path_len - 6);
+  segment[path_len - 6] = '\0';
+  segment_fp = fopen(segment, "rb");
+  mem_free(segment);
+  
+  if (segment_fp != NULL) {
+    if (fseek(segment_fp, 0, SEEK_END) == 0) {
+      size = ftell(segment_fp);
+    }
+    fclose(segment_fp);
+  }
+  
+  FILE *fp = fopen(path, "rb");
+  BloomHeader header;
+  int result = -1;
+  
+  if (fp == NULL) {
+    return -1;
+  }
+  
+  if (bloom_read_header(fp, &header) &&
+      size >= 0 &&
+      header.covered == (uint64_t)size) {
+    result = bloom_lookup(fp, &header, token);
+  }
+  
+  fclose(fp);
+  return result;
+} // log_bloom_check()
+
+
+// State
+// ---------------------------------------------------------------------------
+// 
+
+/**
+ * @brief Get the string version of the current level.
+ * 
+ * @note  **DO NOT free()** the returned strings! They're elements of an
+ *        internal array, and we need them around.
+ * 
+ * @return const char * `NULL`-terminated string like "DEBUG". **DO NOT**
+ *                      free()!
+ */
+const char *
+log_get_level_name() {
+  return log_level_to_name(L.level);
+}
+
+/**
+ * @brief Set the log level by a level_names member.
+ * 
+ * @see log_name_to_level()
+ * 
+ * @param name
+ *    One of the level_names - "TRACE", "DEBUG", "INFO", "WARN", "ERROR" or
+ *    "FATAL" (case-insensitive).
+ * 
+ * @return int 
+ *    The level that was set, or `-1` on failure.
+ */
+int log_set_level_by_name(char* name) {
+  int level = log_name_to_level(name);
+  if (level != BAD_LEVEL) {
+    log_set_level(level);
+  }
+  return level;
+}
+
+FILE
+*log_get_fp() {
+  return L.fp;
+}
+
+/**
+ * @brief Set the file pointer to log to (in addition to stderr, unless in
+ *        "quiet" mode).
+ * 
+ * If `fp` turns out to be the same file that stderr is writing to (same
+ * stream, or same device and inode) the stderr output is skipped while it's
+ * set, so each record is only written once. The check happens here, so
+ * re-call log_set_fp() if stderr is redirected afterwards.
+ * 
+ * Ends indexing started by log_set_fp_indexed(), saving the filter.
+ * 
+ * @param fp Stream to log to, or `NULL` to stop file logging.
+ */
+void
+log_set_fp(FILE *fp) {
+  lock();
+  wait_file_queue();
+  bloom_stop();
+  L.fp = fp;
+  L.fp_is_stderr = (fp != NULL && same_file(fp, stderr));
+  unlock();
+}
+
+/**
+ * @brief Set the file pointer to log to, as log_set_fp(), and index what's
+ *        written to it in a Bloom filter saved as `<segment>.bloom`, so
+ *        lookups across many segments (see log_bloom_check()) can skip the
+ *        ones that can't contain what they're after.
+ * 
+ * Call it again with the next segment when rotating; the switch happens
+ * under the lock, so each record is indexed with the segment it's in. The
+ * filter is saved then, by log_flush() and at exit, along with how much of
+ * the segment it covers. If `<segment>.bloom` already exists (a restarted
+ * process appending) it's added to, once what was written after it was last
+ * saved has been indexed.
+ * 
+ * Tokens are runs of letters, digits and `_-.:@` in the message, less any
+ * trailing `.:-`. With `keys` only the tokens directly following one of them
+ * are indexed - `{"request_id=", "trace=", NULL}` indexes just the values of
+ * those fields, which keeps the filter small and accurate.
+ * 
+ * @param fp      Stream to log to.
+ * @param segment Path of the file `fp` writes to.
+ * @param keys    `NULL`-terminated list of up to 8 keys, each shorter than 32
+ *                bytes, or `NULL` to index every token.
+ * 
+ * @return int `0` on success, `-1` if the keys are bad or the filter
+ *             couldn't be allocated (in which case logging to `fp` carries
+ *             on unindexed).
+ */
+int
+log_set_fp_indexed(FILE *fp, const char *segment, const char *const *keys) {
+  int num_keys = 0;
+  
+  while (keys != NULL && keys[num_keys] != NULL) {
+    if (num_keys == BLOOM_MAX_KEYS ||
+        keys[num_keys][0] == '\0' ||
+        strlen(keys[num_keys]) >= BLOOM_KEY_SIZE) {
+      log_error("Tried to index by bad keys");
+      log_set_fp(fp);
+      return -1;
+    }
+    num_keys++;
+  }
+  
+  // `<segment>.bloom` and `<segment>.bloom.tmp`, in one allocation
+  size_t path_size = strlen(segment) + sizeof(".bloom");
+  size_t tmp_path_size = path_size + sizeof(".tmp") - 1;
+  unsigned char *bits = mem_alloc(LOG_BLOOM_BITS / 8);
+  char *path = mem_alloc(path_size + tmp_path_size);
+  
+  if (bits == NULL || path == NULL) {
+    mem_free(bits);
+    mem_free(path);
+    log_set_fp(fp);
+    log_error("Couldn't allocate the index for %s", segment);
+    return -1;
+  }
+  
+  lock();
+  
+  wait_file_queue();
+  bloom_stop();
+  L.fp = fp;
+  L.fp_is_stderr = (fp != NULL && same_file(fp, stderr));
+  
+  memset(bits, 0, LOG_BLOOM_BITS / 8);
+  snprintf(path, path_size, "%s.bloom", segment);
+  L.bloom.bits = bits;
+  L.bloom.path = path;
+  L.bloom.tmp_path = path + path_size;
+  snprintf(L.bloom.tmp_path, tmp_path_size, "%s.bloom.tmp", segment);
+  L.bloom.num_keys = num_keys;
+  memset(L.bloom.keys, 0, sizeof(L.bloom.keys));
+  for (int k = 0; k < num_keys; k++) {
+    snprintf(L.bloom.keys[k], BLOOM_KEY_SIZE, "%s", keys[k]);
+  }
+  L.bloom.dirty = false;
+  bloom_load(segment);
+  
+  if (!L.bloom.at_exit_registered) {
+    atexit(bloom_at_exit);
+    L.bloom.at_exit_registered = true;
+  }
+  
+  unlock();
+  
+  return 0;
+} // log_set_fp_indexed()
+
+int
+log_get_level() {
+  return L.level;
+}
+
+/**
+ * @brief Set the log level.
+ * 
+ * If `level` is not valid an error is logged and the log level remains as
+ * before.
+ * 
+ * @param level 
+ */
+void
+log_set_level(int level) {
+  if (!log_is_level(level)) {
+    log_error("Tried to set bad log level %d", level);
+    return;
+  }
+  lock();
+  L.level = level;
+  loggers_resolve();
+  unlock();
+}
+
+/**
+ * @brief Is the logger in "quiet" mode - where logging to stderr is silenced,
+ *        though file logging continues if configured (see log_get_fp() /
+ *        log_set_fp()).
+ * 
+ * @return bool
+ */
+bool
+log_get_quiet() {
+  return L.quiet;
+}
+
+/**
+ * @brief Sets "quiet" mode - where logging to stderr is silenced, though file
+ *        logging continues if configured (see log_get_fp() / log_set_fp()).
+ * 
+ * @param enable State to set: on (true) or off (false).
+ */
+void
+log_set_quiet(bool enable) {
+  L.quiet = enable;
+}
+
+#ifdef LOG_USE_MSGPACK
+
+FILE *
+log_get_msgpack_fp() {
+  return L.msgpack_fp;
+}
+
+/**
+ * @brief Set a stream to write records to as length-prefixed MessagePack (in
+ *        addition to the text outputs).
+ * 
+ * Open it in binary mode. See write_msgpack_record() for the frame layout and
+ * log_msgpack_read() to read it back.
+ * 
+ * @param fp Stream to write to, or `NULL` to stop.
+ */
+void
+log_set_msgpack_fp(FILE *fp) {
+  L.msgpack_fp = fp;
+  msgpack_intern_reset();
+}
+
+bool
+log_get_msgpack_intern() {
+  return L.msgpack_intern;
+}
+
+/**
+ * @brief Turn interning of file names in the MessagePack output on or off.
+ * 
+ * When on, each file name is written to the stream once, in a definition
+ * frame, and records refer to it by a small integer ID after that.
+ * log_msgpack_read() expands the IDs back to the names.
+ * 
+ * @note  File names are interned by address and a hash of their contents,
+ *        so a name that's moved or changed is just defined again.
+ * 
+ * @param enable State to set: on (true) or off (false).
+ */
+void
+log_set_msgpack_intern(bool enable) {
+  L.msgpack_intern = enable;
+  msgpack_intern_reset();
+}
+
+#endif // #ifdef LOG_USE_MSGPACK
+
+bool
+log_get_escape() {
+  return L.escape;
+}
+
+/**
+ * @brief Sets "escape" mode - where control characters in messages are
+ *        escaped in the text outputs (`\n` and `\r` as such, others like
+ *        `\x1b`), so every record is exactly one line and can't send
+ *        terminal escape sequences.
+ * 
+ * The structured outputs (MessagePack, OTLP) carry messages as-is.
+ * 
+ * @param enable State to set: on (true) or off (false).
+ */
+void
+log_set_escape(bool enable) {
+  L.escape = enable;
+}
+
+/**
+ * @brief Choose when stderr output is written.
+ * 
+ * LOG_FLUSH_RECORD writes each record as it's logged. LOG_FLUSH_BUFFERED
+ * holds records back (up to LOG_STDERR_BUF_SIZE bytes) and writes them
+ * together when the buffer fills, on a record at LOG_ERROR or above, when
+ * a record comes in after the oldest held back is LOG_STDERR_MAX_AGE_MS old,
+ * on log_flush() and at exit - much cheaper for a pipe or file, at the cost
+ * of lines showing up late. LOG_FLUSH_AUTO, the default, does the former for
+ * a terminal and the latter for a pipe, file or socket.
+ * 
+ * @note  With buffering, anything else written to stderr directly can come
+ *        out ahead of earlier records. Call log_flush() first if it matters,
+ *        and before going idle for long - nothing checks the age while no
+ *        records come in (except the real-time drain thread, if running).
+ * 
+ * @param policy LOG_FLUSH_AUTO, LOG_FLUSH_RECORD or LOG_FLUSH_BUFFERED.
+ */
+void
+log_set_stderr_flush(int policy) {
+  lock();
+  stderr_flush();
+  L.err.policy = policy;
+  L.err.resolved = false;
+  unlock();
+}
+
+/**
+ * @brief Log more for a while after something goes wrong.
+ * 
+ * After a record at `trigger` or above is logged, records down to `level`
+ * are let through as well for the next `seconds` seconds (restarting with
+ * each triggering record), then the usual level (see log_set_level()) applies
+ * again. When no boost is running, filtered-out records cost one more check.
+ * 
+ * @param trigger     Level that starts a boost.
+ * @param level       Level to log down to while boosted.
+ * @param seconds     How long a boost lasts, or `0` to turn boosting off (the
+ *                    default).
+ * @param per_thread  Boost only the thread that logged the triggering record,
+ *                    rather than all of them. Needs thread-local storage
+ *                    (GCC, clang or C11); without it all threads are
+ *                    boosted.
+ */
+void
+log_set_boost(int trigger, int level, int seconds, bool per_thread) {
+  if (seconds < 0 || !log_is_level(trigger) || !log_is_level(level)) {
+    log_error("Tried to set bad boost %d -> %d", trigger, level);
+    return;
+  }
+  
+  lock();
+  
+  L.boost.trigger = trigger;
+  L.boost.level = level;
+  L.boost.duration_ms = (int64_t)seconds * 1000;
+#ifdef LOG_THREAD_LOCAL
+  L.boost.per_thread = per_thread;
+#else
+  // Nowhere to keep a boost per thread, so boost them all
+  (void)per_thread;
+  L.boost.per_thread = false;
+#endif
+  ATOMIC_STORE(&L.boost.until_ms, 0, RELAXED);
+  
+  // Last, so a thread that sees the new generation sees the settings too
+  ATOMIC_STORE(
+    &L.boost.generation,
+    ATOMIC_LOAD(&L.boost.generation, RELAXED) + 1,
+    RELEASE);
+  
+  unlock();
+}
+
+/**
+ * @brief Watch for writes to the file output (see log_set_fp()) that hang -
+ *        a stuck NFS mount, say - so logging threads don't all hang behind
+ *        them.
+ * 
+ * With a timeout set the file is written outside the lock, by one thread at
+ * a time, and other threads' lines queue up for it. Once a write has taken
+ * longer than `timeout_ms`, the file lines of records logged meanwhile are
+ * written to `fallback` instead, or dropped if it's `NULL`, and a note goes
+ * to stderr. The other outputs aren't affected. When the write returns the
+ * queue is written as normal, and stderr gets the number of records that
+ * were diverted or dropped (a batch counts as one).
+ * 
+ * log_set_fp() waits for the write in progress to finish, so the stream
+ * it replaces can be closed once it returns.
+ * 
+ * @param timeout_ms  How long a write can take, or `0` to turn it off (the
+ *                    default). Needs a POSIX monotonic clock.
+ * @param fallback    Stream to divert to, or `NULL` to drop.
+ */
+void
+log_set_stall_timeout(int timeout_ms, FILE *fallback) {
+  lock();
+  wait_file_queue();
+  L.stall.fallback = fallback;
+  L.stall.timeout_ms = timeout_ms;
+  unlock();
+}
+
+/**
+ * @brief Cap the memory the logger allocates, across all its buffers.
+ * 
+ * Records mostly fit in stack buffers; the heap is used for long messages,
+ * batches, the OTLP queue and spool, and MessagePack frames. Allocations
+ * that would take the total over `bytes` fail, and are handled the way
+ * running out of memory is (see the LOG_MEM_* policies). Kept buffers are
+ * also given back sooner once half the budget is in use.
+ * 
+ * @note  The accounting is lock-free with GCC-style atomics (GCC, clang).
+ *        Other compilers get plain counters, which can drift if several
+ *        threads allocate at once.
+ * 
+ * @param bytes   The budget, or `0` for no limit (the default).
+ * @param policy  LOG_MEM_DROP or LOG_MEM_DROP_LOW.
+ */
+void
+log_set_mem_budget(size_t bytes, int policy) {
+  L.mem.budget = bytes;
+  L.mem.policy = policy;
+}
+
+/**
+ * @brief Have the logger get all its memory from `alloc` and `free` rather
+ *        than malloc() and free() - a dedicated jemalloc arena, say, so its
+ *        buffers neither fragment nor contend with the application's heap,
+ *        and are accounted separately:
+ * 
+ *     static void *arena_alloc(void *udata, size_t size) {
+ *       return mallocx(size, MALLOCX_ARENA(*(unsigned *)udata));
+ *     }
+ *     static void arena_free(void *udata, void *ptr) {
+ *       dallocx(ptr, MALLOCX_ARENA(*(unsigned *)udata));
+ *     }
+ *     ...
+ *     mallctl("arenas.create", &arena, &size, NULL, 0);
+ *     log_set_allocator(arena_alloc, arena_free, &arena);
+ * 
+ * Covers every heap allocation the logger makes (long messages, batches,
+ * the OTLP queue and gzip state, MessagePack frames and the Bloom filter),
+ * all still counted against the memory budget (see log_set_mem_budget()).
+ * The stderr pipe regions of LOG_USE_VMSPLICE and the shared memory ring are
+ * mapped directly, not allocated.
+ * 
+ * Blocks remember the free function they were allocated with, so the
+ * allocator can be changed at any time; `free` and `udata` must stay valid
+ * while blocks from them are outstanding.
+ * 
+ * @param alloc   Returns `size` bytes aligned for anything, or `NULL`. Called
+ *                from any thread, not always with the lock held. `NULL`
+ *                goes back to malloc() and free().
+ * @param free    Frees what `alloc` returned.
+ * @param udata   Passed to both.
+ */
+void
+log_set_allocator(log_AllocFn alloc, log_FreeFn free, void *udata) {
+  lock();
+  L.allocator.alloc = alloc != NULL && free != NULL ? alloc : NULL;
+  L.allocator.free = alloc != NULL && free != NULL ? free : NULL;
+  L.allocator.udata = udata;
+  unlock();
+}
+
+/**
+ * @brief Get current and peak logger memory use, and how often the budget
+ *        got in the way.
+ */
+void
+log_get_mem_stats(log_MemStats *stats) {
+  stats->used = ATOMIC_LOAD(&L.mem.used, RELAXED);
+  stats->peak = ATOMIC_LOAD(&L.mem.peak, RELAXED);
+  stats->budget = L.mem.budget;
+  stats->refused = ATOMIC_LOAD(&L.mem.refused, RELAXED);
+  stats->dropped = ATOMIC_LOAD(&L.mem.dropped, RELAXED);
+}
+
+void
+log_set_udata(void *udata) {
+  L.udata = udata;
+}
+
+void
+log_set_lock(log_LockFn fn) {
+  L.lock = fn;
+}
+
+/**
+ * @brief Set level given a string, which may be the string representation of
+ * one of the level integers, or one of the level_names (case insensitive).
+ * 
+ * @see log_set_level_by_name()
+ *
+ * @param string
+ *    Either a string representation of a level integer - "0" (LOG_TRACE)
+ *    through "5" (LOG_FATAL) - or one of the level_names - "TRACE", "DEBUG",
+ *    "INFO", "WARN", "ERROR" or "FATAL" (case-insensitive).
+ *
+ * @return int
+ *    Level that was set, or BAD_LEVEL on failure.
+ */
+int
+log_set_level_from_string(char* string) {
+  size_t length = strlen(string);
+  
+  if (0 == length) {
+    log_error("Received empty string");
+    return BAD_LEVEL;
+  }
+  
+  for (int level = LOG_TRACE; level <= LOG_FATAL; level++) {
+    if (0 == strcmp(string, log_level_to_string(level))) {
+      log_set_level(level);
+      return level;
+    }
+  }
+  
+  return log_set_level_by_name(string);
+} // log_set_level_from_string()
+
+/**
+ * @brief Get the ID of the logger called `name`, registering it if needed.
+ *        Look it up once (at startup, or into a static) and pass the ID to
+ *        the log_named_*() macros.
+ * 
+ * Names are dot-separated paths, like "db.pool". A logger's level is the one
+ * set for it with log_set_logger_level(), or else its nearest ancestor's
+ * ("db"), or else the global level.
+ * 
+ * @return int The ID, or `-1` if `name` is LOG_LOGGER_NAME_SIZE bytes or
+ *             more, or LOG_MAX_LOGGERS are registered already.
+ */
+int
+log_get_logger(const char *name) {
+  lock();
+  int id = logger_add(name);
+  loggers_resolve();
+  unlock();
+  return id;
+}
+
+/**
+ * @brief The name of logger `id`, or `NULL` if there's no such logger.
+ */
+const char *
+log_get_logger_name(int id) {
+  if (id < 0 || id >= ATOMIC_LOAD(&L.loggers.count, ACQUIRE)) {
+    return NULL;
+  }
+  return L.loggers.names[id];
+}
+
+/**
+ * @brief Set the level of the logger called `name` (registering it if
+ *        needed), and of its descendants that don't have one set.
+ * 
+ * @return int The logger's ID, or `-1` if it couldn't be registered (see
+ *             log_get_logger()) or `level` is bad.
+ */
+int
+log_set_logger_level(const char *name, int level) {
+  if (!log_is_level(level)) {
+    log_error("Tried to set bad log level %d", level);
+    return -1;
+  }
+  
+  lock();
+  int id = logger_add(name);
+  if (id >= 0) {
+    L.loggers.configured[id] = level;
+    loggers_resolve();
+  }
+  unlock();
+  return id;
+} // log_set_logger_level()
+
+
+// Clocks
+// ---------------------------------------------------------------------------
+// 
+// Clock functions for log_set_clock(). Each fills in the time since the
+// epoch (or since boot, for log_clock_monotonic()).
+// 
+
+/**
+ * @brief `clock_gettime(CLOCK_REALTIME)` - the default.
+ */
+void
+log_clock_realtime(void *udata, struct timespec *now) {
+  (void)udata;
+  clock_realtime(now);
+}
+
+/**
+ * @brief `CLOCK_REALTIME_COARSE` where there is one: cheaper, but only as
+ *        precise as the scheduler tick (a few milliseconds).
+ */
+void
+log_clock_realtime_coarse(void *udata, struct timespec *now) {
+  (void)udata;
+#ifdef CLOCK_REALTIME_COARSE
+  clock_gettime(CLOCK_REALTIME_COARSE, now);
+#else
+  clock_realtime(now);
+#endif
+}
+
+/**
+ * @brief `CLOCK_MONOTONIC`, which never jumps, but counts from boot rather
+ *        than the epoch - so dates come out in 1970.
+ */
+void
+log_clock_monotonic(void *udata, struct timespec *now) {
+  (void)udata;
+#ifdef LOG_HAVE_POSIX
+  clock_gettime(CLOCK_MONOTONIC, now);
+#else
+  clock_realtime(now);
+#endif
+}
+
+#ifdef LOG_HAVE_TSC
+
+static uint64_t
+read_tsc(void) {
+  return __builtin_ia32_rdtsc();
+}
+
+static int64_t
+timespec_ns(const struct timespec *ts) {
+  return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/**
+ * @brief Time the TSC against the monotonic clock for 10ms, and note the
+ *        real time to count from.
+ */
+static void
+tsc_calibrate(void) {
+  struct timespec start, end;
+  struct timespec nap = { 0, 10 * 1000 * 1000 };
+  
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t start_tsc = read_tsc();
+  nanosleep(&nap, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  uint64_t end_tsc = read_tsc();
+  
+  if (end_tsc <= start_tsc) {
+    return;
+  }
+  
+  clock_gettime(CLOCK_REALTIME, &L.tsc.base);
+  L.tsc.base_tsc = read_tsc();
+  L.tsc.ns_per_tick =
+    (double)(timespec_ns(&end) - timespec_ns(&start)) /
+    (double)(end_tsc - start_tsc);
+} // tsc_calibrate()
+
+#endif // #ifdef LOG_HAVE_TSC
+
+/**
+ * @brief Real time from the CPU's time stamp counter (x86), calibrated when
+ *        it's set with log_set_clock() - no system call or vDSO page at all.
+ *        Assumes an invariant TSC, and drifts from the real-time clock over
+ *        time (re-set it to recalibrate). Elsewhere, the real-time clock.
+ */
+void
+log_clock_tsc(void *udata, struct timespec *now) {
+  (void)udata;
+#ifdef LOG_HAVE_TSC
+  if (L.tsc.ns_per_tick > 0) {
+    int64_t ns = timespec_ns(&L.tsc.base) + (int64_t)(
+      (double)(read_tsc() - L.tsc.base_tsc) * L.tsc.ns_per_tick);
+    
+    now->tv_sec = (time_t)(ns / 1000000000);
+    now->tv_nsec = (long)(ns % 1000000000);
+    return;
+  }
+#endif
+  clock_realtime(now);
+}
+
+/**
+ * @brief Always the time `udata` points to (a `struct timespec`), for
+ *        deterministic output in tests. Change it to move time along.
+ */
+void
+log_clock_fixed(void *udata, struct timespec *now) {
+  *now = *(const struct timespec *)udata;
+}
+
+/**
+ * @brief Set the clock records are timestamped with - one of the
+ *        log_clock_*() functions or your own. Sub-second precision is kept in
+ *        the MessagePack and OTLP outputs; the text outputs show seconds.
+ * 
+ * @param fn    Clock function, or `NULL` for the real-time clock.
+ * @param udata Passed to `fn`.
+ */
+void
+log_set_clock(log_ClockFn fn, void *udata) {
+  lock();
+#ifdef LOG_HAVE_TSC
+  if (fn == log_clock_tsc) {
+    tsc_calibrate();
+  }
+#endif
+  L.clock = fn;
+  L.clock_udata = udata;
+  L.ts_cache.valid = false;
+  unlock();
+} // log_set_clock()
+
+
+// Doin' Stuff
+// ---------------------------------------------------------------------------
+
+/**
+ * @brief Initialize L (logger structure) values from environment variables,
+ * if present.
+ * 
+ * Only handles setting the log level. LOG_LEVEL_ENV_VAR is used as the env
+ * var name, which defaults to "LOG_LEVEL", but a custom prefix can be added
+ * by defining LOG_ENV_VAR_PREFIX.
+ * 
+ * Sets a flag the fist time called, then just returns immediately on subsequent
+ * calls, so don't worry about calling it multiple times in multiple places.
+ */
+void
+log_init_from_env(void) {
+  if (has_init_from_env) {
+    return;
+  }
+  
+  char *value = getenv(LOG_LEVEL_ENV_VAR);
+  
+  if (value != NULL) {
+    log_set_level_from_string(value);
+  }
+  
+  has_init_from_env = 1;
+} // log_init_from_env()
+
+/**
+ * @brief Write a formatted message to every output.
+ * 
+ * The timestamp is taken after the lock is acquired, and every output is
+ * written before it's released, so with a lock set (see log_set_lock())
+ * records from all threads come out in timestamp order - except those given
+ * a `when`. Real-time records are timestamped when they're queued, so can be
+ * older than records already written.
+ * 
+ * @param when  When the record happened, or `NULL` for now.
+ */
+static void
+write_message(int level,
+              const struct timespec *when,
+              const char *file,
+              int line,
+              const char *msg,
+              size_t msg_len) {
+  char out_storage[LOG_MSG_BUF_SIZE + 128];
+  Buffer out;
+  bool file_writer = false;
+  
+  buffer_init(&out, out_storage, sizeof(out_storage));
+
+  /* Acquire lock */
+  lock();
+
+  /* Get current time */
+  struct timespec now;
+  if (when) {
+    now = *when;
+  } else {
+    read_clock(&now);
+  }
+  const Timestamp *ts = timestamp_for(now.tv_sec);
+
+  /* Log to stderr (unless the file *is* stderr, which is written below) */
+  if (!L.quiet && !L.fp_is_stderr) {
+    append_stderr_line(&out, ts, level, file, line, msg, msg_len);
+    write_stderr_buffer(&out, level);
+  }
+
+  /* Log to file */
+  if (L.fp) {
+    out.len = 0;
+    append_file_line(&out, ts, level, file, line, msg, msg_len);
+    file_writer = write_file_buffer(&out);
+    
+    if (L.bloom.bits) {
+      bloom_add_message(msg, msg_len);
+    }
+  }
+
+#ifdef LOG_USE_SHM
+  /* Publish to the shared memory ring */
+  if (L.shm) {
+    out.len = 0;
+    append_file_line(&out, ts, level, file, line, msg, msg_len);
+    shm_write(L.shm, out.data, out.len);
+  }
+#endif
+
+#ifdef LOG_USE_MSGPACK
+  /* Log to MessagePack stream */
+  if (L.msgpack_fp) {
+    write_msgpack_record(
+      L.msgpack_fp, now.tv_sec, now.tv_nsec, level, file, line, msg, msg_len);
+    fflush(L.msgpack_fp);
+  }
+#endif
+
+#ifdef LOG_USE_OTLP
+  /* Export to the OpenTelemetry collector */
+  if (L.otlp.host) {
+    otlp_add_record(now.tv_sec, now.tv_nsec, level, file, line, msg, msg_len);
+  }
+#endif
+
+  /* Release lock */
+  unlock();
+  
+  /* Write out the file queue, if it's ours to */
+  if (file_writer) {
+    write_file_queue();
+  }
+  
+  buffer_free(&out);
+} // write_message()
+
+/**
+ * @brief Format a message and write it to every output. Does the work for
+ *        log_log() and log_named_log(), once they've checked the level.
+ * 
+ * The message is formatted once, before the lock is acquired, into a buffer
+ * of LOG_MSG_BUF_SIZE bytes on the stack (moving to the heap if it doesn't
+ * fit). Each text output then gets its whole line assembled in memory and
+ * written with a single fwrite().
+ * 
+ * @param logger  Name to prefix the message with (`[name] `), or `NULL`.
+ */
+static void
+write_record(int level,
+             const char *logger,
+             const char *file,
+             int line,
+             const char *fmt,
+             va_list args) {
+  char msg_storage[LOG_MSG_BUF_SIZE];
+  Buffer msg;
+  
+  buffer_init(&msg, msg_storage, sizeof(msg_storage));
+  
+  if (logger != NULL) {
+    buffer_printf(&msg, "[%s] ", logger);
+  }
+  buffer_vprintf(&msg, fmt, args);
+  
+  write_message(level, NULL, file, line, msg.data, msg.len);
+  
+  buffer_free(&msg);
+} // write_record()
+
+/**
+ * @brief Does the actual logging of a message. You should not want or need to 
+ *        call this function directly - use the log_trace(), log_debug(), etc.
+ *        macros.
+ * 
+ * @param level Level of the message. Note that is is **NOT VALIDATED**, and 
+ *              passing a bad level is likely to have bad consequences.
+ * @param file  File name to cite in the log.
+ * @param line  Line number to cite in the log.
+ * @param fmt   The format string for the message (printf-style).
+ * @param ...   Arguments to substitute into `fmt`.
+ */
+void
+log_log(int level, const char *file, int line, const char *fmt, ...) {
+  if (!level_enabled(level, L.level) || mem_drop_record(level)) {
+    return;
+  }
+  
+  va_list args;
+  va_start(args, fmt);
+  write_record(level, NULL, file, line, fmt, args);
+  va_end(args);
+} // log_log()
+
+/**
+ * @brief Log a message from a named logger (see log_get_logger()). You should
+ *        not want or need to call this function directly - use the
+ *        log_named_trace(), log_named_debug(), etc. macros.
+ * 
+ * The level check is one load from the flattened table of effective levels.
+ * The message is prefixed with the logger's name, as `[db.pool] `.
+ * 
+ * @param logger  ID from log_get_logger(). Anything else (like the `-1` it
+ *                returns when the table is full) logs as log_log() would.
+ * @param level   Level of the message (**NOT VALIDATED**, as log_log()).
+ * @param file    File name to cite in the log.
+ * @param line    Line number to cite in the log.
+ * @param fmt     The format string for the message (printf-style).
+ * @param ...     Arguments to substitute into `fmt`.
+ */
+void
+log_named_log(int logger,
+              int level,
+              const char *file,
+              int line,
+              const char *fmt,
+              ...) {
+  bool named = logger >= 0 &&
+    logger < ATOMIC_LOAD(&L.loggers.count, ACQUIRE);
+  int threshold = named ? L.loggers.levels[logger] : L.level;
+  
+  if (!level_enabled(level, threshold) || mem_drop_record(level)) {
+    return;
+  }
+  
+  va_list args;
+  va_start(args, fmt);
+  write_record(
+    level, named ? L.loggers.names[logger] : NULL, file, line, fmt, args);
+  va_end(args);
+} // log_named_log()
+
+/**
+ * @brief Log a numeric array as one record. You should not want or need to
+ *        call this function directly - use the log_array() macro.
+ * 
+ * The record reads `label[count] = {1, 2, 3}`. Integers are converted two
+ * digits at a time and floats printed in the fewest digits that read back
+ * exactly, straight into the record buffer. Past LOG_ARRAY_MAX_ELEMS
+ * elements the rest are elided and the min, max and mean appended:
+ * 
+ *     latency_us[1000] = {12, 15, 9, ..., +968 more} min=3 max=9000 mean=45.2
+ * 
+ * @param label   What the array is.
+ * @param type    LOG_I32, LOG_I64, LOG_U32, LOG_U64, LOG_F32 or LOG_F64, or'd
+ *                with LOG_ARRAY_SUMMARY to print just the min, max and mean.
+ * @param array   The elements.
+ * @param count   How many.
+ */
+void
+log_array_log(int level,
+              const char *file,
+              int line,
+              const char *label,
+              int type,
+              const void *array,
+              size_t count) {
+  if (!level_enabled(level, L.level) || mem_drop_record(level)) {
+    return;
+  }
+  
+  bool summary = (type & LOG_ARRAY_SUMMARY) != 0;
+  type &= ~LOG_ARRAY_SUMMARY;
+  
+  if (array_elem_size(type) == 0) {
+    log_error("Tried to log array %s of bad type %d", label, type);
+    return;
+  }
+  
+  char msg_storage[LOG_MSG_BUF_SIZE];
+  Buffer msg;
+  
+  buffer_init(&msg, msg_storage, sizeof(msg_storage));
+  
+  buffer_append(&msg, label, strlen(label));
+  buffer_append(&msg, "[", 1);
+  buffer_append_u64(&msg, count);
+  
+  if (summary) {
+    buffer_append(&msg, "]:", 2);
+  } else {
+    size_t shown = count > LOG_ARRAY_MAX_ELEMS ? LOG_ARRAY_MAX_ELEMS : count;
+    
+    buffer_append(&msg, "] = {", 5);
+    for (size_t i = 0; i < shown; i++) {
+      if (i > 0) {
+        buffer_append(&msg, ", ", 2);
+      }
+      buffer_append_value(&msg, type, array_get(type, array, i));
+    }
+    if (shown < count) {
+      buffer_append(&msg, ", ..., +", 8);
+      buffer_append_u64(&msg, count - shown);
+      buffer_append(&msg, " more", 5);
+    }
+    buffer_append(&msg, "}", 1);
+    
+    summary = shown < count;
+  }
+  
+  if (summary && count > 0) {
+    buffer_append_summary(&msg, type, array, count);
+  }
+  
+  write_message(level, NULL, file, line, msg.data, msg.len);
+  
+  buffer_free(&msg);
+} // log_array_log()
+
+
+/**
+ * @brief Write out any stderr output being held back (see
+ *        log_set_stderr_flush()), and save the file output's index (see
+ *        log_set_fp_indexed()).
+ */
+void
+log_flush(void) {
+  lock();
+  stderr_flush();
+  bloom_save();
+  unlock();
+}
+
+
+// Batches
+// ---------------------------------------------------------------------------
+// 
+// For logging a bunch of lines at once (dumping a table, per-item results)
+// without paying for the level check, lock, timestamp and flush on every
+// line. The lock is held from log_batch_begin() to log_batch_commit(), so the
+// batch comes out contiguous.
+// 
+
+/**
+ * @brief Does the calling thread have the batch open? Another thread's batch
+ *        doesn't count - its lines and its lock aren't ours to touch.
+ * 
+ * Without thread-local storage all there is to go on is whether a batch is
+ * open at all.
+ */
+static bool
+batch_is_open(void) {
+#ifdef LOG_THREAD_LOCAL
+  return thread_batch_open;
+#else
+  return L.batch.active;
+#endif
+}
+
+/**
+ * @brief Start a batch of records at `level`.
+ * 
+ * If `level` is enabled this acquires the lock and takes the timestamp every
+ * line in the batch will share; lines added with log_batch_add() are then
+ * collected in memory until log_batch_commit() writes them.
+ * 
+ * @warning Batches don't nest, and since the lock is held don't call the
+ *          other log_*() functions from the same thread until
+ *          log_batch_commit().
+ * 
+ * @return bool Whether `level` is enabled. If not, log_batch_add() and
+ *              log_batch_commit() do nothing, so callers can skip building
+ *              the lines entirely. That's so even if another thread has a
+ *              batch open at the time.
+ */
+bool
+log_batch_begin(int level) {
+#if defined(LOG_USE_USDT) && defined(__x86_64__)
+  thread_batch_level = level;
+#endif
+  
+  if (!level_enabled(level, L.level) || mem_drop_record(level)) {
+    return false;
+  }
+  
+  lock();
+  
+#ifdef LOG_THREAD_LOCAL
+  thread_batch_open = true;
+#endif
+  L.batch.active = true;
+  L.batch.level = level;
+  read_clock(&L.batch.time);
+  L.batch.ts = *timestamp_for(L.batch.time.tv_sec);
+  L.batch.err_out.len = 0;
+  L.batch.file_out.len = 0;
+  
+  return true;
+} // log_batch_begin()
+
+/**
+ * @brief Add a line to the current batch. You should not want or need to 
+ *        call this function directly - use the log_batch_add() macro.
+ * 
+ * @param file  File name to cite in the log.
+ * @param line  Line number to cite in the log.
+ * @param fmt   The format string for the message (printf-style).
+ * @param ...   Arguments to substitute into `fmt`.
+ */
+void
+log_batch_log(const char *file, int line, const char *fmt, ...) {
+#if defined(LOG_USE_USDT) && defined(__x86_64__)
+  // Here rather than in the macro, which doesn't know the level
+  LOG_USDT(thread_batch_level, file, line, fmt);
+#endif
+  
+  if (!batch_is_open()) {
+    return;
+  }
+  
+  va_list args;
+  char msg_storage[LOG_MSG_BUF_SIZE];
+  Buffer msg;
+  
+  buffer_init(&msg, msg_storage, sizeof(msg_storage));
+  
+  va_start(args, fmt);
+  buffer_vprintf(&msg, fmt, args);
+  va_end(args);
+  
+  if (!L.quiet && !L.fp_is_stderr) {
+    append_stderr_line(
+      &L.batch.err_out, &L.batch.ts, L.batch.level, file, line,
+      msg.data, msg.len);
+  }
+  
+  if (L.fp) {
+    append_file_line(
+      &L.batch.file_out, &L.batch.ts, L.batch.level, file, line,
+      msg.data, msg.len);
+    
+    if (L.bloom.bits) {
+      bloom_add_message(msg.data, msg.len);
+    }
+  }
+  
+#ifdef LOG_USE_SHM
+  if (L.shm) {
+    char out_storage[LOG_MSG_BUF_SIZE + 128];
+    Buffer out;
+    
+    buffer_init(&out, out_storage, sizeof(out_storage));
+    append_file_line(
+      &out, &L.batch.ts, L.batch.level, file, line, msg.data, msg.len);
+    shm_write(L.shm, out.data, out.len);
+    buffer_free(&out);
+  }
+#endif
+  
+#ifdef LOG_USE_MSGPACK
+  if (L.msgpack_fp) {
+    write_msgpack_record(
+      L.msgpack_fp, L.batch.time.tv_sec, L.batch.time.tv_nsec,
+      L.batch.level, file, line,
+      msg.data, msg.len);
+  }
+#endif
+  
+#ifdef LOG_USE_OTLP
+  if (L.otlp.host) {
+    otlp_add_record(
+      L.batch.time.tv_sec, L.batch.time.tv_nsec, L.batch.level, file, line,
+      msg.data, msg.len);
+  }
+#endif
+  
+  buffer_free(&msg);
+} // log_batch_log()
+
+/**
+ * @brief Write out the current batch - one fwrite() and flush per output -
+ *        and release the lock.
+ */
+void
+log_batch_commit(void) {
+  bool file_writer = false;
+  
+  if (!batch_is_open()) {
+    return;
+  }
+  
+  if (L.batch.err_out.len > 0) {
+    write_stderr_buffer(&L.batch.err_out, L.batch.level);
+  }
+  
+  if (L.fp && L.batch.file_out.len > 0) {
+    file_writer = write_file_buffer(&L.batch.file_out);
+  }
+  
+#ifdef LOG_USE_MSGPACK
+  if (L.msgpack_fp) {
+    fflush(L.msgpack_fp);
+  }
+#endif
+  
+  // Hang on to the buffers for the next batch, unless they got big or memory
+  // is getting tight
+  size_t keep_size = LOG_BATCH_KEEP_SIZE;
+  if (L.mem.budget > 0 &&
+      ATOMIC_LOAD(&L.mem.used, RELAXED) > L.mem.budget / 2) {
+    keep_size = 0;
+  }
+  if (L.batch.err_out.cap > keep_size) {
+    buffer_free(&L.batch.err_out);
+  }
+  if (L.batch.file_out.cap > keep_size) {
+    buffer_free(&L.batch.file_out);
+  }
+  
+  L.batch.active = false;
+#ifdef LOG_THREAD_LOCAL
+  thread_batch_open = false;
+#endif
+  
+  unlock();
+  
+  if (file_writer) {
+    write_file_queue();
+  }
+} // log_batch_commit()
+
+
+#ifdef LOG_USE_MSGPACK
+// MessagePack Decoding
+// ---------------------------------------------------------------------------
+// 
+// Reads back what write_msgpack_record() writes. Works on one whole frame in
+// memory at a time, with every read bounds-checked against the frame.
+// 
+
+typedef struct {
+  const unsigned char *p;
+  const unsigned char *end;
+} mp_reader;
+
+static bool
+mp_get_be(mp_reader *r, int bytes, uint64_t *value) {
+  if (r->end - r->p < bytes) {
+    return false;
+  }
+  
+  *value = 0;
+  for (int i = 0; i < bytes; i++) {
+    *value = (*value << 8) | *r->p++;
+  }
+  return true;
+}
+
+static bool
+mp_get_int(mp_reader *r, int64_t *value) {
+  uint64_t raw;
+  int bytes;
+  bool is_signed;
+  
+  if (r->p >= r->end) {
+    return false;
+  }
+  
+  unsigned char type = *r->p++;
+  
+  if (type <= 0x7f) {
+    // positive fixint
+    *value = type;
+    return true;
+  } else if (type >= 0xe0) {
+    // negative fixint
+    *value = (int8_t)type;
+    return true;
+  } else if (type >= 0xcc && type <= 0xcf) {
+    // uint 8, 16, 32, 64
+    bytes = 1 << (type - 0xcc);
+    is_signed = false;
+  } else if (type >= 0xd0 && type <= 0xd3) {
+    // int 8, 16, 32, 64
+    bytes = 1 << (type - 0xd0);
+    is_signed = true;
+  } else {
+    return false;
+  }
+  
+  if (!mp_get_be(r, bytes, &raw)) {
+    return false;
+  }
+  
+  if (!is_signed) {
+    *value = (int64_t)raw;
+  } else if (bytes == 1) {
+    *value = (int8_t)raw;
+  } else if (bytes == 2) {
+    *value = (int16_t)raw;
+  } else if (bytes == 4) {
+    *value = (int32_t)raw;
+  } else {
+    *value = (int64_t)raw;
+  }
+  return true;
+} // mp_get_int()
+
+/**
+ * @brief Read a string header and point `str` at its (*not*
+ *        `NULL`-terminated) bytes inside the frame.
+ */
+static bool
+mp_get_str(mp_reader *r, const char **str, size_t *len) {
+  uint64_t raw;
+  
+  if (r->p >= r->end) {
+    return false;
+  }
+  
+  unsigned char type = *r->p++;
+  
+  if ((type & 0xe0) == 0xa0) {
+    raw = type & 0x1f;
+  } else if (type == 0xd9) {
+    if (!mp_get_be(r, 1, &raw)) return false;
+  } else if (type == 0xda) {
+    if (!mp_get_be(r, 2, &raw)) return false;
+  } else if (type == 0xdb) {
+    if (!mp_get_be(r, 4, &raw)) return false;
+  } else {
+    return false;
+  }
+  
+  if ((uint64_t)(r->end - r->p) < raw) {
+    return false;
+  }
+  
+  *str = (const char *)r->p;
+  *len = (size_t)raw;
+  r->p += raw;
+  return true;
+} // mp_get_str()
+
+static bool
+mp_get_time(mp_reader *r, int64_t *sec, long *nsec) {
+  uint64_t raw, hi;
+  
+  if (r->end - r->p < 2) {
+    return false;
+  }
+  
+  if (r->p[0] == 0xd6 && (int8_t)r->p[1] == MSGPACK_EXT_TIMESTAMP) {
+    r->p += 2;
+    if (!mp_get_be(r, 4, &raw)) return false;
+    *sec = (int64_t)raw;
+    *nsec = 0;
+  } else if (r->p[0] == 0xd7 && (int8_t)r->p[1] == MSGPACK_EXT_TIMESTAMP) {
+    r->p += 2;
+    if (!mp_get_be(r, 8, &raw)) return false;
+    *sec = (int64_t)(raw & (((uint64_t)1 << 34) - 1));
+    *nsec = (long)(raw >> 34);
+  } else if ( r->end - r->p >= 3 &&
+              r->p[0] == 0xc7 &&
+              r->p[1] == 12 &&
+              (int8_t)r->p[2] == MSGPACK_EXT_TIMESTAMP ) {
+    r->p += 3;
+    if (!mp_get_be(r, 4, &hi) || !mp_get_be(r, 8, &raw)) return false;
+    *nsec = (long)hi;
+    *sec = (int64_t)raw;
+  } else {
+    return false;
+  }
+  return true;
+} // mp_get_time()
+
+/**
+ * @brief Skip over any single value, so records can grow keys without
+ *        breaking older readers.
+ */
+static bool
+mp_skip(mp_reader *r, int depth) {
+  uint64_t count = 0;   // nested values to skip after
+  uint64_t skip = 0;    // bytes to skip
+  
+  if (r->p >= r->end || depth > 32) {
+    return false;
+  }
+  
+  unsigned char type = *r->p++;
+  
+  if (type <= 0x7f || type >= 0xe0 || type == 0xc0 || type == 0xc2 ||
+      type == 0xc3) {
+    // fixints, nil, false, true
+    return true;
+  } else if ((type & 0xe0) == 0xa0) {
+    // fixstr
+    skip = type & 0x1f;
+  } else if ((type & 0xf0) == 0x90) {
+    // fixarray
+    count = type & 0x0f;
+  } else if ((type & 0xf0) == 0x80) {
+    // fixmap
+    count = (type & 0x0f) * 2;
+  } else if (type >= 0xc4 && type <= 0xc6) {
+    // bin 8, 16, 32
+    if (!mp_get_be(r, 1 << (type - 0xc4), &skip)) return false;
+  } else if (type >= 0xc7 && type <= 0xc9) {
+    // ext 8, 16, 32 (length doesn't include the type byte)
+    if (!mp_get_be(r, 1 << (type - 0xc7), &skip)) return false;
+    skip += 1;
+  } else if (type == 0xca) {
+    // float 32
+    skip = 4;
+  } else if (type == 0xcb) {
+    // float 64
+    skip = 8;
+  } else if (type >= 0xcc && type <= 0xcf) {
+    // uint 8, 16, 32, 64
+    skip = 1 << (type - 0xcc);
+  } else if (type >= 0xd0 && type <= 0xd3) {
+    // int 8, 16, 32, 64
+    skip = 1 << (type - 0xd0);
+  } else if (type >= 0xd4 && type <= 0xd8) {
+    // fixext 1, 2, 4, 8, 16 (plus the type byte)
+    skip = 1 + (1 << (type - 0xd4));
+  } else if (type >= 0xd9 && type <= 0xdb) {
+    // str 8, 16, 32
+    if (!mp_get_be(r, 1 << (type - 0xd9), &skip)) return false;
+  } else if (type == 0xdc || type == 0xdd) {
+    // array 16, 32
+    if (!mp_get_be(r, type == 0xdc ? 2 : 4, &count)) return false;
+  } else if (type == 0xde || type == 0xdf) {
+    // map 16, 32
+    if (!mp_get_be(r, type == 0xde ? 2 : 4, &count)) return false;
+    count *= 2;
+  } else {
+    return false;
+  }
+  
+  if ((uint64_t)(r->end - r->p) < skip) {
+    return false;
+  }
+  r->p += skip;
+  
+  for (uint64_t i = 0; i < count; i++) {
+    if (!mp_skip(r, depth + 1)) {
+      return false;
+    }
+  }
+  return true;
+} // mp_skip()
+
+static char *
+copy_str(const char *str, size_t len) {
+  char *copy = mem_alloc(len + 1);
+  
+  if (copy != NULL) {
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+  }
+  return copy;
+}
+
+/**
+ * @brief Record an interned string definition in the reader.
+ */
+static bool
+define_interned(log_MsgpackReader *reader,
+                int64_t id,
+                const char *str,
+                size_t len) {
+  if (id < 0 || id > MSGPACK_MAX_INTERN_ID) {
+    return false;
+  }
+  
+  if ((size_t)id >= reader->num_strings) {
+    size_t num_strings = (size_t)id + 1;
+    char **strings =
+      mem_realloc(reader->strings, num_strings * sizeof(char *));
+    
+    if (strings == NULL) {
+      return false;
+    }
+    
+    memset(
+      strings + reader->num_strings, 0,
+      (num_strings - reader->num_strings) * sizeof(char *));
+    reader->strings = strings;
+    reader->num_strings = num_strings;
+  }
+  
+  mem_free(reader->strings[id]);
+  reader->strings[id] = copy_str(str, len);
+  return reader->strings[id] != NULL;
+} // define_interned()
+
+/**
+ * @brief Decode one frame's payload into `record`, or into the reader's
+ *        interned strings if it's a definition frame.
+ * 
+ * @param is_def Set `true` when the frame was a definition.
+ */
+static bool
+decode_msgpack_frame(log_MsgpackReader *reader,
+                     mp_reader *r,
+                     log_Record *record,
+                     bool *is_def) {
+  uint64_t count;
+  int64_t value;
+  int64_t def_id = -1;
+  const char *key, *str;
+  const char *def_str = NULL;
+  size_t key_len, len, def_len = 0;
+  
+  if (r->p >= r->end) {
+    return false;
+  }
+  
+  if ((*r->p & 0xf0) == 0x80) {
+    count = *r->p++ & 0x0f;
+  } else if (*r->p == 0xde) {
+    r->p++;
+    if (!mp_get_be(r, 2, &count)) return false;
+  } else {
+    return false;
+  }
+  
+#define KEY_IS(name) \
+  (key_len == sizeof(name) - 1 && 0 == memcmp(key, name, key_len))
+  
+  for (uint64_t i = 0; i < count; i++) {
+    if (!mp_get_str(r, &key, &key_len)) {
+      return false;
+    }
+    
+    if (KEY_IS("t")) {
+      int64_t sec;
+      if (!mp_get_time(r, &sec, &record->nsec)) return false;
+      record->time = (time_t)sec;
+    } else if (KEY_IS("lvl")) {
+      if (!mp_get_int(r, &value)) return false;
+      record->level = (int)value;
+    } else if (KEY_IS("line")) {
+      if (!mp_get_int(r, &value)) return false;
+      record->line = (int)value;
+    } else if (KEY_IS("file") && r->p < r->end && (*r->p & 0xe0) != 0xa0 &&
+               (*r->p < 0xd9 || *r->p > 0xdb)) {
+      // Interned file name ID
+      if (!mp_get_int(r, &value)) return false;
+      if (value < 0 || (uint64_t)value >= reader->num_strings ||
+          reader->strings[value] == NULL) {
+        return false;
+      }
+      mem_free(record->file);
+      record->file = copy_str(
+        reader->strings[value], strlen(reader->strings[value]));
+      if (record->file == NULL) return false;
+    } else if (KEY_IS("file") || KEY_IS("msg")) {
+      char **dest = KEY_IS("file") ? &record->file : &record->msg;
+      if (!mp_get_str(r, &str, &len)) return false;
+      mem_free(*dest);
+      *dest = copy_str(str, len);
+      if (*dest == NULL) return false;
+      if (dest == &record->msg) record->msg_len = len;
+    } else if (KEY_IS("def")) {
+      if (!mp_get_int(r, &def_id)) return false;
+    } else if (KEY_IS("str")) {
+      if (!mp_get_str(r, &def_str, &def_len)) return false;
+    } else if (!mp_skip(r, 0)) {
+      return false;
+    }
+  }
+  
+#undef KEY_IS
+  
+  *is_def = (def_id >= 0);
+  
+  if (*is_def) {
+    return def_str != NULL && define_interned(reader, def_id, def_str, def_len);
+  }
+  return record->file != NULL && record->msg != NULL;
+} // decode_msgpack_frame()
+
+/**
+ * @brief Set up a reader for a stream written by the MessagePack output.
+ * 
+ * @param fp Stream to read from (binary mode). Not closed by
+ *           log_msgpack_reader_free().
+ */
+void
+log_msgpack_reader_init(log_MsgpackReader *reader, FILE *fp) {
+  reader->fp = fp;
+  reader->strings = NULL;
+  reader->num_strings = 0;
+}
+
+/**
+ * @brief Free the interned strings a reader has collected.
+ */
+void
+log_msgpack_reader_free(log_MsgpackReader *reader) {
+  for (size_t i = 0; i < reader->num_strings; i++) {
+    mem_free(reader->strings[i]);
+  }
+  mem_free(reader->strings);
+  reader->strings = NULL;
+  reader->num_strings = 0;
+}
+
+/**
+ * @brief Read the next record from a stream written by the MessagePack output
+ *        (see log_set_msgpack_fp()).
+ * 
+ * Reads one record frame (plus any string definitions before it), so it can
+ * be called in a loop on a pipe or socket as records arrive. Interned file
+ * names are expanded, so `record->file` is always a string.
+ * 
+ * @param reader Reader from log_msgpack_reader_init().
+ * @param record Filled in on success. Release with log_record_free().
+ * 
+ * @return int `1` when a record was read, `0` at a clean end of stream, `-1`
+ *             on a truncated or malformed frame.
+ */
+int
+log_msgpack_read(log_MsgpackReader *reader, log_Record *record) {
+  unsigned char prefix[4];
+  bool is_def = true;
+  
+  while (is_def) {
+    size_t got = fread(prefix, 1, sizeof(prefix), reader->fp);
+    
+    memset(record, 0, sizeof(*record));
+    
+    if (got == 0 && feof(reader->fp)) {
+      return 0;
+    }
+    if (got != sizeof(prefix)) {
+      return -1;
+    }
+    
+    size_t size =
+      ((size_t)prefix[0] << 24) | ((size_t)prefix[1] << 16) |
+      ((size_t)prefix[2] << 8) | (size_t)prefix[3];
+    
+    if (size > LOG_MSGPACK_MAX_FRAME) {
+      return -1;
+    }
+    
+    unsigned char *frame = mem_alloc(size > 0 ? size : 1);
+    if (frame == NULL) {
+      return -1;
+    }
+    
+    if (fread(frame, 1, size, reader->fp) != size) {
+      mem_free(frame);
+      return -1;
+    }
+    
+    mp_reader r = { frame, frame + size };
+    bool ok = decode_msgpack_frame(reader, &r, record, &is_def);
+    
+    mem_free(frame);
+    
+    if (!ok || is_def) {
+      log_record_free(record);
+    }
+    if (!ok) {
+      return -1;
+    }
+  }
+  
+  return 1;
+} // log_msgpack_read()
+
+/**
+ * @brief Free the strings log_msgpack_read() allocated in a record (not the
+ *        record itself).
+ */
+void
+log_record_free(log_Record *record) {
+  mem_free(record->file);
+  mem_free(record->msg);
+  record->file = NULL;
+  record->msg = NULL;
+}
+
+/**
+ * @brief Convert a MessagePack log stream to the text file format (as written
+ *        by log_set_fp()).
+ * 
+ * Flushes after each record, so it can sit on the end of a pipe.
+ * 
+ * @return int Number of records converted, or `-1` if the input was
+ *             malformed (records before the bad one are still written).
+ */
+int
+log_msgpack_to_text(FILE *in, FILE *out) {
+  log_MsgpackReader reader;
+  log_Record record;
+  int count = 0;
+  int status;
+  
+  log_msgpack_reader_init(&reader, in);
+  
+  while ((status = log_msgpack_read(&reader, &record)) == 1) {
+    char out_storage[LOG_MSG_BUF_SIZE];
+    Buffer buffer;
+    Timestamp ts;
+    int level = log_is_level(record.level) ? record.level : LOG_FATAL;
+    
+    buffer_init(&buffer, out_storage, sizeof(out_storage));
+    format_timestamp(&ts, record.time);
+    append_file_line(
+      &buffer, &ts, level, record.file, record.line,
+      record.msg, record.msg_len);
+    write_buffer(out, &buffer);
+    buffer_free(&buffer);
+    
+    log_record_free(&record);
+    count++;
+  }
+  
+  log_msgpack_reader_free(&reader);
+  
+  return status < 0 ? -1 : count;
+} // log_msgpack_to_text()
+
+#endif // #ifdef LOG_USE_MSGPACK
+
+
+#ifdef LOG_USE_OTLP
+// OTLP Export
+// ---------------------------------------------------------------------------
+
+static void
+otlp_at_exit(void) {
+  log_otlp_close();
+}
+
+/**
+ * @brief Start exporting records to an OpenTelemetry collector over OTLP/HTTP
+ *        (protobuf), in addition to the other outputs.
+ * 
+ * Records are batched and POST-ed to `http://host:port/v1/logs` once
+ * LOG_OTLP_BATCH_SIZE bytes or LOG_OTLP_BATCH_INTERVAL_MS have built up
+ * (checked as records arrive), and whatever is left is sent at exit. While
+ * the collector is down records are held, up to LOG_OTLP_MAX_PENDING bytes,
+ * and retried with backoff. Compiled with LOG_USE_ZLIB, batches are gzipped.
+ * 
+ * @note  Batches are sent from whichever thread logs the record that fills
+ *        them, with the lock held, so point this at a collector on the local
+ *        host.
+ * 
+ * @param host Collector host, like "localhost".
+ * @param port Collector port, like "4318".
+ * 
+ * @return int `0` on success, `-1` if out of memory.
+ */
+int
+log_otlp_open(const char *host, const char *port) {
+  char *host_copy = mem_strdup(host);
+  char *port_copy = mem_strdup(port);
+  
+  if (host_copy == NULL || port_copy == NULL) {
+    mem_free(host_copy);
+    mem_free(port_copy);
+    return -1;
+  }
+  
+  log_otlp_close();
+  
+  lock();
+  L.otlp.host = host_copy;
+  L.otlp.port = port_copy;
+  L.otlp.backoff_ms = 0;
+  L.otlp.retry_at_ms = 0;
+  unlock();
+  
+  if (!L.otlp.at_exit_registered) {
+    atexit(otlp_at_exit);
+    L.otlp.at_exit_registered = true;
+  }
+  
+  return 0;
+} // log_otlp_open()
+
+/**
+ * @brief Send any pending records now, unless backing off after a failure.
+ * 
+ * Batches are otherwise only sent as records arrive, so call this
+ * periodically if logging can go quiet for long stretches.
+ * 
+ * @return size_t Number of records still pending.
+ */
+size_t
+log_otlp_flush(void) {
+  size_t pending;
+  
+  lock();
+  if (L.otlp.host) {
+    otlp_maybe_send(true);
+  }
+  pending = L.otlp.pending_count;
+  unlock();
+  
+  return pending;
+}
+
+/**
+ * @brief Make a last attempt to send pending records and stop exporting.
+ *        Anything that still can't be sent is spooled, if there's a spool,
+ *        or dropped.
+ */
+void
+log_otlp_close(void) {
+  lock();
+  
+  if (L.otlp.host) {
+    L.otlp.retry_at_ms = 0;
+    otlp_send();
+    otlp_drop_all();
+    buffer_free(&L.otlp.pending);
+    mem_free(L.otlp.host);
+    mem_free(L.otlp.port);
+    L.otlp.host = NULL;
+    L.otlp.port = NULL;
+  }
+  
+  if (L.otlp.spool_dir) {
+    if (L.otlp.spool_fd >= 0) {
+      close(L.otlp.spool_fd);
+    }
+    mem_free(L.otlp.spool_dir);
+    L.otlp.spool_dir = NULL;
+  }
+  
+  unlock();
+} // log_otlp_close()
+
+/**
+ * @brief Spool batches to disk while the collector is unreachable, and
+ *        replay them in order once it's back. Call after log_otlp_open().
+ * 
+ * Batches are appended to segment files named `otlp-<number>.spool` in `dir`,
+ * which roll over every LOG_OTLP_SPOOL_SEGMENT_SIZE bytes and are deleted as
+ * they're replayed. Replay is throttled to LOG_OTLP_SPOOL_REPLAY_FRAMES
+ * batches per send. Segments left by an earlier run are picked up and
+ * replayed too (so records may be sent twice if a run ends mid-replay).
+ * 
+ * @param dir       Existing directory to keep the segments in.
+ * @param max_bytes Most bytes to keep on disk; past that the oldest segments
+ *                  are deleted and their records counted as dropped.
+ * 
+ * @return int `0` on success, `-1` if `dir` can't be read or the exporter
+ *             isn't open.
+ */
+int
+log_otlp_set_spool(const char *dir, size_t max_bytes) {
+  char path[1024];
+  struct dirent *entry;
+  struct stat st;
+  bool found = false;
+  
+  if (L.otlp.host == NULL) {
+    return -1;
+  }
+  
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    return -1;
+  }
+  
+  char *dir_copy = mem_strdup(dir);
+  if (dir_copy == NULL) {
+    closedir(d);
+    return -1;
+  }
+  
+  lock();
+  
+  if (L.otlp.spool_dir) {
+    if (L.otlp.spool_fd >= 0) {
+      close(L.otlp.spool_fd);
+    }
+    mem_free(L.otlp.spool_dir);
   }
   
-  return log_level_strings()[level - LOG_TRACE];
-} // log_level_to_string()
-
-
-// State
-// ---------------------------------------------------------------------------
-// 
+  L.otlp.spool_dir = dir_copy;
+  L.otlp.spool_max = max_bytes;
+  L.otlp.spool_bytes = 0;
+  L.otlp.spool_first = 0;
+  L.otlp.spool_next = 0;
+  L.otlp.spool_read_offset = 0;
+  L.otlp.spool_fd = -1;
+  L.otlp.spool_fd_size = 0;
+  
+  // Pick up segments left by an earlier run
+  while ((entry = readdir(d)) != NULL) {
+    unsigned long long seq;
+    char suffix[8];
+    
+    if (  sscanf(entry->d_name, "otlp-%20llu.%7s", &seq, suffix) != 2 ||
+          strcmp(suffix, "spool") != 0 ) {
+      continue;
+    }
+    
+    spool_path(path, sizeof(path), seq);
+    if (stat(path, &st) != 0) {
+      continue;
+    }
+    
+    if (!found || seq < L.otlp.spool_first) {
+      L.otlp.spool_first = seq;
+    }
+    if (!found || seq > L.otlp.spool_next) {
+      L.otlp.spool_next = seq;
+    }
+    L.otlp.spool_bytes += (size_t)st.st_size;
+    found = true;
+  }
+  
+  unlock();
+  
+  closedir(d);
+  return 0;
+} // log_otlp_set_spool()
 
 /**
- * @brief Get the string version of the current level.
- * 
- * @note  **DO NOT free()** the returned strings! They're elements of an
- *        internal array, and we need them around.
- * 
- * @return const char * `NULL`-terminated string like "DEBUG". **DO NOT**
- *                      free()!
+ * @brief How many records have been dropped - because the collector was
+ *        unreachable long enough to fill LOG_OTLP_MAX_PENDING (or the spool),
+ *        or rejected them.
  */
-const char *
-log_get_level_name() {
-  return log_level_to_name(L.level);
+unsigned long
+log_otlp_dropped(void) {
+  return L.otlp.dropped;
 }
 
+#endif // #ifdef LOG_USE_OTLP
+
+
+#ifdef LOG_USE_SHM
+// Shared Memory Ring
+// ---------------------------------------------------------------------------
+
 /**
- * @brief Set the log level by a level_names member.
+ * @brief Start publishing records to a ring in POSIX shared memory (under
+ *        `/dev/shm` on Linux), for a reader in another process to consume with
+ *        the log_shm_reader_*() functions.
  * 
- * @see log_name_to_level()
+ * Each record is the file-format line (see log_set_fp()), newline included.
+ * When the reader falls behind far enough that a record won't fit, it is
+ * dropped and counted in the header.
  * 
- * @param name
- *    One of the level_names - "TRACE", "DEBUG", "INFO", "WARN", "ERROR" or
- *    "FATAL" (case-insensitive).
+ * The segment is created (or reset, if it exists) and stays around after
+ * log_shm_close() - `shm_unlink()` it when done.
  * 
- * @return int 
- *    The level that was set, or `-1` on failure.
+ * @param name     Shared memory object name, like "/myapp.log".
+ * @param capacity Bytes for records; rounded up to a power of 2.
+ * 
+ * @return int `0` on success, `-1` on failure (with `errno` set).
  */
-int log_set_level_by_name(char* name) {
-  int level = log_name_to_level(name);
-  if (level != BAD_LEVEL) {
-    log_set_level(level);
+int
+log_shm_open(const char *name, size_t capacity) {
+  size_t size = 4096;
+  
+  while (size < capacity) {
+    size *= 2;
   }
-  return level;
-}
-
-FILE
-*log_get_fp() {
-  return L.fp;
-}
+  capacity = size;
+  size += LOG_SHM_DATA_OFFSET;
+  
+  int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    return -1;
+  }
+  
+  if (ftruncate(fd, (off_t)size) != 0) {
+    close(fd);
+    return -1;
+  }
+  
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  
+  log_ShmHeader *header = map;
+  
+  memset(header, 0, sizeof(*header));
+  header->version = LOG_SHM_VERSION;
+  header->capacity = capacity;
+  // Magic last, so a reader doesn't see a half-initialized header
+  __atomic_store_n(&header->magic, LOG_SHM_MAGIC, __ATOMIC_RELEASE);
+  
+  log_shm_close();
+  
+  lock();
+  L.shm = header;
+  L.shm_size = size;
+  unlock();
+  
+  return 0;
+} // log_shm_open()
 
+/**
+ * @brief Stop publishing to the shared memory ring and unmap it.
+ */
 void
-log_set_fp(FILE *fp) {
-  L.fp = fp;
+log_shm_close(void) {
+  lock();
+  if (L.shm) {
+    munmap(L.shm, L.shm_size);
+    L.shm = NULL;
+    L.shm_size = 0;
+  }
+  unlock();
 }
 
+/**
+ * @brief Attach to a ring created by log_shm_open() (possibly in another
+ *        process).
+ * 
+ * @return int `0` on success, `-1` on failure (including a segment that
+ *             isn't a ring, or is a different version).
+ */
 int
-log_get_level() {
-  return L.level;
-}
+log_shm_reader_open(log_ShmReader *reader, const char *name) {
+  struct stat st;
+  
+  memset(reader, 0, sizeof(*reader));
+  
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < LOG_SHM_DATA_OFFSET) {
+    close(fd);
+    return -1;
+  }
+  
+  void *map = mmap(
+    NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  
+  log_ShmHeader *header = map;
+  
+  if (  __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != LOG_SHM_MAGIC ||
+        header->version != LOG_SHM_VERSION ||
+        header->capacity + LOG_SHM_DATA_OFFSET > (uint64_t)st.st_size ) {
+    munmap(map, (size_t)st.st_size);
+    return -1;
+  }
+  
+  reader->header = header;
+  reader->size = (size_t)st.st_size;
+  return 0;
+} // log_shm_reader_open()
 
 /**
- * @brief Set the log level.
+ * @brief Get the next record, in place in shared memory - no copy and, when
+ *        records are waiting, no syscall.
  * 
- * If `level` is not valid an error is logged and the log level remains as
- * before.
+ * The record stays valid until log_shm_reader_release(), which must be called
+ * before peeking again.
  * 
- * @param level 
+ * @param data       Set to the record's bytes (*not* `NULL`-terminated).
+ * @param len        Set to the record's length.
+ * @param timeout_ms How long to sleep waiting for a record when the ring is
+ *                   empty: `0` to not wait, `-1` to wait indefinitely.
+ * 
+ * @return int `1` with a record, `0` if none arrived in time.
  */
-void
-log_set_level(int level) {
-  if (!log_is_level(level)) {
-    log_error("Tried to set bad log level %d", level);
-    return;
+int
+log_shm_reader_peek(log_ShmReader *reader,
+                    const char **data,
+                    size_t *len,
+                    int timeout_ms) {
+  log_ShmHeader *header = reader->header;
+  uint64_t tail = header->tail;
+  char *base = shm_data(header);
+  
+  for (;;) {
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    
+    if (head != tail) {
+      uint64_t offset = tail & (header->capacity - 1);
+      uint32_t record_len;
+      
+      memcpy(&record_len, base + offset, 4);
+      
+      if (record_len == LOG_SHM_WRAP) {
+        // Producer wrapped; the record is at the start
+        tail += header->capacity - offset;
+        __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+        continue;
+      }
+      
+      *data = base + offset + 4;
+      *len = record_len;
+      reader->next_tail = tail + SHM_ALIGN(4 + record_len);
+      return 1;
+    }
+    
+    if (timeout_ms == 0) {
+      return 0;
+    }
+    
+    // Announce we're going to sleep, then check again before doing so; a
+    // producer publishing in between sees the flag and bumps wake_seq, so
+    // the FUTEX_WAIT returns right away.
+    uint32_t seq = __atomic_load_n(&header->wake_seq, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&header->reader_waiting, 1, __ATOMIC_SEQ_CST);
+    
+    if (__atomic_load_n(&header->head, __ATOMIC_SEQ_CST) != tail) {
+      __atomic_store_n(&header->reader_waiting, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+    
+    struct timespec timeout = {
+      timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000
+    };
+    
+    futex(&header->wake_seq, FUTEX_WAIT, seq, timeout_ms < 0 ? NULL : &timeout);
+    
+    // Only wait once; the caller decides whether to keep waiting
+    timeout_ms = 0;
   }
-  L.level = level;
-}
+} // log_shm_reader_peek()
 
 /**
- * @brief Is the logger in "quiet" mode - where logging to stderr is silenced,
- *        though file logging continues if configured (see log_get_fp() /
- *        log_set_fp()).
- * 
- * @return bool
+ * @brief Done with the record from log_shm_reader_peek(); hand its space
+ *        back to the producer.
  */
-bool
-log_get_quiet() {
-  return L.quiet;
+void
+log_shm_reader_release(log_ShmReader *reader) {
+  __atomic_store_n(&reader->header->tail, reader->next_tail, __ATOMIC_RELEASE);
 }
 
 /**
- * @brief Sets "quiet" mode - where logging to stderr is silenced, though file
- *        logging continues if configured (see log_get_fp() / log_set_fp()).
- * 
- * @param enable State to set: on (true) or off (false).
+ * @brief How many records the producer has dropped because the ring was
+ *        full.
  */
-void
-log_set_quiet(bool enable) {
-  L.quiet = enable;
+uint64_t
+log_shm_reader_dropped(const log_ShmReader *reader) {
+  return __atomic_load_n(&reader->header->dropped, __ATOMIC_RELAXED);
 }
 
 void
-log_set_udata(void *udata) {
-  L.udata = udata;
+log_shm_reader_close(log_ShmReader *reader) {
+  if (reader->header) {
+    munmap(reader->header, reader->size);
+    reader->header = NULL;
+  }
 }
 
-void
-log_set_lock(log_LockFn fn) {
-  L.lock = fn;
-}
+#endif // #ifdef LOG_USE_SHM
+
+
+#ifdef LOG_USE_RT
+// Real-Time Mode
+// ---------------------------------------------------------------------------
+// 
+// See rt_capture() and friends above. The producer side, log_rt_log(),
+// doesn't allocate, lock, format, call localtime() or touch stdio, and takes
+// a bounded number of steps; everything else happens on the drain thread.
+// 
 
 /**
- * @brief Set level given a string, which may be the string representation of
- * one of the level integers, or one of the level_names (case insensitive).
+ * @brief Write out everything in the rings, oldest first across them.
  * 
- * @see log_set_level_by_name()
- *
- * @param string
- *    Either a string representation of a level integer - "0" (LOG_TRACE)
- *    through "5" (LOG_FATAL) - or one of the level_names - "TRACE", "DEBUG",
- *    "INFO", "WARN", "ERROR" or "FATAL" (case-insensitive).
- *
- * @return int
- *    Level that was set, or BAD_LEVEL on failure.
+ * @return bool Whether there was anything.
  */
-int
-log_set_level_from_string(char* string) {
-  size_t length = strlen(string);
+static bool
+rt_drain(void) {
+  RtSlot next[LOG_RT_THREADS];
+  bool have[LOG_RT_THREADS];
+  unsigned num_rings = __atomic_load_n(&L.rt.num_rings, __ATOMIC_ACQUIRE);
+  bool any = false;
   
-  if (0 == length) {
-    log_error("Received empty string");
-    return BAD_LEVEL;
+  if (num_rings > LOG_RT_THREADS) {
+    num_rings = LOG_RT_THREADS;
   }
   
-  for (int level = LOG_TRACE; level <= LOG_FATAL; level++) {
-    if (0 == strcmp(string, log_level_to_string(level))) {
-      log_set_level(level);
-      return level;
-    }
+  for (unsigned i = 0; i < num_rings; i++) {
+    have[i] = rt_read(&rt_rings[i], &next[i]);
   }
   
-  return log_set_level_by_name(string);
-} // log_set_level_from_string()
-
+  for (;;) {
+    int oldest = -1;
+    
+    for (unsigned i = 0; i < num_rings; i++) {
+      if (have[i] && (oldest < 0 ||
+                      timespec_before(&next[i].time, &next[oldest].time))) {
+        oldest = (int)i;
+      }
+    }
+    
+    if (oldest < 0) {
+      return any;
+    }
+    
+    const RtSlot *record = &next[oldest];
+    char msg_storage[LOG_MSG_BUF_SIZE];
+    Buffer msg;
+    
+    buffer_init(&msg, msg_storage, sizeof(msg_storage));
+    rt_format(&msg, record);
+    write_message(
+      record->level, &record->time, record->file, record->line,
+      msg.data, msg.len);
+    buffer_free(&msg);
+    
+    any = true;
+    have[oldest] = rt_read(&rt_rings[oldest], &next[oldest]);
+  }
+} // rt_drain()
 
-// Doin' Stuff
-// ---------------------------------------------------------------------------
+static void *
+rt_drain_main(void *arg) {
+  struct timespec nap = { 0, LOG_RT_DRAIN_INTERVAL_US * 1000L };
+  
+  (void)arg;
+  
+  while (__atomic_load_n(&L.rt.running, __ATOMIC_ACQUIRE)) {
+    if (!rt_drain()) {
+      // Nothing's coming in to push buffered stderr output out
+      lock();
+      stderr_flush_stale();
+      unlock();
+      nanosleep(&nap, NULL);
+    }
+  }
+  
+  // Whatever came in since
+  rt_drain();
+  return NULL;
+} // rt_drain_main()
 
 /**
- * @brief Initialize L (logger structure) values from environment variables,
- * if present.
+ * @brief Queue a record from a real-time thread. You should not want or need
+ *        to call this function directly - use the log_rt_trace(),
+ *        log_rt_debug(), etc. macros.
  * 
- * Only handles setting the log level. LOG_LEVEL_ENV_VAR is used as the env
- * var name, which defaults to "LOG_LEVEL", but a custom prefix can be added
- * by defining LOG_ENV_VAR_PREFIX.
+ * The record goes into the calling thread's ring, with its arguments copied
+ * (strings up to LOG_RT_STR_SIZE bytes a record), and is formatted and
+ * written by the drain thread (see log_rt_start()). When the ring is full the
+ * record is dropped, or overwrites the oldest, depending on the policy.
  * 
- * Sets a flag the fist time called, then just returns immediately on subsequent
- * calls, so don't worry about calling it multiple times in multiple places.
+ * The only things called are the clock (see log_set_clock() - the default
+ * `clock_gettime()` is a vDSO call, log_clock_tsc() cheaper still) and, the
+ * first time a thread logs, one atomic increment to claim its ring.
+ * 
+ * @note  Pointers other than `%s` strings (`%p`) are kept as values, and
+ *        `long double`s are narrowed to `double`.
  */
 void
-log_init_from_env(void) {
-  if (has_init_from_env) {
+log_rt_log(int level, const char *file, int line, const char *fmt, ...) {
+  if (level < L.level) {
     return;
   }
   
-  char *value = getenv(LOG_LEVEL_ENV_VAR);
+  RtRing *ring = rt_thread_ring;
   
-  if (value != NULL) {
-    log_set_level_from_string(value);
+  if (ring == NULL && (ring = rt_claim()) == NULL) {
+    __atomic_add_fetch(&L.rt.lost, 1, __ATOMIC_RELAXED);
+    return;
   }
   
-  has_init_from_env = 1;
-} // log_init_from_env()
+  // Only this thread writes `head`
+  uint64_t head = ring->head;
+  
+  if (L.rt.policy == LOG_RT_DROP &&
+      head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RT_SLOTS) {
+    __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  
+  // A seqlock, so the drain can tell if a slot it's copying is overwritten:
+  // odd while being written, then 2 * position + 2
+  RtSlot *slot = &ring->slots[head & (LOG_RT_SLOTS - 1)];
+  
+  __atomic_store_n(&slot->seq, 2 * head + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  
+  read_clock(&slot->time);
+  slot->file = file;
+  slot->fmt = fmt;
+  slot->level = level;
+  slot->line = line;
+  
+  va_list args;
+  va_start(args, fmt);
+  rt_capture(slot, fmt, args);
+  va_end(args);
+  
+  __atomic_store_n(&slot->seq, 2 * head + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+} // log_rt_log()
 
 /**
- * @brief Does the actual logging of a message. You should not want or need to 
- *        call this function directly - use the log_trace(), log_debug(), etc.
- *        macros.
+ * @brief Start the drain thread, which formats and writes records queued by
+ *        log_rt_log() to the usual outputs.
  * 
- * @param level Level of the message. Note that is is **NOT VALIDATED**, and 
- *              passing a bad level is likely to have bad consequences.
- * @param file  File name to cite in the log.
- * @param line  Line number to cite in the log.
- * @param fmt   The format string for the message (printf-style).
- * @param ...   Arguments to substitute into `fmt`.
+ * @param policy  What log_rt_log() does when a thread's ring is full:
+ *                LOG_RT_DROP drops the new record, LOG_RT_OVERWRITE
+ *                overwrites the oldest one. Either way it's counted (see
+ *                log_rt_dropped()).
+ * 
+ * @return int `0` on success, `-1` if the thread couldn't be started.
  */
-void
-log_log(int level, const char *file, int line, const char *fmt, ...) {
-  if (level < L.level) {
-    return;
+int
+log_rt_start(int policy) {
+  if (L.rt.started) {
+    return 0;
   }
+  
+  L.rt.policy = policy;
+  __atomic_store_n(&L.rt.running, true, __ATOMIC_RELEASE);
+  
+  if (pthread_create(&L.rt.drain, NULL, rt_drain_main, NULL) != 0) {
+    __atomic_store_n(&L.rt.running, false, __ATOMIC_RELEASE);
+    return -1;
+  }
+  
+  L.rt.started = true;
+  return 0;
+} // log_rt_start()
 
-  /* Acquire lock */
-  lock();
-
-  /* Get current time */
-  time_t t = time(NULL);
-  struct tm *lt = localtime(&t);
-
-  /* Log to stderr */
-  if (!L.quiet) {
-    va_list args;
-    char buf[16];
-    buf[strftime(buf, sizeof(buf), "%H:%M:%S", lt)] = '\0';
-#ifdef LOG_USE_COLOR
-    fprintf(
-      stderr, "%s %s%-5s\x1b[0m \x1b[90m%s:%d:\x1b[0m ",
-      buf, log_level_to_color(level), log_level_to_name(level), file, line);
-#else
-    fprintf(  stderr,
-              "%s %-5s %s:%d: ",
-              buf,
-              log_level_to_name(level),
-              file,
-              line );
-#endif
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    fprintf(stderr, "\n");
-    fflush(stderr);
+/**
+ * @brief Write out what's queued and stop the drain thread.
+ */
+void
+log_rt_stop(void) {
+  if (!L.rt.started) {
+    return;
   }
+  
+  __atomic_store_n(&L.rt.running, false, __ATOMIC_RELEASE);
+  pthread_join(L.rt.drain, NULL);
+  L.rt.started = false;
+}
 
-  /* Log to file */
-  if (L.fp) {
-    va_list args;
-    char buf[32];
-    buf[strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", lt)] = '\0';
-    fprintf(L.fp, "%s %-5s %s:%d: ", buf, log_level_to_name(level), file, line);
-    va_start(args, fmt);
-    vfprintf(L.fp, fmt, args);
-    va_end(args);
-    fprintf(L.fp, "\n");
-    fflush(L.fp);
+/**
+ * @brief How many real-time records have been lost: dropped or overwritten
+ *        in full rings, or from threads past the first LOG_RT_THREADS.
+ */
+unsigned long
+log_rt_dropped(void) {
+  unsigned long dropped = __atomic_load_n(&L.rt.lost, __ATOMIC_RELAXED);
+  
+  for (int i = 0; i < LOG_RT_THREADS; i++) {
+    dropped += __atomic_load_n(&rt_rings[i].dropped, __ATOMIC_RELAXED);
   }
+  
+  return dropped;
+}
 
-  /* Release lock */
-  unlock();
-} // log_log()
+#endif // #ifdef LOG_USE_RT
@@ -10,6 +10,7 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <time.h>
 
 // Defines the `bool` type, etc.
 #include <stdbool.h>
@@ -22,7 +23,170 @@
 
 #define LOG_LEVEL_ENV_VAR (LOG_ENV_VAR_PREFIX "LOG_LEVEL")
 
+// For the clock API. <time.h> only defines it with POSIX (or C11), which a
+// strict C99 build doesn't ask for, so it's declared here either way.
+struct timespec;
+
 typedef void (*log_LockFn)(void *udata, int lock);
+typedef void *(*log_AllocFn)(void *udata, size_t size);
+typedef void (*log_FreeFn)(void *udata, void *ptr);
+typedef void (*log_ClockFn)(void *udata, struct timespec *now);
+
+#ifdef LOG_USE_MSGPACK
+
+/**
+ * @brief A record read back from a MessagePack stream by log_msgpack_read().
+ */
+typedef struct {
+  time_t time;      ///< Seconds since the epoch.
+  long nsec;        ///< Nanoseconds into that second.
+  int level;
+  char *file;       ///< `NULL`-terminated, owned by the record.
+  int line;
+  char *msg;        ///< `NULL`-terminated, owned by the record.
+  size_t msg_len;
+} log_Record;
+
+/**
+ * @brief State for reading a MessagePack stream - the stream, plus the
+ *        interned strings it has defined so far.
+ */
+typedef struct {
+  FILE *fp;
+  char **strings;       ///< Interned strings, indexed by ID.
+  size_t num_strings;
+} log_MsgpackReader;
+
+#endif // #ifdef LOG_USE_MSGPACK
+
+#ifdef LOG_USE_SHM
+
+#include <stdint.h>
+
+/**
+ * @brief "logc", identifying a shared memory log ring.
+ */
+#define LOG_SHM_MAGIC 0x63676f6cu
+
+#define LOG_SHM_VERSION 1
+
+/**
+ * @brief Where record data starts in the segment (one page in, so the data
+ *        area is page-aligned).
+ */
+#define LOG_SHM_DATA_OFFSET 4096
+
+/**
+ * @brief Record length that marks the rest of the data area as unused; the
+ *        next record is at its start.
+ */
+#define LOG_SHM_WRAP 0xffffffffu
+
+/**
+ * @brief Header at the start of a shared memory log ring (see
+ *        log_shm_open()).
+ * 
+ * The data area is `capacity` bytes (a power of 2) starting at
+ * LOG_SHM_DATA_OFFSET. `head` and `tail` are byte counts that only ever grow;
+ * their offset into the data area is `position & (capacity - 1)`. The
+ * producer owns `head` and the reader owns `tail`, each on its own cache line,
+ * and the ring holds `head - tail` bytes.
+ * 
+ * Each record is a native-endian `uint32_t` length followed by that many
+ * bytes (one file-format line), padded to 8 bytes. A record never wraps: if
+ * one won't fit before the end of the data area, the producer writes
+ * LOG_SHM_WRAP there and the record at offset 0.
+ * 
+ * Wake-ups: a reader with nothing to read stores `1` to `reader_waiting`,
+ * re-checks `head`, then `FUTEX_WAIT`s on `wake_seq`. After publishing, the
+ * producer swaps `reader_waiting` to `0` and, only if it was set, bumps
+ * `wake_seq` and `FUTEX_WAKE`s it - so neither side makes a syscall per
+ * record while the reader keeps up.
+ */
+typedef struct {
+  uint32_t magic;             ///< LOG_SHM_MAGIC, once initialized.
+  uint32_t version;           ///< LOG_SHM_VERSION.
+  uint64_t capacity;          ///< Data area size in bytes.
+  uint64_t dropped;           ///< Records that didn't fit.
+  char _pad0[40];
+  uint64_t head;              ///< Bytes published (producer).
+  uint32_t wake_seq;          ///< Futex word.
+  uint32_t reader_waiting;    ///< Reader is (about to be) asleep.
+  char _pad1[48];
+  uint64_t tail;              ///< Bytes consumed (reader).
+  char _pad2[56];
+} log_ShmHeader;
+
+/**
+ * @brief A reader attached to a shared memory log ring.
+ */
+typedef struct {
+  log_ShmHeader *header;
+  size_t size;
+  uint64_t next_tail;         ///< Tail after the peeked record.
+} log_ShmReader;
+
+#endif // #ifdef LOG_USE_SHM
+
+#ifdef LOG_USE_RT
+
+/**
+ * @brief What log_rt_log() does when the thread's ring is full (see
+ *        log_rt_start()).
+ */
+enum {
+  LOG_RT_DROP = 0,          ///< Drop the new record.
+  LOG_RT_OVERWRITE = 1      ///< Overwrite the oldest record.
+};
+
+#endif // #ifdef LOG_USE_RT
+
+/**
+ * @brief When stderr output is written (see log_set_stderr_flush()).
+ */
+enum {
+  LOG_FLUSH_AUTO = 0,       ///< Per record for a terminal, else buffered.
+  LOG_FLUSH_RECORD = 1,     ///< Each record as it's logged.
+  LOG_FLUSH_BUFFERED = 2    ///< When the buffer fills, at LOG_ERROR, etc.
+};
+
+/**
+ * @brief What to do once the logger's memory budget is used up (see
+ *        log_set_mem_budget()).
+ */
+enum {
+  /** Allocations past the budget fail, so long messages are truncated and
+      records that need more memory (batches, OTLP) are dropped. */
+  LOG_MEM_DROP = 0,
+  /** As LOG_MEM_DROP, and also drop records below LOG_WARN outright once 3/4
+      of the budget is in use, keeping the rest for the important ones. */
+  LOG_MEM_DROP_LOW = 1
+};
+
+/**
+ * @brief Logger memory use, from log_get_mem_stats().
+ */
+typedef struct {
+  size_t used;              ///< Bytes currently allocated by the logger.
+  size_t peak;              ///< Most bytes allocated at once.
+  size_t budget;            ///< `0` when unlimited.
+  unsigned long refused;    ///< Allocations refused (over budget or OOM).
+  unsigned long dropped;    ///< Records dropped by LOG_MEM_DROP_LOW.
+} log_MemStats;
+
+/**
+ * @brief Element types for log_array().
+ */
+enum {
+  LOG_I32 = 1,              ///< int32_t
+  LOG_I64 = 2,              ///< int64_t
+  LOG_U32 = 3,              ///< uint32_t
+  LOG_U64 = 4,              ///< uint64_t
+  LOG_F32 = 5,              ///< float
+  LOG_F64 = 6,              ///< double
+  /** Or'd with the type: log just the count, min, max and mean. */
+  LOG_ARRAY_SUMMARY = 0x100
+};
 
 /**
  * @brief The available levels.
@@ -48,12 +212,158 @@ enum {
   LOG_FATAL = 4
 };
 
-#define log_trace(...) log_log(LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__)
-#define log_debug(...) log_log(LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define log_info(...)  log_log(LOG_INFO,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_warn(...)  log_log(LOG_WARN,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_error(...) log_log(LOG_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define log_fatal(...) log_log(LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__)
+// ---------------------------------------------------------------------------
+// 
+// The file the log_*() macros cite. By default that's __FILE__, however the
+// file was named on the command line - often a long absolute path. Trimmed
+// at compile time (GCC and Clang fold these even at -O0):
+// 
+// -   LOG_USE_FILE_NAME - just the base name, `src/db/pool.c` -> `pool.c`.
+// -   LOG_SOURCE_PREFIX - strip this leading path where files start with it,
+//     e.g. `-DLOG_SOURCE_PREFIX='"/home/ci/build/"'`.
+// 
+// (`-fmacro-prefix-map=OLD=NEW` does the same as the latter to __FILE__
+// itself, on compilers that have it.)
+// 
+
+#if defined(LOG_USE_FILE_NAME) && defined(__FILE_NAME__)
+
+#define LOG_FILE __FILE_NAME__
+
+#elif defined(LOG_USE_FILE_NAME) && defined(__GNUC__)
+
+#define LOG_FILE (__builtin_strrchr("/" __FILE__, '/') + 1)
+
+#elif defined(LOG_SOURCE_PREFIX) && defined(__GNUC__)
+
+#define LOG_FILE                                                            \
+  ( __builtin_strncmp(                                                      \
+      __FILE__, LOG_SOURCE_PREFIX, sizeof(LOG_SOURCE_PREFIX) - 1) == 0      \
+    ? __FILE__ + sizeof(LOG_SOURCE_PREFIX) - 1                              \
+    : __FILE__ )
+
+#else
+
+#define LOG_FILE __FILE__
+
+#endif
+
+#if defined(LOG_USE_USDT) && defined(__x86_64__)
+// ---------------------------------------------------------------------------
+// 
+// USDT (SystemTap SDT) probe `logc:record` at every log_*() call site, fired
+// *before* the level check so filtered sites can be traced too. Arguments:
+// 
+// -   arg0 - level (int)
+// -   arg1 - file (const char *)
+// -   arg2 - line (int)
+// -   arg3 - format string (const char *), or label for log_array()
+// 
+// log_batch_add() lines fire it from log_batch_log(), with the level given to
+// log_batch_begin(). The macros stay expressions, so they can be used in
+// `?:` and comma expressions just as without probes.
+// 
+// Emits the same `.note.stapsdt` layout as <sys/sdt.h>, without needing it.
+// The probe is gated on a semaphore that tracers (bpftrace, perf, stap)
+// increment when they attach, so untraced sites cost a load and a branch.
+// 
+
+extern volatile unsigned short log_usdt_semaphore;
+
+#define LOG_USDT_FIRST(...) LOG_USDT_FIRST_(__VA_ARGS__, 0)
+#define LOG_USDT_FIRST_(first, ...) first
+
+#define LOG_USDT_PROBE(level, file, line, fmt)                              \
+  __asm__ __volatile__ (                                                    \
+    "990: nop\n"                                                            \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                            \
+    ".balign 4\n"                                                           \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                      \
+    "991: .asciz \"stapsdt\"\n"                                             \
+    "992: .balign 4\n"                                                      \
+    "993: .8byte 990b\n"                                                    \
+    ".8byte _.stapsdt.base\n"                                               \
+    ".8byte log_usdt_semaphore\n"                                           \
+    ".asciz \"logc\"\n"                                                     \
+    ".asciz \"record\"\n"                                                   \
+    ".asciz \"-4@%0 8@%1 -4@%2 8@%3\"\n"                                    \
+    "994: .balign 4\n"                                                      \
+    ".popsection\n"                                                         \
+    ".ifndef _.stapsdt.base\n"                                              \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n"                                                \
+    ".hidden _.stapsdt.base\n"                                              \
+    "_.stapsdt.base: .space 1\n"                                            \
+    ".size _.stapsdt.base, 1\n"                                             \
+    ".popsection\n"                                                         \
+    ".endif\n"                                                              \
+    :: "nor" ((int)(level)), "nor" ((const char *)(file)),                  \
+       "nor" ((int)(line)), "nor" ((const char *)(fmt)))
+
+/**
+ * @brief Fire the probe if a tracer is attached, as a `void` expression.
+ */
+#define LOG_USDT(level, file, line, fmt)                                    \
+  ( __builtin_expect(log_usdt_semaphore, 0)                                 \
+    ? __extension__ ({ LOG_USDT_PROBE(level, file, line, fmt); })           \
+    : (void)0 )
+
+#define LOG_AT(level, ...)                                                  \
+  ( LOG_USDT(level, LOG_FILE, __LINE__, LOG_USDT_FIRST(__VA_ARGS__)),       \
+    log_log(level, LOG_FILE, __LINE__, __VA_ARGS__) )
+
+#define LOG_NAMED_AT(logger, level, ...)                                    \
+  ( LOG_USDT(level, LOG_FILE, __LINE__, LOG_USDT_FIRST(__VA_ARGS__)),       \
+    log_named_log(logger, level, LOG_FILE, __LINE__, __VA_ARGS__) )
+
+#define log_array(level, label, type, array, count)                         \
+  ( LOG_USDT(level, LOG_FILE, __LINE__, label),                             \
+    log_array_log(level, LOG_FILE, __LINE__, label, type, array, count) )
+
+#define LOG_RT_AT(level, ...)                                               \
+  ( LOG_USDT(level, LOG_FILE, __LINE__, LOG_USDT_FIRST(__VA_ARGS__)),       \
+    log_rt_log(level, LOG_FILE, __LINE__, __VA_ARGS__) )
+
+#else
+
+#define LOG_AT(level, ...) log_log(level, LOG_FILE, __LINE__, __VA_ARGS__)
+
+#define LOG_NAMED_AT(logger, level, ...) \
+  log_named_log(logger, level, LOG_FILE, __LINE__, __VA_ARGS__)
+
+#define log_array(level, label, type, array, count) \
+  log_array_log(level, LOG_FILE, __LINE__, label, type, array, count)
+
+#define LOG_RT_AT(level, ...) log_rt_log(level, LOG_FILE, __LINE__, __VA_ARGS__)
+
+#endif // #if defined(LOG_USE_USDT) && defined(__x86_64__) ******************
+
+#define log_trace(...) LOG_AT(LOG_TRACE, __VA_ARGS__)
+#define log_debug(...) LOG_AT(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...)  LOG_AT(LOG_INFO,  __VA_ARGS__)
+#define log_warn(...)  LOG_AT(LOG_WARN,  __VA_ARGS__)
+#define log_error(...) LOG_AT(LOG_ERROR, __VA_ARGS__)
+#define log_fatal(...) LOG_AT(LOG_FATAL, __VA_ARGS__)
+
+#define log_named_trace(id, ...) LOG_NAMED_AT(id, LOG_TRACE, __VA_ARGS__)
+#define log_named_debug(id, ...) LOG_NAMED_AT(id, LOG_DEBUG, __VA_ARGS__)
+#define log_named_info(id, ...)  LOG_NAMED_AT(id, LOG_INFO,  __VA_ARGS__)
+#define log_named_warn(id, ...)  LOG_NAMED_AT(id, LOG_WARN,  __VA_ARGS__)
+#define log_named_error(id, ...) LOG_NAMED_AT(id, LOG_ERROR, __VA_ARGS__)
+#define log_named_fatal(id, ...) LOG_NAMED_AT(id, LOG_FATAL, __VA_ARGS__)
+
+#define log_batch_add(...) log_batch_log(LOG_FILE, __LINE__, __VA_ARGS__)
+
+#ifdef LOG_USE_RT
+
+#define log_rt_trace(...) LOG_RT_AT(LOG_TRACE, __VA_ARGS__)
+#define log_rt_debug(...) LOG_RT_AT(LOG_DEBUG, __VA_ARGS__)
+#define log_rt_info(...)  LOG_RT_AT(LOG_INFO,  __VA_ARGS__)
+#define log_rt_warn(...)  LOG_RT_AT(LOG_WARN,  __VA_ARGS__)
+#define log_rt_error(...) LOG_RT_AT(LOG_ERROR, __VA_ARGS__)
+#define log_rt_fatal(...) LOG_RT_AT(LOG_FATAL, __VA_ARGS__)
+
+#endif // #ifdef LOG_USE_RT
 
 
 // Function Declarations (Public API)
@@ -66,6 +376,7 @@ bool        log_is_level              (int level);
 const char *log_level_to_name         (int level);
 char      **log_level_strings         (void);
 char       *log_level_to_string       (int level);
+int         log_bloom_check           (const char *path, const char *token);
 
 #ifdef LOG_USE_COLOR
 
@@ -76,26 +387,136 @@ const char *log_level_to_color        (int level);
 // State
 // ---------------------------------------------------------------------------
 
+bool        log_get_escape            (void);
 FILE       *log_get_fp                (void);
 int         log_get_level             (void);
 const char *log_get_level_name        (void);
+int         log_get_logger            (const char *name);
+const char *log_get_logger_name       (int id);
+void        log_get_mem_stats         (log_MemStats *stats);
 bool        log_get_quiet             (void);
+void        log_set_allocator         (log_AllocFn alloc,
+                                       log_FreeFn free,
+                                       void *udata);
+void        log_set_boost             (int trigger,
+                                       int level,
+                                       int seconds,
+                                       bool per_thread);
+void        log_set_escape            (bool enable);
 void        log_set_fp                (FILE *fp);
+int         log_set_fp_indexed        (FILE *fp,
+                                       const char *segment,
+                                       const char *const *keys);
 void        log_set_level             (int level);
 int         log_set_level_by_name     (char* name);
 int         log_set_level_from_string (char* string);
 void        log_set_lock              (log_LockFn fn);
+int         log_set_logger_level      (const char *name, int level);
+void        log_set_mem_budget        (size_t bytes, int policy);
 void        log_set_quiet             (bool enable);
+void        log_set_stall_timeout     (int timeout_ms, FILE *fallback);
+void        log_set_stderr_flush      (int policy);
 void        log_set_udata             (void *udata);
 
+#ifdef LOG_USE_MSGPACK
+
+FILE       *log_get_msgpack_fp        (void);
+bool        log_get_msgpack_intern    (void);
+void        log_set_msgpack_fp        (FILE *fp);
+void        log_set_msgpack_intern    (bool enable);
+
+#endif // #ifdef LOG_USE_MSGPACK
+
+// Clocks
+// ---------------------------------------------------------------------------
+
+void        log_clock_realtime        (void *udata, struct timespec *now);
+void        log_clock_realtime_coarse (void *udata, struct timespec *now);
+void        log_clock_monotonic       (void *udata, struct timespec *now);
+void        log_clock_tsc             (void *udata, struct timespec *now);
+void        log_clock_fixed           (void *udata, struct timespec *now);
+void        log_set_clock             (log_ClockFn fn, void *udata);
+
 // Doin' Stuff
 // ---------------------------------------------------------------------------
 
 void        log_init_from_env         (void);
+void        log_flush                 (void);
 void        log_log                   (int level,
                                        const char *file,
                                        int line,
                                        const char *fmt,
                                        ...);
+void        log_named_log             (int logger,
+                                       int level,
+                                       const char *file,
+                                       int line,
+                                       const char *fmt,
+                                       ...);
+void        log_array_log             (int level,
+                                       const char *file,
+                                       int line,
+                                       const char *label,
+                                       int type,
+                                       const void *array,
+                                       size_t count);
+
+bool        log_batch_begin           (int level);
+void        log_batch_log             (const char *file,
+                                       int line,
+                                       const char *fmt,
+                                       ...);
+void        log_batch_commit          (void);
+
+#ifdef LOG_USE_MSGPACK
+
+void        log_msgpack_reader_init   (log_MsgpackReader *reader,
+                                       FILE *fp);
+void        log_msgpack_reader_free   (log_MsgpackReader *reader);
+int         log_msgpack_read          (log_MsgpackReader *reader,
+                                       log_Record *record);
+void        log_record_free           (log_Record *record);
+int         log_msgpack_to_text       (FILE *in, FILE *out);
+
+#endif // #ifdef LOG_USE_MSGPACK
+
+#ifdef LOG_USE_OTLP
+
+int         log_otlp_open             (const char *host, const char *port);
+size_t      log_otlp_flush            (void);
+void        log_otlp_close            (void);
+int         log_otlp_set_spool        (const char *dir, size_t max_bytes);
+unsigned long log_otlp_dropped        (void);
+
+#endif // #ifdef LOG_USE_OTLP
+
+#ifdef LOG_USE_RT
+
+void        log_rt_log                (int level,
+                                       const char *file,
+                                       int line,
+                                       const char *fmt,
+                                       ...);
+int         log_rt_start              (int policy);
+void        log_rt_stop               (void);
+unsigned long log_rt_dropped          (void);
+
+#endif // #ifdef LOG_USE_RT
+
+#ifdef LOG_USE_SHM
+
+int         log_shm_open              (const char *name, size_t capacity);
+void        log_shm_close             (void);
+int         log_shm_reader_open       (log_ShmReader *reader,
+                                       const char *name);
+int         log_shm_reader_peek       (log_ShmReader *reader,
+                                       const char **data,
+                                       size_t *len,
+                                       int timeout_ms);
+void        log_shm_reader_release    (log_ShmReader *reader);
+uint64_t    log_shm_reader_dropped    (const log_ShmReader *reader);
+void        log_shm_reader_close      (log_ShmReader *reader);
+
+#endif // #ifdef LOG_USE_SHM
 
 #endif // #ifndef LOG_H
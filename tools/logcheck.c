@@ -0,0 +1,896 @@
+/**
+ * @file tools/logcheck.c
+ * @brief Checks for the parts of log.c that are hard to get right by
+ *        inspection - races between threads, and the like.
+ *
+ * log.c is compiled into this file so internals can be checked directly.
+ * Build with the same flags as the code being checked, e.g.:
+ *
+ *     cc -O2 -std=gnu99 -Isrc tools/logcheck.c -lpthread -o logcheck
+ *     ./logcheck [CHECK...]
+ *
+ * Runs the named checks, or all of them, printing `ok` or `FAIL` and why for
+ * each.
+ *
+ * @return `0` if every check passed, `1` otherwise.
+ */
+
+// For F_SETPIPE_SZ
+#define _GNU_SOURCE
+
+#include "../src/log.c"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+// Helpers
+// ===========================================================================
+
+/**
+ * @brief Why the current check failed, or empty if it hasn't. Only the first
+ *        failure is kept.
+ */
+static char failure[256];
+static pthread_mutex_t failure_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+fail(const char *fmt, ...) {
+  va_list args;
+
+  pthread_mutex_lock(&failure_mutex);
+  if (failure[0] == '\0') {
+    va_start(args, fmt);
+    vsnprintf(failure, sizeof(failure), fmt, args);
+    va_end(args);
+  }
+  pthread_mutex_unlock(&failure_mutex);
+}
+
+/**
+ * @brief A lock that notices being released by a thread that doesn't hold
+ *        it.
+ */
+static pthread_mutex_t mutex;
+
+static void
+lock_mutex(void *udata, int acquire) {
+  (void)udata;
+  if (acquire) {
+    pthread_mutex_lock(&mutex);
+  } else if (pthread_mutex_unlock(&mutex) == EPERM) {
+    fail("lock released by a thread that doesn't hold it");
+  }
+}
+
+static void
+use_checked_lock(void) {
+  pthread_mutexattr_t attr;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+  pthread_mutex_init(&mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+  log_set_lock(lock_mutex);
+}
+
+/**
+ * @brief Read all of `fp` into a `NULL`-terminated string (free() it).
+ */
+static char *
+slurp(FILE *fp) {
+  long size;
+  char *data;
+
+  fflush(fp);
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  rewind(fp);
+
+  data = malloc((size_t)size + 1);
+  if (data == NULL || fread(data, 1, (size_t)size, fp) != (size_t)size) {
+    free(data);
+    return NULL;
+  }
+  data[size] = '\0';
+  return data;
+}
+
+
+// Batches
+// ===========================================================================
+
+#define BATCH_ROUNDS 2000
+#define BATCH_LINES 5
+
+/**
+ * @brief Takes batches at `LOG_INFO`, which is enabled.
+ */
+static void *
+batch_owner(void *arg) {
+  (void)arg;
+
+  for (int round = 0; round < BATCH_ROUNDS; round++) {
+    if (!log_batch_begin(LOG_INFO)) {
+      fail("log_batch_begin(LOG_INFO) returned false");
+      continue;
+    }
+    for (int i = 0; i < BATCH_LINES; i++) {
+      log_batch_add("owner %d.%d", round, i);
+    }
+    log_batch_commit();
+  }
+  return NULL;
+}
+
+/**
+ * @brief Goes through the motions at `LOG_DEBUG`, which isn't enabled, so
+ *        its adds and commits must do nothing - even while the owner has a
+ *        batch open.
+ */
+static void *
+batch_outsider(void *arg) {
+  (void)arg;
+
+  for (int round = 0; round < BATCH_ROUNDS * 5; round++) {
+    if (log_batch_begin(LOG_DEBUG)) {
+      fail("log_batch_begin(LOG_DEBUG) returned true");
+    }
+    log_batch_add("outsider %d", round);
+    log_batch_commit();
+  }
+  return NULL;
+}
+
+/**
+ * @brief Two threads racing begin/add/commit: lines only go in the batch of
+ *        the thread that opened it, and each batch comes out whole.
+ */
+static void
+check_batch(void) {
+  FILE *fp = tmpfile();
+  pthread_t owner, outsider;
+
+  use_checked_lock();
+  log_set_quiet(true);
+  log_set_level(LOG_INFO);
+  log_set_fp(fp);
+
+  pthread_create(&owner, NULL, batch_owner, NULL);
+  pthread_create(&outsider, NULL, batch_outsider, NULL);
+  pthread_join(owner, NULL);
+  pthread_join(outsider, NULL);
+
+  log_set_fp(NULL);
+  log_set_lock(NULL);
+
+  char *data = slurp(fp);
+  fclose(fp);
+
+  if (data == NULL) {
+    fail("can't read the output back");
+    return;
+  }
+
+  if (strstr(data, "outsider") != NULL) {
+    fail("an outsider's line got into the owner's batch");
+  }
+
+  // Each batch's lines together and in order
+  int round = 0, i = 0;
+  for (char *line = strstr(data, "owner "); line != NULL;
+       line = strstr(line + 1, "owner ")) {
+    int line_round, line_i;
+
+    if (sscanf(line, "owner %d.%d", &line_round, &line_i) != 2 ||
+        line_round != round || line_i != i) {
+      fail("expected owner %d.%d, got %.20s", round, i, line);
+      break;
+    }
+    if (++i == BATCH_LINES) {
+      i = 0;
+      round++;
+    }
+  }
+  if (failure[0] == '\0' && round != BATCH_ROUNDS) {
+    fail("%d of %d batches written", round, BATCH_ROUNDS);
+  }
+
+  free(data);
+}
+
+
+// Buffered stderr
+// ===========================================================================
+
+/**
+ * @brief Is `text` in what's been written to `fp` so far?
+ */
+static bool
+written(FILE *fp, const char *text) {
+  char *data = slurp(fp);
+  bool found = data != NULL && strstr(data, text) != NULL;
+
+  free(data);
+  return found;
+}
+
+/**
+ * @brief Buffered stderr output is held back no longer than
+ *        LOG_STDERR_MAX_AGE_MS once another record comes along - or, with
+ *        the real-time drain thread running, at all.
+ */
+static void
+check_stderr_age(void) {
+  FILE *err = tmpfile();
+  int saved_stderr = dup(STDERR_FILENO);
+  struct timespec age = {
+    LOG_STDERR_MAX_AGE_MS / 1000,
+    (LOG_STDERR_MAX_AGE_MS % 1000 + 100) * 1000000L
+  };
+
+  fflush(stderr);
+  dup2(fileno(err), STDERR_FILENO);
+
+  log_set_quiet(false);
+  log_set_level(LOG_INFO);
+  log_set_stderr_flush(LOG_FLUSH_BUFFERED);
+
+  log_info("first");
+  if (written(err, "first")) {
+    fail("the first record wasn't buffered");
+  }
+
+  nanosleep(&age, NULL);
+  log_info("second");
+  if (!written(err, "first") || !written(err, "second")) {
+    fail("stale output wasn't written with the next record");
+  }
+
+#ifdef LOG_USE_RT
+  log_rt_start(LOG_RT_DROP);
+  log_info("third");
+  nanosleep(&age, NULL);
+  nanosleep(&age, NULL);
+  if (!written(err, "third")) {
+    fail("the drain thread didn't write stale output");
+  }
+  log_rt_stop();
+#endif
+
+  log_set_stderr_flush(LOG_FLUSH_AUTO);
+  log_set_quiet(true);
+  fflush(stderr);
+  dup2(saved_stderr, STDERR_FILENO);
+  close(saved_stderr);
+  fclose(err);
+} // check_stderr_age()
+
+
+// Stall Watchdog
+// ===========================================================================
+
+#define STALL_LINE_SIZE (256 * 1024)
+#define STALL_RECORDS 100
+
+/**
+ * @brief Logs one line too big for the pipe, so its write hangs until the
+ *        pipe is read.
+ */
+static void *
+stall_writer(void *arg) {
+  char *line = malloc(STALL_LINE_SIZE + 1);
+
+  (void)arg;
+  memset(line, 'x', STALL_LINE_SIZE);
+  line[STALL_LINE_SIZE] = '\0';
+  log_info("%s", line);
+  free(line);
+  return NULL;
+}
+
+/**
+ * @brief Read the pipe until it's closed, into a string (free() it).
+ */
+static void *
+stall_reader(void *arg) {
+  int fd = *(int *)arg;
+  size_t len = 0, cap = 2 * STALL_LINE_SIZE;
+  char *data = malloc(cap + 1);
+  ssize_t n;
+
+  while ((n = read(fd, data + len, cap - len)) > 0) {
+    len += (size_t)n;
+    if (len == cap) {
+      cap *= 2;
+      data = realloc(data, cap + 1);
+    }
+  }
+  data[len] = '\0';
+  return data;
+}
+
+/**
+ * @brief A file write that hangs only takes the file output with it: records
+ *        logged meanwhile still reach stderr, their file lines go to the
+ *        fallback, and the file picks up again once the write returns. The
+ *        notes about it come after records buffered for stderr before it.
+ */
+static void
+check_stall(void) {
+  int fds[2];
+  FILE *fallback = tmpfile();
+  FILE *err = tmpfile();
+  int saved_stderr = dup(STDERR_FILENO);
+  pthread_t writer, reader;
+  struct timespec brief = { 0, 30 * 1000000 };
+  struct timespec pause = { 0, 300 * 1000000 };
+  char *data;
+
+  if (pipe(fds) != 0) {
+    fail("can't make a pipe");
+    return;
+  }
+
+  FILE *fp = fdopen(fds[1], "w");
+
+  fflush(stderr);
+  dup2(fileno(err), STDERR_FILENO);
+
+  use_checked_lock();
+  log_set_quiet(false);
+  log_set_level(LOG_INFO);
+  log_set_fp(fp);
+  log_set_stall_timeout(100, fallback);
+
+  pthread_create(&writer, NULL, stall_writer, NULL);
+  nanosleep(&brief, NULL);
+  // Left buffered for stderr, so it has to come out ahead of the note
+  log_info("early");
+  nanosleep(&pause, NULL);
+  log_info("late");
+
+  for (int i = 0; i < STALL_RECORDS; i++) {
+    log_error("during %d", i);
+  }
+
+  pthread_create(&reader, NULL, stall_reader, &fds[0]);
+  pthread_join(writer, NULL);
+  log_error("after");
+
+  log_set_fp(NULL);
+  log_set_stall_timeout(0, NULL);
+  log_set_lock(NULL);
+  log_set_quiet(true);
+  fclose(fp);
+  pthread_join(reader, (void **)&data);
+
+  fflush(stderr);
+  dup2(saved_stderr, STDERR_FILENO);
+  close(saved_stderr);
+  close(fds[0]);
+
+  char *err_data = slurp(err);
+  char *fallback_data = slurp(fallback);
+  char last[32];
+
+  snprintf(last, sizeof(last), "during %d", STALL_RECORDS - 1);
+
+  if (err_data == NULL || fallback_data == NULL) {
+    fail("can't read the output back");
+  } else if (strstr(err_data, last) == NULL) {
+    fail("records logged during the stall didn't reach stderr");
+  } else if (strstr(err_data, "stalled") == NULL ||
+             strstr(err_data, "early") == NULL ||
+             strstr(err_data, "early") > strstr(err_data, "stalled")) {
+    fail("a record from before the stall came out after the note on it");
+  } else if (strstr(err_data, "records diverted") == NULL) {
+    fail("no note on stderr when the file write resumed");
+  } else if (strstr(fallback_data, last) == NULL) {
+    fail("records logged during the stall didn't reach the fallback");
+  } else if (strstr(data, "during") != NULL) {
+    fail("records logged during the stall reached the file too");
+  } else if (strstr(data, "after") == NULL) {
+    fail("the file output didn't carry on after the stall");
+  }
+
+  free(data);
+  free(err_data);
+  free(fallback_data);
+  fclose(err);
+  fclose(fallback);
+} // check_stall()
+
+
+#ifdef LOG_USE_RT
+// Real-Time Mode
+// ===========================================================================
+
+#define RT_LOCK_HOLD_MS 300
+
+// The thread isn't scheduled real-time here, so being preempted counts too:
+// allow the odd slow record, but nothing near the time the lock is held
+#define RT_SLOW_US 20
+#define RT_MAX_SLOW_PER 1000
+#define RT_MAX_LATENCY_US 20000
+
+static volatile bool rt_lock_held;
+
+/**
+ * @brief Holds the logger's lock for RT_LOCK_HOLD_MS, so the drain thread
+ *        is stuck behind it and the rings fill up.
+ */
+static void *
+rt_lock_holder(void *arg) {
+  struct timespec hold = { 0, RT_LOCK_HOLD_MS * 1000000L };
+
+  (void)arg;
+  pthread_mutex_lock(&mutex);
+  rt_lock_held = true;
+  nanosleep(&hold, NULL);
+  rt_lock_held = false;
+  pthread_mutex_unlock(&mutex);
+  return NULL;
+}
+
+static int64_t
+now_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * @brief log_rt_log() never waits: over every record logged while the lock
+ *        is held elsewhere (with the drain stuck and the ring full), the
+ *        worst case stays far under the time the lock is held, and hardly
+ *        any take over RT_SLOW_US - with as many arguments and as much
+ *        string as a record takes, and either policy.
+ */
+static void
+check_rt_latency(void) {
+  static const char str[] =
+    "a string longer than LOG_RT_STR_SIZE, so the copy runs to the end of "
+    "the room there is for strings in a slot, and stops there";
+  FILE *fp = tmpfile();
+  int policies[] = { LOG_RT_DROP, LOG_RT_OVERWRITE };
+
+  use_checked_lock();
+  log_set_quiet(true);
+  log_set_level(LOG_INFO);
+  log_set_fp(fp);
+
+  for (int p = 0; p < 2; p++) {
+    pthread_t holder;
+    int64_t worst_ns = 0;
+    unsigned long records = 0, slow = 0;
+
+    log_rt_start(policies[p]);
+    pthread_create(&holder, NULL, rt_lock_holder, NULL);
+    while (!rt_lock_held) {
+      sched_yield();
+    }
+
+    while (rt_lock_held) {
+      int64_t start = now_ns();
+      log_rt_info(
+        "%s %s %d %ld %lld %zu %f %p %.*s %c %u",
+        str, str, 1, 2L, 3LL, (size_t)4, 5.0, (void *)str, 8, str, 'x', 9u);
+      int64_t took = now_ns() - start;
+
+      if (took > worst_ns) {
+        worst_ns = took;
+      }
+      if (took > RT_SLOW_US * 1000L) {
+        slow++;
+      }
+      records++;
+    }
+
+    pthread_join(holder, NULL);
+    log_rt_stop();
+
+    if (records <= LOG_RT_SLOTS) {
+      fail("only %lu records logged, the ring never filled", records);
+    } else if (worst_ns > RT_MAX_LATENCY_US * 1000L ||
+               slow > records / RT_MAX_SLOW_PER) {
+      fail(
+        "worst case %.1f us, %lu over %d us, of %lu records (%s policy)",
+        worst_ns / 1000.0, slow, RT_SLOW_US, records,
+        p == 0 ? "drop" : "overwrite");
+    }
+  }
+
+  log_set_fp(NULL);
+  log_set_lock(NULL);
+  fclose(fp);
+} // check_rt_latency()
+
+/**
+ * @brief `%.Ns` strings needn't be `NUL`-terminated: they're read no further
+ *        than their precision, as printf() would. Each one here ends right
+ *        at an unmapped page.
+ */
+static void
+check_rt_precision(void) {
+  long page = sysconf(_SC_PAGESIZE);
+  char *pages = mmap(
+    NULL, (size_t)page * 2, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  FILE *fp = tmpfile();
+
+  if (pages == MAP_FAILED) {
+    fail("can't map pages");
+    return;
+  }
+  mprotect(pages + page, (size_t)page, PROT_NONE);
+
+  char *end = pages + page;
+  memcpy(end - 8, "abcdwxyz", 8);
+
+  log_set_quiet(true);
+  log_set_level(LOG_INFO);
+  log_set_fp(fp);
+  log_rt_start(LOG_RT_DROP);
+  log_rt_info("[%.4s] [%.*s] [%-6.*s]", end - 4, 2, end - 2, 3, end - 8);
+  log_rt_stop();
+  log_set_fp(NULL);
+
+  char *data = slurp(fp);
+
+  if (data == NULL) {
+    fail("can't read the output back");
+  } else if (strstr(data, "[wxyz] [yz] [abc   ]") == NULL) {
+    fail("got %s", data);
+  }
+
+  free(data);
+  fclose(fp);
+  munmap(pages, (size_t)page * 2);
+} // check_rt_precision()
+
+#endif // #ifdef LOG_USE_RT
+
+
+// Escaping
+// ===========================================================================
+
+/**
+ * @brief How log_set_escape() should render `msg`, worked out byte by byte
+ *        from the spec rather than the library's code.
+ */
+static size_t
+escape_reference(char *out, const unsigned char *msg, size_t len) {
+  size_t n = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = msg[i];
+
+    if (c == '\n') {
+      n += (size_t)sprintf(out + n, "\\n");
+    } else if (c == '\r') {
+      n += (size_t)sprintf(out + n, "\\r");
+    } else if ((c < 0x20 && c != '\t') || c == 0x7f) {
+      n += (size_t)sprintf(out + n, "\\x%02x", c);
+    } else {
+      out[n++] = (char)c;
+    }
+  }
+  return n;
+}
+
+/**
+ * @brief Escape `msg` with both finders and check they agree with each other
+ *        and with escape_reference().
+ */
+static bool
+escape_matches(const unsigned char *msg, size_t len) {
+  char expected[4 * 256];
+  char storage[4 * 256];
+  size_t expected_len = escape_reference(expected, msg, len);
+  size_t (*finders[])(const char *, size_t) = {
+    find_escape, find_escape_scalar
+  };
+
+  for (int f = 0; f < 2; f++) {
+    const char *name = f == 0 ? "find_escape" : "find_escape_scalar";
+    Buffer out;
+
+    if (finders[f]((const char *)msg, len) !=
+        find_escape_scalar((const char *)msg, len)) {
+      fail(
+        "%s() found %zu in a %zu byte message, expected %zu", name,
+        finders[f]((const char *)msg, len), len,
+        find_escape_scalar((const char *)msg, len));
+      return false;
+    }
+
+    buffer_init(&out, storage, sizeof(storage));
+    buffer_append_escaped(&out, (const char *)msg, len, finders[f]);
+
+    if (out.len != expected_len ||
+        memcmp(out.data, expected, expected_len) != 0) {
+      fail(
+        "escaping with %s() gave \"%.*s\", expected \"%.*s\"", name,
+        (int)out.len, out.data, (int)expected_len, expected);
+      buffer_free(&out);
+      return false;
+    }
+    buffer_free(&out);
+  }
+  return true;
+} // escape_matches()
+
+/**
+ * @brief The vectorized escaping (SSE2/AVX2, whichever this is built for)
+ *        matches the byte-at-a-time path: every byte value at every offset
+ *        across two 32 byte blocks, pairs of control bytes on each side of
+ *        a block boundary, and random messages.
+ */
+static void
+check_escape(void) {
+  unsigned char msg[256];
+
+  for (size_t len = 0; len <= 80; len++) {
+    for (size_t at = 0; at < len; at++) {
+      for (int c = 0; c < 256; c++) {
+        memset(msg, 'a', len);
+        msg[at] = (unsigned char)c;
+        if (!escape_matches(msg, len)) {
+          return;
+        }
+      }
+    }
+  }
+
+  // "\r\n" and the like, straddling 16 and 32 byte boundaries
+  static const unsigned char controls[] = { '\r', '\n', 0x1b, 0x00, 0x7f };
+  for (size_t at = 1; at < 72; at++) {
+    for (size_t a = 0; a < sizeof(controls); a++) {
+      for (size_t b = 0; b < sizeof(controls); b++) {
+        memset(msg, 'x', 80);
+        msg[at - 1] = controls[a];
+        msg[at] = controls[b];
+        if (!escape_matches(msg, 80)) {
+          return;
+        }
+      }
+    }
+  }
+
+  unsigned seed = 1;
+  for (int i = 0; i < 200000; i++) {
+    size_t len = (size_t)(i % 200);
+
+    for (size_t j = 0; j < len; j++) {
+      seed = seed * 1103515245u + 12345u;
+      // Mostly text, with control bytes and high bytes mixed in
+      unsigned r = (seed >> 16) & 0xff;
+      msg[j] = r < 16 ? (unsigned char)(r * 2) :
+               r < 24 ? (unsigned char)(0x78 + r - 16) :
+               r < 32 ? (unsigned char)(0x80 + r * 4) :
+               (unsigned char)(' ' + r % 94);
+    }
+    if (!escape_matches(msg, len)) {
+      return;
+    }
+  }
+} // check_escape()
+
+
+// Bloom Filters
+// ===========================================================================
+
+/**
+ * @brief A filter that's behind its segment isn't trusted, and re-opening the
+ *        segment indexes what was written after the filter was saved - as
+ *        after a crash.
+ */
+static void
+check_bloom(void) {
+  char dir[] = "/tmp/logcheck-bloom-XXXXXX";
+  char segment[64];
+  char bloom[72];
+  static const char *const keys[] = { "trace:", NULL };
+  FILE *fp;
+
+  if (mkdtemp(dir) == NULL) {
+    fail("couldn't make a directory: %s", strerror(errno));
+    return;
+  }
+  snprintf(segment, sizeof(segment), "%s/segment.log", dir);
+  snprintf(bloom, sizeof(bloom), "%s.bloom", segment);
+
+  log_set_quiet(true);
+  log_set_level(LOG_INFO);
+
+  fp = fopen(segment, "a");
+  log_set_fp_indexed(fp, segment, keys);
+  log_info("saved trace:abc123");
+  log_flush();
+  if (log_bloom_check(bloom, "abc123") != 1) {
+    fail("a saved token wasn't found");
+  }
+
+  // Die without saving again
+  log_info("unsaved trace:def456");
+  lock();
+  L.bloom.dirty = false;
+  L.bloom.covered = bloom_segment_size();
+  mem_free(L.bloom.bits);
+  mem_free(L.bloom.path);
+  L.bloom.bits = NULL;
+  L.bloom.path = NULL;
+  L.fp = NULL;
+  unlock();
+  fclose(fp);
+
+  if (log_bloom_check(bloom, "def456") != -1) {
+    fail("a filter behind its segment was used");
+  }
+
+  fp = fopen(segment, "a");
+  log_set_fp_indexed(fp, segment, keys);
+  log_set_fp(NULL);
+  fclose(fp);
+
+  if (log_bloom_check(bloom, "abc123") != 1 ||
+      log_bloom_check(bloom, "def456") != 1) {
+    fail("re-opening the segment didn't index what the filter missed");
+  }
+  if (log_bloom_check(bloom, "unsaved") != 0) {
+    fail("a token not following a key was indexed");
+  }
+
+  remove(bloom);
+  remove(segment);
+  rmdir(dir);
+} // check_bloom()
+
+
+// vmsplice()
+// ===========================================================================
+
+#ifdef LOG_HAVE_VMSPLICE
+
+#define SHARED_PIPE_SIZE (1024 * 1024)
+#define SHARED_FOREIGN (2 * LOG_STDERR_BUF_SIZE)
+
+/**
+ * @brief Fill the current region with lines of `c` and flush it.
+ */
+static void
+splice_region(char c) {
+  char line[64];
+  Buffer buffer;
+
+  memset(line, c, sizeof(line) - 1);
+  line[sizeof(line) - 1] = '\n';
+  buffer_init(&buffer, line, sizeof(line));
+  buffer.len = sizeof(line);
+
+  lock();
+  while (L.err.pending.len + sizeof(line) <= LOG_STDERR_BUF_SIZE) {
+    write_stderr_buffer(&buffer, LOG_INFO);
+  }
+  stderr_flush();
+  unlock();
+}
+
+/**
+ * @brief With another process's output in the pipe as well, the pipe can
+ *        hold more than was ever spliced into it. Pages the reader hasn't
+ *        got to yet mustn't be written over all the same.
+ */
+static void
+check_vmsplice_shared(void) {
+  int fds[2];
+  int saved_stderr = dup(STDERR_FILENO);
+  char *foreign = malloc(SHARED_FOREIGN);
+  char *data = malloc(SHARED_PIPE_SIZE);
+  size_t len = 0;
+  ssize_t n;
+
+  if (pipe(fds) != 0 ||
+      fcntl(fds[1], F_SETPIPE_SZ, SHARED_PIPE_SIZE) < SHARED_PIPE_SIZE) {
+    fail("can't make a %d byte pipe", SHARED_PIPE_SIZE);
+    return;
+  }
+
+  fflush(stderr);
+  dup2(fds[1], STDERR_FILENO);
+  log_set_stderr_flush(LOG_FLUSH_BUFFERED);
+
+  // Nothing is read until the end
+  memset(foreign, 'f', SHARED_FOREIGN);
+  if (write(fds[1], foreign, SHARED_FOREIGN) != SHARED_FOREIGN) {
+    fail("couldn't fill the pipe");
+  }
+  splice_region('a');
+  splice_region('b');
+  splice_region('c');
+
+  if (!L.err.splice) {
+    fail("stderr output wasn't spliced");
+  }
+
+  log_set_stderr_flush(LOG_FLUSH_AUTO);
+  dup2(saved_stderr, STDERR_FILENO);
+  close(saved_stderr);
+  close(fds[1]);
+
+  while ((n = read(fds[0], data + len, SHARED_PIPE_SIZE - len)) > 0) {
+    len += (size_t)n;
+  }
+  close(fds[0]);
+
+  size_t at = SHARED_FOREIGN;
+  if (len <= at || data[at] != 'a') {
+    fail(
+      "the first spliced region reads \"%.8s...\", expected \"aaaaaaaa...\"",
+      len > at ? data + at : "");
+  }
+
+  free(foreign);
+  free(data);
+} // check_vmsplice_shared()
+
+#endif // #ifdef LOG_HAVE_VMSPLICE
+
+
+// Main
+// ===========================================================================
+
+typedef struct {
+  const char *name;
+  void (*run)(void);
+} Check;
+
+static const Check checks[] = {
+  { "batch",        check_batch },
+  { "bloom",        check_bloom },
+  { "escape",       check_escape },
+  { "stderr-age",   check_stderr_age },
+  { "stall",        check_stall },
+#ifdef LOG_USE_RT
+  { "rt-latency",   check_rt_latency },
+  { "rt-precision", check_rt_precision },
+#endif
+#ifdef LOG_HAVE_VMSPLICE
+  { "vmsplice-shared", check_vmsplice_shared },
+#endif
+};
+
+int
+main(int argc, char **argv) {
+  int failed = 0;
+
+  for (size_t c = 0; c < sizeof(checks) / sizeof(checks[0]); c++) {
+    bool wanted = argc == 1;
+
+    for (int i = 1; i < argc; i++) {
+      wanted = wanted || strcmp(argv[i], checks[c].name) == 0;
+    }
+    if (!wanted) {
+      continue;
+    }
+
+    failure[0] = '\0';
+    checks[c].run();
+
+    if (failure[0] == '\0') {
+      printf("%-20s ok\n", checks[c].name);
+    } else {
+      printf("%-20s FAIL: %s\n", checks[c].name, failure);
+      failed++;
+    }
+  }
+
+  return failed > 0 ? 1 : 0;
+} // main()
@@ -0,0 +1,572 @@
+/**
+ * @file tools/logfollow.c
+ * @brief Follow a log file as it's written, like `tail -F`, across rotations
+ *        and with filters.
+ *
+ *     cc -O2 -std=gnu99 -DLOG_USE_SHM -Isrc tools/logfollow.c src/log.c \
+ *       -o logfollow
+ *     ./logfollow [OPTIONS] FILE
+ *     ./logfollow [OPTIONS] --shm NAME
+ *
+ * Options:
+ *
+ * -   `--level NAME` - only records at or above this level.
+ * -   `--module NAME` - only records from this named logger or those below
+ *     it (`db` takes `[db] ...` and `[db.pool] ...`, see log_get_logger()).
+ * -   `--since TIME`, `--until TIME` - only records in this range, as
+ *     `YYYY-mm-dd HH:MM:SS` (or any prefix of that, `2047-03-11 20`).
+ * -   `--from-start` - print what's already in the file first, rather than
+ *     starting at the end.
+ *
+ * Uses inotify rather than polling. The file's directory is watched too, so
+ * when the file is renamed away or deleted and a new one created in its
+ * place the new one is followed from its start. The old one is still read
+ * until it's deleted or nothing has been written to it for a few seconds
+ * (ROTATED_GRACE_MS), for writers that haven't moved over yet, and a last
+ * line left without a newline is printed then - no lines are lost across the
+ * rotation. If the file is truncated it's read again from the start.
+ *
+ * With `--shm` records are read straight from a shared memory ring (see
+ * log_shm_open()), with no file in between; needs log.c built with
+ * `LOG_USE_SHM`. Records the reader was too slow for are reported on stderr.
+ *
+ * Lines are in the file format (see log_set_fp()). Lines that aren't are
+ * passed through unless a filter is set.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/**
+ * @brief The length of "YYYY-mm-dd HH:MM:SS", which starts each line.
+ */
+#define DATE_TIME_LEN 19
+
+/**
+ * @brief Bytes read from the file at a time.
+ */
+#define READ_SIZE (64 * 1024)
+
+static struct {
+  int level;                  ///< LOG_TRACE to take everything.
+  const char *module;         ///< `NULL` for any.
+  size_t module_len;
+  const char *since;          ///< `NULL` for no limit.
+  const char *until;
+  bool any;                   ///< Is any filter set?
+} filter;
+
+
+// Filtering
+// ===========================================================================
+
+/**
+ * @brief The level called `name` (any case), or `-2` if there isn't one.
+ */
+static int
+level_by_name(const char *name) {
+  for (int level = LOG_TRACE; level <= LOG_FATAL; level++) {
+    if (strcasecmp(name, log_level_to_name(level)) == 0) {
+      return level;
+    }
+  }
+  return LOG_TRACE - 1;
+}
+
+/**
+ * @brief Does a line (without its newline) pass the filters?
+ */
+static bool
+matches(const char *line, size_t len) {
+  if (!filter.any) {
+    return true;
+  }
+
+  // "YYYY-mm-dd HH:MM:SS LEVEL file:line: message"
+  if (len < DATE_TIME_LEN + 2 || line[4] != '-' || line[10] != ' ' ||
+      line[DATE_TIME_LEN] != ' ') {
+    return false;
+  }
+
+  if (filter.since != NULL &&
+      strncmp(line, filter.since, strlen(filter.since)) < 0) {
+    return false;
+  }
+  if (filter.until != NULL &&
+      strncmp(line, filter.until, strlen(filter.until)) > 0) {
+    return false;
+  }
+
+  const char *p = line + DATE_TIME_LEN + 1;
+  const char *end = line + len;
+  char name[8];
+  size_t name_len = 0;
+
+  while (p < end && *p != ' ' && name_len < sizeof(name) - 1) {
+    name[name_len++] = *p++;
+  }
+  name[name_len] = '\0';
+
+  int level = level_by_name(name);
+  if (!log_is_level(level) || level < filter.level) {
+    return false;
+  }
+
+  if (filter.module != NULL) {
+    // The message starts after the first ": " following the level
+    const char *msg = NULL;
+
+    for (; p + 1 < end; p++) {
+      if (p[0] == ':' && p[1] == ' ') {
+        msg = p + 2;
+        break;
+      }
+    }
+
+    if (msg == NULL ||
+        (size_t)(end - msg) < filter.module_len + 2 ||
+        msg[0] != '[' ||
+        memcmp(msg + 1, filter.module, filter.module_len) != 0 ||
+        (msg[1 + filter.module_len] != ']' &&
+         msg[1 + filter.module_len] != '.')) {
+      return false;
+    }
+  }
+
+  return true;
+} // matches()
+
+/**
+ * @brief Print the lines in `data` that pass the filters.
+ */
+static void
+print_matching(const char *data, size_t len) {
+  const char *p = data;
+  const char *end = data + len;
+
+  while (p < end) {
+    const char *newline = memchr(p, '\n', (size_t)(end - p));
+    const char *next = newline ? newline + 1 : end;
+
+    if (matches(p, (size_t)((newline ? newline : end) - p))) {
+      fwrite(p, 1, (size_t)(next - p), stdout);
+    }
+    p = next;
+  }
+}
+
+
+// Following a File
+// ===========================================================================
+
+/**
+ * @brief How long a file that's been rotated away is still read after it
+ *        was last written to. Writers only move to the new file once they
+ *        notice the rotation (logrotate's `create` and a SIGHUP, say), and
+ *        until then their lines go to the old one.
+ */
+#define ROTATED_GRACE_MS 5000
+
+/**
+ * @brief A file being read.
+ */
+typedef struct {
+  int fd;                     ///< `-1` if none.
+  off_t offset;
+  int wd;                     ///< Its inotify watch, or `-1`.
+  char *pending;              ///< Read, but not yet a whole line.
+  size_t pending_len;
+  size_t pending_cap;
+  int64_t grew_ms;            ///< When it was last found to have grown.
+} Followed;
+
+static struct {
+  const char *path;
+  char *dir;
+  const char *base;
+  int inotify;
+  Followed current;           ///< The file at `path`.
+  Followed rotated;           ///< The one that was, until it's drained.
+} F;
+
+static int64_t
+now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Make room for `more` bytes after what's pending.
+ */
+static void
+pending_reserve(Followed *f, size_t more) {
+  if (f->pending_cap - f->pending_len < more) {
+    f->pending_cap = f->pending_len + more * 2;
+    f->pending = realloc(f->pending, f->pending_cap);
+    if (f->pending == NULL) {
+      perror("realloc");
+      exit(2);
+    }
+  }
+}
+
+/**
+ * @brief Read a file from its offset to its end, printing whole lines and
+ *        keeping any partial one for next time.
+ */
+static void
+follow_read(Followed *f) {
+  struct stat st;
+
+  // Truncated (copytruncate-style rotation): start again
+  if (fstat(f->fd, &st) == 0 && st.st_size < f->offset) {
+    f->offset = 0;
+    f->pending_len = 0;
+  }
+
+  for (;;) {
+    pending_reserve(f, READ_SIZE);
+
+    ssize_t n = pread(f->fd, f->pending + f->pending_len, READ_SIZE, f->offset);
+    if (n <= 0) {
+      break;
+    }
+    f->offset += n;
+    f->pending_len += (size_t)n;
+    f->grew_ms = now_ms();
+
+    // Print up to the last newline, and keep the rest
+    size_t whole = f->pending_len;
+    while (whole > 0 && f->pending[whole - 1] != '\n') {
+      whole--;
+    }
+    if (whole > 0) {
+      print_matching(f->pending, whole);
+      memmove(f->pending, f->pending + whole, f->pending_len - whole);
+      f->pending_len -= whole;
+    }
+  }
+
+  fflush(stdout);
+} // follow_read()
+
+/**
+ * @brief Read the rest of a file and stop following it. A last line with no
+ *        newline is printed as if it had one.
+ */
+static void
+follow_close(Followed *f) {
+  follow_read(f);
+
+  if (f->pending_len > 0) {
+    pending_reserve(f, 1);
+    f->pending[f->pending_len++] = '\n';
+    print_matching(f->pending, f->pending_len);
+    fflush(stdout);
+  }
+
+  close(f->fd);
+  if (f->wd >= 0) {
+    inotify_rm_watch(F.inotify, f->wd);
+  }
+  free(f->pending);
+  memset(f, 0, sizeof(*f));
+  f->fd = -1;
+  f->wd = -1;
+}
+
+/**
+ * @brief Read what's been added to the rotated file, and let it go once it's
+ *        been deleted or quiet for ROTATED_GRACE_MS.
+ */
+static void
+follow_drain_rotated(void) {
+  struct stat st;
+
+  if (F.rotated.fd < 0) {
+    return;
+  }
+
+  follow_read(&F.rotated);
+
+  if ((fstat(F.rotated.fd, &st) == 0 && st.st_nlink == 0) ||
+      now_ms() - F.rotated.grew_ms >= ROTATED_GRACE_MS) {
+    follow_close(&F.rotated);
+  }
+}
+
+/**
+ * @brief Start following whatever is at `F.path` now. The file followed
+ *        until now is kept open and drained (see follow_drain_rotated()).
+ *
+ * @return bool `false` if there's nothing there (yet).
+ */
+static bool
+follow_open(bool from_start) {
+  int fd = open(F.path, O_RDONLY);
+
+  if (fd < 0) {
+    return false;
+  }
+
+  if (F.current.fd >= 0) {
+    // Rotated twice within the grace period: the oldest is done with
+    if (F.rotated.fd >= 0) {
+      follow_close(&F.rotated);
+    }
+    F.rotated = F.current;
+    F.rotated.grew_ms = now_ms();
+  }
+
+  memset(&F.current, 0, sizeof(F.current));
+  F.current.fd = fd;
+  F.current.offset = from_start ? 0 : lseek(fd, 0, SEEK_END);
+  // IN_ATTRIB for the link count dropping to 0 once it's rotated away
+  F.current.wd = inotify_add_watch(
+    F.inotify, F.path,
+    IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+
+  return true;
+}
+
+/**
+ * @brief Has `F.path` been replaced by a different file from the one being
+ *        read?
+ */
+static bool
+follow_replaced(void) {
+  struct stat current, now;
+
+  if (F.current.fd < 0) {
+    return true;
+  }
+
+  return  stat(F.path, &now) == 0 &&
+          fstat(F.current.fd, &current) == 0 &&
+          (now.st_dev != current.st_dev || now.st_ino != current.st_ino);
+}
+
+static int
+follow_file(const char *path, bool from_start) {
+  char *dir_copy = strdup(path);
+  char *base_copy = strdup(path);
+
+  F.path = path;
+  F.dir = dirname(dir_copy);
+  F.base = basename(base_copy);
+  F.current.fd = -1;
+  F.current.wd = -1;
+  F.rotated.fd = -1;
+  F.rotated.wd = -1;
+  F.inotify = inotify_init1(IN_CLOEXEC);
+
+  if (F.inotify < 0) {
+    perror("inotify_init1");
+    return 2;
+  }
+
+  if (inotify_add_watch(
+        F.inotify, F.dir, IN_CREATE | IN_MOVED_TO) < 0) {
+    perror(F.dir);
+    return 2;
+  }
+
+  if (follow_open(from_start)) {
+    follow_read(&F.current);
+  } else {
+    fprintf(stderr, "logfollow: waiting for %s\n", path);
+  }
+
+  char events[4096]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  for (;;) {
+    struct pollfd pfd = { F.inotify, POLLIN, 0 };
+    int timeout = -1;
+    ssize_t n = 0;
+
+    // Wake up to let go of a rotated file that's gone quiet
+    if (F.rotated.fd >= 0) {
+      int64_t left = F.rotated.grew_ms + ROTATED_GRACE_MS - now_ms();
+      timeout = left > 0 ? (int)left : 0;
+    }
+
+    int ready = poll(&pfd, 1, timeout);
+
+    if (ready > 0) {
+      n = read(F.inotify, events, sizeof(events));
+    }
+    if (ready < 0 || n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror(ready < 0 ? "poll" : "read");
+      return 2;
+    }
+
+    bool rotated = false;
+
+    for (char *p = events; p < events + n; ) {
+      const struct inotify_event *event = (const struct inotify_event *)p;
+
+      if (event->wd == F.rotated.wd) {
+        // Just more to drain
+      } else if (event->wd == F.current.wd &&
+          (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF))) {
+        rotated = true;
+      } else if (event->wd != F.current.wd && event->len > 0 &&
+                 strcmp(event->name, F.base) == 0) {
+        rotated = true;
+      }
+
+      p += sizeof(struct inotify_event) + event->len;
+    }
+
+    // What went to the old files first
+    follow_drain_rotated();
+    if (F.current.fd >= 0) {
+      follow_read(&F.current);
+    }
+
+    if (rotated && follow_replaced() && follow_open(true)) {
+      follow_read(&F.current);
+    }
+  }
+} // follow_file()
+
+
+// Reading Shared Memory
+// ===========================================================================
+
+#ifdef LOG_USE_SHM
+
+static int
+follow_shm(const char *name) {
+  log_ShmReader reader;
+  uint64_t dropped = 0;
+
+  if (log_shm_reader_open(&reader, name) != 0) {
+    fprintf(stderr, "logfollow: can't open shared memory ring %s\n", name);
+    return 2;
+  }
+
+  for (;;) {
+    const char *data;
+    size_t len;
+
+    if (log_shm_reader_peek(&reader, &data, &len, 1000) == 1) {
+      print_matching(data, len);
+      log_shm_reader_release(&reader);
+
+      // Flush when caught up, rather than per record
+      if (log_shm_reader_peek(&reader, &data, &len, 0) == 1) {
+        continue;
+      }
+      fflush(stdout);
+    }
+
+    uint64_t now_dropped = log_shm_reader_dropped(&reader);
+    if (now_dropped != dropped) {
+      fprintf(
+        stderr, "logfollow: %llu records dropped\n",
+        (unsigned long long)(now_dropped - dropped));
+      dropped = now_dropped;
+    }
+  }
+} // follow_shm()
+
+#endif // #ifdef LOG_USE_SHM
+
+
+// Main
+// ===========================================================================
+
+static void
+usage(void) {
+  fprintf(
+    stderr,
+    "usage: logfollow [--level NAME] [--module NAME] [--since TIME]\n"
+    "                 [--until TIME] [--from-start] (FILE | --shm NAME)\n");
+}
+
+int
+main(int argc, char **argv) {
+  const char *shm_name = NULL;
+  const char *path = NULL;
+  bool from_start = false;
+
+  filter.level = LOG_TRACE;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+    if (strcmp(arg, "--from-start") == 0) {
+      from_start = true;
+      continue;
+    }
+
+    if (arg[0] != '-') {
+      path = arg;
+      continue;
+    }
+
+    if (value == NULL) {
+      usage();
+      return 2;
+    }
+    i++;
+
+    if (strcmp(arg, "--level") == 0) {
+      filter.level = level_by_name(value);
+      if (!log_is_level(filter.level)) {
+        fprintf(stderr, "logfollow: bad level %s\n", value);
+        return 2;
+      }
+    } else if (strcmp(arg, "--module") == 0) {
+      filter.module = value;
+      filter.module_len = strlen(value);
+    } else if (strcmp(arg, "--since") == 0) {
+      filter.since = value;
+    } else if (strcmp(arg, "--until") == 0) {
+      filter.until = value;
+    } else if (strcmp(arg, "--shm") == 0) {
+      shm_name = value;
+    } else {
+      usage();
+      return 2;
+    }
+  }
+
+  filter.any =  filter.level > LOG_TRACE || filter.module != NULL ||
+                filter.since != NULL || filter.until != NULL;
+
+  if (shm_name != NULL) {
+#ifdef LOG_USE_SHM
+    return follow_shm(shm_name);
+#else
+    fprintf(stderr, "logfollow: built without LOG_USE_SHM\n");
+    return 2;
+#endif
+  }
+
+  if (path == NULL) {
+    usage();
+    return 2;
+  }
+
+  return follow_file(path, from_start);
+} // main()
@@ -0,0 +1,229 @@
+/**
+ * @file tools/loggrep.c
+ * @brief Find the lines mentioning an ID across many log segments, skipping
+ *        what each segment's Bloom filter (see log_set_fp_indexed()) rules
+ *        out.
+ *
+ * log.c is compiled into this file, so lines can be split into tokens
+ * exactly as the filter was built:
+ *
+ *     cc -O2 -std=gnu99 -Isrc tools/loggrep.c -o loggrep
+ *     ./loggrep [-v] --id ID SEGMENT...
+ *
+ * The ID has to be a whole token, and matches whole tokens: a run of
+ * letters, digits and `_-.:@` (less any trailing `.:-`), so `abc123` matches
+ * `id=abc123` and `abc123.` but not `trace:abc123`. In segments indexed with
+ * keys only the values following the keys are matched (`trace:abc123` is
+ * matched if `trace:` is one).
+ *
+ * A filter only covers the segment as it was when it was last saved, so
+ * what's been written since is always read. Segments without a usable
+ * `<segment>.bloom` are read in full, matching every token. Matching lines
+ * are printed as `grep` would, prefixed with the segment's path when there's
+ * more than one. With `-v`, how many segments were skipped (entirely) goes
+ * to stderr.
+ *
+ * @return `0` if any line matched, `1` if none did, `2` on error.
+ */
+
+#include "../src/log.c"
+
+static void
+usage(const char *argv0) {
+  fprintf(
+    stderr,
+    "usage: %s [-v] --id ID SEGMENT...\n"
+    "\n"
+    "Prints the lines of the segments in which ID is a whole token - a run\n"
+    "of letters, digits and _-.:@ (less trailing .:-). For segments indexed\n"
+    "with keys, only the tokens right after a key count.\n",
+    argv0);
+}
+
+/**
+ * @brief What a segment's lines are matched against.
+ */
+typedef struct {
+  const char *id;
+  size_t id_len;
+  int num_keys;
+  const char (*keys)[BLOOM_KEY_SIZE];
+} Search;
+
+static bool
+token_isnt_id(const char *token, size_t len, void *udata) {
+  const Search *search = udata;
+
+  return len != search->id_len || memcmp(token, search->id, len) != 0;
+}
+
+/**
+ * @brief Print the lines of `path` from byte `from` on in which the ID is a
+ *        token. If `from` is partway through a line, that line is skipped.
+ *
+ * @return int Lines matched, or `-1` if `path` couldn't be read.
+ */
+static int
+scan(const char *path, long from, const Search *search, bool show_path) {
+  FILE *fp = fopen(path, "r");
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  int matches = 0;
+
+  if (fp == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  // Start at the first whole line past `from`
+  if (from > 0) {
+    int c;
+
+    if (fseek(fp, from - 1, SEEK_SET) != 0) {
+      fclose(fp);
+      return 0;
+    }
+    while ((c = fgetc(fp)) != EOF && c != '\n') {
+    }
+  }
+
+  while ((len = getline(&line, &size, fp)) != -1) {
+    if (!bloom_each_token(
+          line, (size_t)len, search->num_keys, search->keys, token_isnt_id,
+          (void *)search)) {
+      if (show_path) {
+        printf("%s:", path);
+      }
+      fwrite(line, 1, (size_t)len, stdout);
+      matches++;
+    }
+  }
+
+  free(line);
+  fclose(fp);
+  return matches;
+} // scan()
+
+/**
+ * @brief Look the ID up in `<segment>.bloom`.
+ *
+ * @param header  Filled in from the filter.
+ *
+ * @return int `0` if the part of the segment the filter covers doesn't
+ *             contain it, `1` if it may, `-1` if there's no usable filter.
+ */
+static int
+lookup(const char *segment, const char *id, BloomHeader *header) {
+  size_t size = strlen(segment) + sizeof(".bloom");
+  char *bloom_path = malloc(size);
+  FILE *fp;
+  int result = -1;
+
+  if (bloom_path == NULL) {
+    return -1;
+  }
+  snprintf(bloom_path, size, "%s.bloom", segment);
+  fp = fopen(bloom_path, "rb");
+  free(bloom_path);
+
+  if (fp == NULL) {
+    return -1;
+  }
+  if (bloom_read_header(fp, header)) {
+    result = bloom_lookup(fp, header, id);
+  }
+  fclose(fp);
+  return result;
+} // lookup()
+
+static long
+file_size(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  long size = -1;
+
+  if (fp != NULL) {
+    if (fseek(fp, 0, SEEK_END) == 0) {
+      size = ftell(fp);
+    }
+    fclose(fp);
+  }
+  return size;
+}
+
+int
+main(int argc, char **argv) {
+  const char *id = NULL;
+  bool verbose = false;
+  int first = 1;
+
+  while (first < argc && argv[first][0] == '-') {
+    if (strcmp(argv[first], "-v") == 0) {
+      verbose = true;
+      first++;
+    } else if (strcmp(argv[first], "--id") == 0 && first + 1 < argc) {
+      id = argv[first + 1];
+      first += 2;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  if (id == NULL || first == argc) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  size_t id_len = strlen(id);
+
+  if (id_len == 0 || bloom_token_len(id, id_len) != id_len) {
+    fprintf(stderr, "%s: \"%s\" isn't a whole token\n", argv[0], id);
+    usage(argv[0]);
+    return 2;
+  }
+
+  bool show_path = argc - first > 1;
+  int skipped = 0;
+  int matches = 0;
+  bool failed = false;
+
+  for (int i = first; i < argc; i++) {
+    BloomHeader header;
+    Search search = { id, id_len, 0, NULL };
+    long from = 0;
+    int maybe = lookup(argv[i], id, &header);
+
+    // A segment smaller than its filter says has been replaced since
+    if (maybe >= 0 && (uint64_t)file_size(argv[i]) < header.covered) {
+      maybe = -1;
+    }
+    if (maybe >= 0) {
+      search.num_keys = header.num_keys;
+      search.keys = (const char (*)[BLOOM_KEY_SIZE])header.keys;
+    }
+    if (maybe == 0) {
+      // Just what's been written since the filter was saved, if anything
+      from = (long)header.covered;
+      if (file_size(argv[i]) == from) {
+        skipped++;
+        continue;
+      }
+    }
+
+    int n = scan(argv[i], from, &search, show_path);
+    if (n < 0) {
+      failed = true;
+    } else {
+      matches += n;
+    }
+  }
+
+  if (verbose) {
+    fprintf(
+      stderr, "%s: skipped %d of %d segments\n",
+      argv[0], skipped, argc - first);
+  }
+
+  return failed ? 2 : matches > 0 ? 0 : 1;
+} // main()
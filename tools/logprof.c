@@ -0,0 +1,454 @@
+/**
+ * @file tools/logprof.c
+ * @brief Per-record cost profiler for log.c, using hardware counters.
+ *
+ * Runs representative logging workloads and reads counters through
+ * `perf_event_open()` around them: cycles, instructions, L1 data and
+ * last-level cache misses, branch misses and context switches, each divided
+ * by the number of records. As well as whole log_log() calls it times the
+ * pieces a record goes through - taking the time, formatting the message,
+ * the lock, assembling and writing the line - so a regression can be pinned
+ * on one of them. The `body*` workloads compare copying message bodies as
+ * they are with escaping them (see log_set_escape()), vectorized and not.
+ * The `stderr-*` workloads write buffered stderr output to a pipe, copied
+ * in with write() or, built with `LOG_USE_VMSPLICE`, handed over with
+ * vmsplice().
+ *
+ * log.c is compiled into this file so those internal pieces can be called
+ * directly. Build with the same flags as the code being profiled, e.g.:
+ *
+ *     cc -O2 -std=gnu99 -Isrc tools/logprof.c -lpthread -o logprof
+ *     ./logprof [records]
+ *
+ * Counters the kernel or hypervisor won't provide (or all of them, if
+ * `kernel.perf_event_paranoid` forbids it) are shown as `-`; the wall-clock
+ * time per record is always shown.
+ */
+
+#include "../src/log.c"
+
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+
+// Counters
+// ===========================================================================
+
+typedef struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} Counter;
+
+#define CACHE_MISS(cache) \
+  ( (cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) )
+
+static const Counter counters[] = {
+  { "cycles",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instrs",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "L1d-miss",     PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D) },
+  { "LLC-miss",     PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL) },
+  { "br-miss",      PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  { "ctx-sw",       PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+#define NUM_COUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+/**
+ * @brief File descriptors for `counters`, `-1` for those that couldn't be
+ *        opened.
+ */
+static int counter_fds[NUM_COUNTERS];
+
+static void
+counters_open(void) {
+  for (size_t i = 0; i < NUM_COUNTERS; i++) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counters[i].type;
+    attr.config = counters[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    counter_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+    // Context switches happen in the kernel
+    if (counter_fds[i] < 0 && attr.type == PERF_TYPE_SOFTWARE) {
+      attr.exclude_kernel = 0;
+      counter_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+  }
+}
+
+static void
+counters_start(void) {
+  for (size_t i = 0; i < NUM_COUNTERS; i++) {
+    if (counter_fds[i] >= 0) {
+      ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+static void
+counters_stop(uint64_t values[NUM_COUNTERS]) {
+  for (size_t i = 0; i < NUM_COUNTERS; i++) {
+    values[i] = 0;
+    if (counter_fds[i] >= 0) {
+      ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+      if (read(counter_fds[i], &values[i], sizeof(values[i])) !=
+          sizeof(values[i])) {
+        values[i] = 0;
+      }
+    }
+  }
+}
+
+
+// Workloads
+// ===========================================================================
+//
+// Each runs one piece of the record path `n` times. They're set up to match
+// what log_log() does, with the logger configured by main().
+//
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+lock_mutex(void *udata, int acquire) {
+  (void)udata;
+  if (acquire) {
+    pthread_mutex_lock(&mutex);
+  } else {
+    pthread_mutex_unlock(&mutex);
+  }
+}
+
+static void
+format_message(Buffer *msg, long i, ...) {
+  va_list args;
+  va_start(args, i);
+  buffer_vprintf(
+    msg, "request %ld from %s took %d us (%.2f%% of budget)", args);
+  va_end(args);
+}
+
+/**
+ * @brief Read the clock and get the rendered time (cached per second).
+ */
+static void
+run_timestamp(long n) {
+  for (long i = 0; i < n; i++) {
+    struct timespec now;
+    read_clock(&now);
+    volatile const Timestamp *ts = timestamp_for(now.tv_sec);
+    (void)ts;
+  }
+}
+
+/**
+ * @brief Render the time without the cache, as log_log() used to.
+ */
+static void
+run_timestamp_uncached(long n) {
+  for (long i = 0; i < n; i++) {
+    struct timespec now;
+    Timestamp ts;
+    read_clock(&now);
+    format_timestamp(&ts, now.tv_sec);
+  }
+}
+
+static void
+run_format(long n) {
+  char storage[LOG_MSG_BUF_SIZE];
+  Buffer msg;
+
+  for (long i = 0; i < n; i++) {
+    buffer_init(&msg, storage, sizeof(storage));
+    format_message(&msg, i, i, "10.0.0.1", (int)(i % 977), i % 100 * 0.5);
+  }
+}
+
+static void
+run_lock(long n) {
+  for (long i = 0; i < n; i++) {
+    lock();
+    unlock();
+  }
+}
+
+/**
+ * @brief Assemble a file line and write it to the file output.
+ */
+static void
+run_write(long n) {
+  char storage[LOG_MSG_BUF_SIZE + 128];
+  const char *msg =
+    "request 123456 from 10.0.0.1 took 42 us (21.00% of budget)";
+  size_t msg_len = strlen(msg);
+  Buffer out;
+  Timestamp ts;
+
+  format_timestamp(&ts, time(NULL));
+
+  for (long i = 0; i < n; i++) {
+    buffer_init(&out, storage, sizeof(storage));
+    append_file_line(&out, &ts, LOG_INFO, __FILE__, __LINE__, msg, msg_len);
+    write_file_buffer(&out);
+  }
+}
+
+/**
+ * @brief Message bodies as they come: mostly clean, the odd one with a
+ *        newline or a terminal escape.
+ */
+static const char *const bodies[] = {
+  "request 123456 from 10.0.0.1 took 42 us (21.00% of budget)",
+  "GET /api/v2/users/8d3f2a7c-1b4e-4f0a-9c61-2e5d7b9a0c13/preferences 200",
+  "connection pool db.primary: 17 active, 3 idle, 0 waiting, max 32",
+  "cache miss for key session:ab41f09e2c77 (ttl 3600s), loading from store",
+  "upstream error: connect() failed (111: Connection refused)\n"
+  "  while connecting to 10.0.3.17:8443",
+  "user input: \x1b[31mred\x1b[0m",
+  "flushed 4096 records to segment 000000000042.log in 3.2 ms",
+  "retrying request 77 after 250 ms backoff (attempt 3 of 5)",
+};
+
+#define NUM_BODIES (sizeof(bodies) / sizeof(bodies[0]))
+
+static size_t body_lens[NUM_BODIES];
+
+/**
+ * @brief Append message bodies as log_log() does, escaped with `find` or
+ *        (`NULL`) not at all.
+ */
+static void
+run_body(long n, size_t (*find)(const char *, size_t)) {
+  char storage[LOG_MSG_BUF_SIZE];
+  Buffer out;
+  
+  if (body_lens[0] == 0) {
+    for (size_t i = 0; i < NUM_BODIES; i++) {
+      body_lens[i] = strlen(bodies[i]);
+    }
+  }
+  
+  for (long i = 0; i < n; i++) {
+    size_t b = (size_t)i % NUM_BODIES;
+    
+    buffer_init(&out, storage, sizeof(storage));
+    if (find == NULL) {
+      buffer_append(&out, bodies[b], body_lens[b]);
+    } else {
+      buffer_append_escaped(&out, bodies[b], body_lens[b], find);
+    }
+    __asm__ __volatile__ ("" :: "r" (out.data) : "memory");
+  }
+}
+
+static void
+run_body_plain(long n) {
+  run_body(n, NULL);
+}
+
+/**
+ * @brief Escaping with find_escape() - SSE2/AVX2 where built for it.
+ */
+static void
+run_body_escaped(long n) {
+  run_body(n, find_escape);
+}
+
+static void
+run_body_escaped_scalar(long n) {
+  run_body(n, find_escape_scalar);
+}
+
+/**
+ * @brief Read a pipe until it's closed.
+ */
+static void *
+drain_pipe(void *arg) {
+  int fd = *(int *)arg;
+  char data[64 * 1024];
+
+  while (read(fd, data, sizeof(data)) > 0) {
+  }
+  return NULL;
+}
+
+/**
+ * @brief Buffered stderr output to a pipe that another thread is reading, as
+ *        to a supervisor: file lines handed to write_stderr_buffer(), which
+ *        flushes every LOG_STDERR_BUF_SIZE bytes. The time includes the
+ *        reader's, on a host with fewer cores than threads.
+ */
+static void
+run_stderr_pipe(long n, bool splice) {
+  char storage[LOG_MSG_BUF_SIZE + 128];
+  const char *msg =
+    "request 123456 from 10.0.0.1 took 42 us (21.00% of budget)";
+  int saved_stderr = dup(STDERR_FILENO);
+  int fds[2];
+  pthread_t reader;
+  Buffer out;
+  Timestamp ts;
+
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+  pthread_create(&reader, NULL, drain_pipe, &fds[0]);
+  fflush(stderr);
+  dup2(fds[1], STDERR_FILENO);
+  close(fds[1]);
+
+  format_timestamp(&ts, time(NULL));
+  buffer_init(&out, storage, sizeof(storage));
+  append_file_line(
+    &out, &ts, LOG_INFO, __FILE__, __LINE__, msg, strlen(msg));
+
+  log_set_stderr_flush(LOG_FLUSH_BUFFERED);
+  lock();
+  stderr_resolve();
+#ifdef LOG_HAVE_VMSPLICE
+  if (!splice && L.err.splice) {
+    splice_stop();
+  }
+#else
+  (void)splice;
+#endif
+  for (long i = 0; i < n; i++) {
+    write_stderr_buffer(&out, LOG_INFO);
+  }
+  stderr_flush();
+  unlock();
+  log_set_stderr_flush(LOG_FLUSH_AUTO);
+
+  dup2(saved_stderr, STDERR_FILENO);
+  close(saved_stderr);
+  pthread_join(reader, NULL);
+  close(fds[0]);
+} // run_stderr_pipe()
+
+static void
+run_stderr_write(long n) {
+  run_stderr_pipe(n, false);
+}
+
+#ifdef LOG_HAVE_VMSPLICE
+/**
+ * @brief As `stderr-write`, with the pages handed over by vmsplice().
+ */
+static void
+run_stderr_vmsplice(long n) {
+  run_stderr_pipe(n, true);
+}
+#endif
+
+static void
+run_log_filtered(long n) {
+  for (long i = 0; i < n; i++) {
+    log_debug("request %ld from %s took %d us", i, "10.0.0.1", 42);
+  }
+}
+
+static void
+run_log(long n) {
+  for (long i = 0; i < n; i++) {
+    log_info(
+      "request %ld from %s took %d us (%.2f%% of budget)",
+      i, "10.0.0.1", (int)(i % 977), i % 100 * 0.5);
+  }
+}
+
+typedef struct {
+  const char *name;
+  void (*run)(long n);
+} Workload;
+
+static const Workload workloads[] = {
+  { "timestamp",          run_timestamp },
+  { "timestamp-uncached", run_timestamp_uncached },
+  { "format",             run_format },
+  { "lock",               run_lock },
+  { "write",              run_write },
+  { "body",               run_body_plain },
+  { "body-escaped",       run_body_escaped },
+  { "body-escaped-scalar", run_body_escaped_scalar },
+  { "stderr-write",       run_stderr_write },
+#ifdef LOG_HAVE_VMSPLICE
+  { "stderr-vmsplice",    run_stderr_vmsplice },
+#endif
+  { "log_log-filtered",   run_log_filtered },
+  { "log_log",            run_log },
+};
+
+
+// Main
+// ===========================================================================
+
+static double
+elapsed_ns(const struct timespec *start, const struct timespec *end) {
+  return  (double)(end->tv_sec - start->tv_sec) * 1e9 +
+          (double)(end->tv_nsec - start->tv_nsec);
+}
+
+int
+main(int argc, char **argv) {
+  long n = argc > 1 ? atol(argv[1]) : 1000000;
+  FILE *fp = fopen("/dev/null", "w");
+
+  if (n <= 0 || fp == NULL) {
+    fprintf(stderr, "usage: %s [records]\n", argv[0]);
+    return 1;
+  }
+
+  // A file output and a real lock, like a typical service
+  log_set_quiet(true);
+  log_set_fp(fp);
+  log_set_level(LOG_INFO);
+  log_set_lock(lock_mutex);
+
+  counters_open();
+
+  printf("%-20s %9s", "per record", "ns");
+  for (size_t i = 0; i < NUM_COUNTERS; i++) {
+    printf(" %9s", counters[i].name);
+  }
+  printf("\n");
+
+  for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+    uint64_t values[NUM_COUNTERS];
+    struct timespec start, end;
+
+    // Warm up caches and the branch predictor
+    workloads[w].run(n / 10 + 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    counters_start();
+    workloads[w].run(n);
+    counters_stop(values);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%-20s %9.1f", workloads[w].name, elapsed_ns(&start, &end) / n);
+    for (size_t i = 0; i < NUM_COUNTERS; i++) {
+      if (counter_fds[i] < 0) {
+        printf(" %9s", "-");
+      } else {
+        printf(" %9.2f", (double)values[i] / n);
+      }
+    }
+    printf("\n");
+  }
+
+  fclose(fp);
+  return 0;
+} // main()
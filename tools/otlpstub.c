@@ -0,0 +1,951 @@
+/**
+ * @file tools/otlpstub.c
+ * @brief A stand-in OpenTelemetry collector, and checks for the OTLP exporter
+ *        (see log_otlp_open()) run against it.
+ *
+ * log.c is compiled into this file so the checks can get at the exporter's
+ * state. Build with `LOG_USE_OTLP`, and `LOG_USE_ZLIB` to check gzip too:
+ *
+ *     cc -O2 -std=gnu99 -DLOG_USE_OTLP -DLOG_USE_ZLIB -Isrc \
+ *       tools/otlpstub.c -lpthread -lz -o otlpstub
+ *     ./otlpstub serve PORT
+ *     ./otlpstub check [CHECK...]
+ *
+ * `serve` listens on 127.0.0.1:PORT and prints each record POST-ed to
+ * `/v1/logs` as `LEVEL file:line: message`, for trying out a program's
+ * export by hand.
+ *
+ * `check` runs the named checks, or all of them, each against a stub on an
+ * ephemeral port, printing `ok` or `FAIL` and why for each. The stub can be
+ * told to answer with errors, or be taken down and brought back, to exercise
+ * retries.
+ *
+ * The stub understands just what the exporter sends: one request per
+ * connection, protobuf `ExportLogsServiceRequest` bodies, gzipped or not.
+ *
+ * @return `0` if every check passed (or the server was stopped), `1`
+ *         otherwise.
+ */
+
+#include "../src/log.c"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdarg.h>
+
+#ifndef LOG_USE_OTLP
+#error "build with -DLOG_USE_OTLP"
+#endif
+
+
+// The Stub Collector
+// ===========================================================================
+
+/**
+ * @brief A record as received.
+ */
+typedef struct {
+  int severity;
+  char file[128];
+  int line;
+  char msg[256];
+} StubRecord;
+
+static struct {
+  pthread_mutex_t mutex;
+  pthread_t thread;
+  int listen_fd;              ///< `-1` while down.
+  int port;
+  bool print;                 ///< Print records as they come (`serve`).
+  int fail_next;              ///< Answer this many more requests with 503.
+  unsigned requests;          ///< Requests answered 2xx.
+  unsigned gzipped;           ///< ...of which were gzipped.
+  unsigned refused;           ///< Requests answered with an error.
+  StubRecord *records;
+  size_t num_records;
+  size_t cap_records;
+} S = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static bool
+pb_get_varint(const unsigned char **p, const unsigned char *end,
+              uint64_t *value) {
+  int shift = 0;
+
+  *value = 0;
+  while (*p < end && shift < 64) {
+    unsigned char byte = *(*p)++;
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+    shift += 7;
+  }
+  return false;
+}
+
+/**
+ * @brief Read the next field's tag and, for a length-delimited one, its
+ *        extent; other wire types are skipped over.
+ *
+ * @return int The field number, `0` for a field that was skipped, or `-1`
+ *             if the message is malformed.
+ */
+static int
+pb_next(const unsigned char **p, const unsigned char *end,
+        const unsigned char **data, size_t *len, uint64_t *value) {
+  uint64_t tag;
+
+  if (!pb_get_varint(p, end, &tag)) {
+    return -1;
+  }
+
+  switch (tag & 7) {
+    case 0:
+      return pb_get_varint(p, end, value) ? (int)(tag >> 3) : -1;
+    case 1:
+      if (end - *p < 8) {
+        return -1;
+      }
+      *p += 8;
+      return 0;
+    case 2: {
+      uint64_t n;
+      if (!pb_get_varint(p, end, &n) || n > (uint64_t)(end - *p)) {
+        return -1;
+      }
+      *data = *p;
+      *len = (size_t)n;
+      *p += n;
+      return (int)(tag >> 3);
+    }
+    default:
+      return -1;
+  }
+} // pb_next()
+
+static void
+copy_field(char *dest, size_t size, const unsigned char *data, size_t len) {
+  if (len > size - 1) {
+    len = size - 1;
+  }
+  memcpy(dest, data, len);
+  dest[len] = '\0';
+}
+
+/**
+ * @brief Decode a `KeyValue` attribute into the record, if it's one the
+ *        exporter sends.
+ */
+static bool
+stub_attribute(StubRecord *record, const unsigned char *p,
+               const unsigned char *end) {
+  const unsigned char *data = NULL, *key = NULL, *value = NULL;
+  size_t len = 0, key_len = 0, value_len = 0;
+  uint64_t number;
+  int field;
+
+  while (p < end) {
+    if ((field = pb_next(&p, end, &data, &len, &number)) < 0) {
+      return false;
+    }
+    if (field == 1) {
+      key = data;
+      key_len = len;
+    } else if (field == 2) {
+      value = data;
+      value_len = len;
+    }
+  }
+
+  if (key == NULL || value == NULL) {
+    return true;
+  }
+
+  // AnyValue { string_value = 1, int_value = 3 }
+  const unsigned char *vp = value, *vend = value + value_len;
+  while (vp < vend) {
+    if ((field = pb_next(&vp, vend, &data, &len, &number)) < 0) {
+      return false;
+    }
+    if (field == 1 && key_len == 13 &&
+        memcmp(key, "code.filepath", 13) == 0) {
+      copy_field(record->file, sizeof(record->file), data, len);
+    } else if (field == 3 && key_len == 11 &&
+               memcmp(key, "code.lineno", 11) == 0) {
+      record->line = (int)number;
+    }
+  }
+  return true;
+} // stub_attribute()
+
+/**
+ * @brief Decode a `LogRecord` and add it to the received records.
+ */
+static bool
+stub_record(const unsigned char *p, const unsigned char *end) {
+  StubRecord record;
+  const unsigned char *data = NULL;
+  size_t len = 0;
+  uint64_t number = 0;
+  int field;
+
+  memset(&record, 0, sizeof(record));
+
+  while (p < end) {
+    if ((field = pb_next(&p, end, &data, &len, &number)) < 0) {
+      return false;
+    }
+    if (field == 2) {
+      record.severity = (int)number;
+    } else if (field == 5) {
+      // AnyValue { string_value = 1 }
+      const unsigned char *bp = data, *bend = data + len;
+      const unsigned char *body = NULL;
+      size_t body_len = 0;
+      while (bp < bend) {
+        if (pb_next(&bp, bend, &body, &body_len, &number) < 0) {
+          return false;
+        }
+      }
+      if (body != NULL) {
+        copy_field(record.msg, sizeof(record.msg), body, body_len);
+      }
+    } else if (field == 6 && !stub_attribute(&record, data, data + len)) {
+      return false;
+    }
+  }
+
+  if (S.print) {
+    int level = LOG_TRACE + (record.severity - 1) / 4;
+    printf(
+      "%-5s %s:%d: %s\n",
+      log_is_level(level) ? log_level_to_name(level) : "?",
+      record.file, record.line, record.msg);
+    fflush(stdout);
+    return true;
+  }
+
+  if (S.num_records == S.cap_records) {
+    size_t cap = S.cap_records ? S.cap_records * 2 : 1024;
+    StubRecord *records = realloc(S.records, cap * sizeof(StubRecord));
+    if (records == NULL) {
+      return false;
+    }
+    S.records = records;
+    S.cap_records = cap;
+  }
+  S.records[S.num_records++] = record;
+  return true;
+} // stub_record()
+
+/**
+ * @brief Decode a message, descending through the fields in `path` (each
+ *        one a length-delimited field number) down to the `LogRecord`s.
+ */
+static bool
+stub_decode(const unsigned char *p, const unsigned char *end,
+            const int *path) {
+  const unsigned char *data = NULL;
+  size_t len = 0;
+  uint64_t number;
+  int field;
+
+  while (p < end) {
+    if ((field = pb_next(&p, end, &data, &len, &number)) < 0) {
+      return false;
+    }
+    if (field != path[0] || data == NULL) {
+      continue;
+    }
+    bool ok = path[1] == 0
+      ? stub_record(data, data + len)
+      : stub_decode(data, data + len, path + 1);
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief gunzip `len` bytes at `data` into `out`.
+ */
+static bool
+stub_gunzip(Buffer *out, const char *data, size_t len) {
+#ifdef LOG_USE_ZLIB
+  z_stream z;
+  int status;
+
+  memset(&z, 0, sizeof(z));
+  if (inflateInit2(&z, 15 + 16) != Z_OK) {
+    return false;
+  }
+
+  z.next_in = (Bytef *)data;
+  z.avail_in = (uInt)len;
+  out->len = 0;
+
+  do {
+    if (!buffer_reserve(out, 64 * 1024)) {
+      inflateEnd(&z);
+      return false;
+    }
+    z.next_out = (Bytef *)out->data + out->len;
+    z.avail_out = (uInt)(out->cap - out->len);
+    status = inflate(&z, Z_NO_FLUSH);
+    out->len = out->cap - z.avail_out;
+  } while (status == Z_OK);
+
+  inflateEnd(&z);
+  return status == Z_STREAM_END;
+#else
+  (void)out;
+  (void)data;
+  (void)len;
+  return false;
+#endif
+} // stub_gunzip()
+
+/**
+ * @brief Read one request off `fd`, take in its records and answer it.
+ */
+static void
+stub_handle(int fd) {
+  static const int path[] = { 1, 2, 2, 0 };
+  Buffer request, body;
+  size_t header_len = 0;      ///< Including the blank line, once known.
+  size_t content_length = 0;
+  int status = 400;
+
+  buffer_init(&request, NULL, 0);
+  buffer_init(&body, NULL, 0);
+
+  // Headers, then the body
+  for (;;) {
+    if (!buffer_reserve(&request, 64 * 1024)) {
+      break;
+    }
+    ssize_t got = recv(fd, request.data + request.len, 64 * 1024, 0);
+    if (got <= 0) {
+      break;
+    }
+    request.len += (size_t)got;
+
+    if (header_len == 0) {
+      buffer_append(&request, "", 1);
+      request.len--;
+      const char *header_end = strstr(request.data, "\r\n\r\n");
+      if (header_end != NULL) {
+        const char *length = strstr(request.data, "Content-Length: ");
+        if (length != NULL && length < header_end) {
+          content_length = strtoul(length + 16, NULL, 10);
+        }
+        header_len = (size_t)(header_end + 4 - request.data);
+      }
+    }
+    if (header_len > 0 && request.len >= header_len + content_length) {
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&S.mutex);
+
+  if (header_len > 0 && request.len >= header_len + content_length &&
+      strncmp(request.data, "POST /v1/logs ", 14) == 0) {
+    const char *data = request.data + header_len;
+    size_t len = content_length;
+    const char *encoding = strstr(request.data, "Content-Encoding: gzip");
+    bool gzipped = encoding != NULL && encoding < data;
+    size_t num_records = S.num_records;
+
+    if (S.fail_next > 0) {
+      S.fail_next--;
+      status = 503;
+    } else if (gzipped && !stub_gunzip(&body, data, len)) {
+      status = 415;
+    } else {
+      if (gzipped) {
+        data = body.data;
+        len = body.len;
+      }
+      status = stub_decode(
+        (const unsigned char *)data, (const unsigned char *)data + len,
+        path) ? 200 : 400;
+    }
+
+    // All of a request's records or none
+    if (status != 200) {
+      S.num_records = num_records;
+    }
+
+    if (status == 200) {
+      S.requests++;
+      S.gzipped += gzipped;
+    } else {
+      S.refused++;
+    }
+  }
+
+  pthread_mutex_unlock(&S.mutex);
+
+  char response[128];
+  int response_len = snprintf(
+    response, sizeof(response),
+    "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+    status, status == 200 ? "OK" : "Error");
+  send(fd, response, (size_t)response_len, MSG_NOSIGNAL);
+
+  buffer_free(&request);
+  buffer_free(&body);
+} // stub_handle()
+
+static void *
+stub_serve(void *arg) {
+  int listen_fd = (int)(intptr_t)arg;
+
+  for (;;) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      // Shut down by stub_down()
+      return NULL;
+    }
+    stub_handle(fd);
+    close(fd);
+  }
+}
+
+/**
+ * @brief Start listening on 127.0.0.1:`port` (`0` for any free port, which
+ *        is then kept in `S.port`).
+ */
+static bool
+stub_up(int port) {
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  int on = 1;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (fd < 0) {
+    return false;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((uint16_t)port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 64) != 0 ||
+      getsockname(fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+    close(fd);
+    return false;
+  }
+
+  S.port = ntohs(addr.sin_port);
+  S.listen_fd = fd;
+  return pthread_create(
+    &S.thread, NULL, stub_serve, (void *)(intptr_t)fd) == 0;
+} // stub_up()
+
+/**
+ * @brief Stop listening, so connections are refused.
+ */
+static void
+stub_down(void) {
+  if (S.listen_fd >= 0) {
+    shutdown(S.listen_fd, SHUT_RDWR);
+    pthread_join(S.thread, NULL);
+    close(S.listen_fd);
+    S.listen_fd = -1;
+  }
+}
+
+/**
+ * @brief Forget everything received, and any errors still to answer with.
+ */
+static void
+stub_reset(void) {
+  pthread_mutex_lock(&S.mutex);
+  S.fail_next = 0;
+  S.requests = 0;
+  S.gzipped = 0;
+  S.refused = 0;
+  S.num_records = 0;
+  pthread_mutex_unlock(&S.mutex);
+}
+
+
+// Checks
+// ===========================================================================
+
+/**
+ * @brief Why the current check failed, or empty if it hasn't. Only the first
+ *        failure is kept.
+ */
+static char failure[256];
+
+static void
+fail(const char *fmt, ...) {
+  va_list args;
+
+  if (failure[0] != '\0') {
+    return;
+  }
+  va_start(args, fmt);
+  vsnprintf(failure, sizeof(failure), fmt, args);
+  va_end(args);
+}
+
+/**
+ * @brief log_otlp_dropped() when the check started - it counts for the
+ *        whole process.
+ */
+static unsigned long dropped_before;
+
+/**
+ * @brief Records dropped since the check started.
+ */
+static unsigned long
+dropped(void) {
+  return log_otlp_dropped() - dropped_before;
+}
+
+/**
+ * @brief Point the exporter at the stub.
+ */
+static void
+open_exporter(void) {
+  char port[16];
+
+  snprintf(port, sizeof(port), "%d", S.port);
+  log_set_quiet(true);
+  log_set_level(LOG_TRACE);
+  if (log_otlp_open("127.0.0.1", port) != 0) {
+    fail("log_otlp_open() failed");
+  }
+}
+
+/**
+ * @brief Don't wait out the backoff after a failed send - it's the retry
+ *        that's being checked, not the timing.
+ */
+static void
+skip_backoff(void) {
+  lock();
+  L.otlp.retry_at_ms = 0;
+  unlock();
+}
+
+/**
+ * @brief Flush until nothing is pending, skipping backoffs.
+ *
+ * @return bool `false` if it didn't get there in `attempts` flushes.
+ */
+static bool
+flush_all(int attempts) {
+  for (int i = 0; i < attempts; i++) {
+    skip_backoff();
+    if (log_otlp_flush() == 0 &&
+        (L.otlp.spool_dir == NULL || !spool_has_records())) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Check the stub got records `first` to `first + count - 1` from
+ *        log_records(), in order, each once, starting at received record
+ *        `at`.
+ */
+static void
+expect_records(size_t at, int first, int count) {
+  pthread_mutex_lock(&S.mutex);
+
+  if (S.num_records != at + (size_t)count) {
+    fail(
+      "collector got %zu records, expected %zu",
+      S.num_records, at + (size_t)count);
+  }
+
+  for (int i = 0; i < count && at + (size_t)i < S.num_records; i++) {
+    const StubRecord *record = &S.records[at + (size_t)i];
+    char msg[64];
+    int level = LOG_TRACE + (first + i) % 6;
+
+    snprintf(msg, sizeof(msg), "record %d", first + i);
+    if (strcmp(record->msg, msg) != 0) {
+      fail("record %zu is \"%s\", expected \"%s\"", at + i, record->msg, msg);
+      break;
+    }
+    if (record->severity != otlp_severity(level) ||
+        strcmp(record->file, "check.c") != 0 ||
+        record->line != first + i) {
+      fail(
+        "record %zu has severity %d at %s:%d", at + i,
+        record->severity, record->file, record->line);
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&S.mutex);
+} // expect_records()
+
+/**
+ * @brief Log records `first` to `first + count - 1`, at every level in turn.
+ */
+static void
+log_records(int first, int count) {
+  for (int i = first; i < first + count; i++) {
+    log_log(LOG_TRACE + i % 6, "check.c", i, "record %d", i);
+  }
+}
+
+/**
+ * @brief Records arrive whole and in order, in batches, gzipped with
+ *        LOG_USE_ZLIB.
+ */
+static void
+check_export(void) {
+  open_exporter();
+
+  log_records(0, 5000);
+  if (!flush_all(1)) {
+    fail("records still pending after a flush");
+  }
+  expect_records(0, 0, 5000);
+
+  if (S.requests < 2) {
+    fail("5000 records sent in %u request(s), not batched", S.requests);
+  }
+#ifdef LOG_USE_ZLIB
+  if (S.gzipped != S.requests) {
+    fail("%u of %u requests gzipped", S.gzipped, S.requests);
+  }
+#else
+  if (S.gzipped != 0) {
+    fail("requests gzipped without LOG_USE_ZLIB");
+  }
+#endif
+
+  log_otlp_close();
+}
+
+/**
+ * @brief Retryable errors (503) and an unreachable collector keep records
+ *        to send later; nothing is lost or sent twice.
+ */
+static void
+check_retry(void) {
+  open_exporter();
+
+  pthread_mutex_lock(&S.mutex);
+  S.fail_next = 3;
+  pthread_mutex_unlock(&S.mutex);
+
+  log_records(0, 100);
+  if (log_otlp_flush() == 0) {
+    fail("records not kept after a 503");
+  }
+  if (!flush_all(5)) {
+    fail("records still pending after the collector recovered");
+  }
+  expect_records(0, 0, 100);
+
+  stub_down();
+  log_records(100, 100);
+  if (log_otlp_flush() == 0) {
+    fail("records not kept while the collector was down");
+  }
+  stub_up(S.port);
+  if (!flush_all(5)) {
+    fail("records still pending after the collector came back");
+  }
+  expect_records(0, 0, 200);
+
+  if (dropped() != 0) {
+    fail("%lu records dropped", dropped());
+  }
+
+  log_otlp_close();
+} // check_retry()
+
+/**
+ * @brief While the collector is down, memory held for it stays under
+ *        LOG_OTLP_MAX_PENDING, dropping the oldest records.
+ */
+static void
+check_bounded(void) {
+  open_exporter();
+  stub_down();
+
+  int count = 0;
+  while (dropped() == 0 && count < 1000000) {
+    log_records(count, 1000);
+    count += 1000;
+    if (L.otlp.pending.len > LOG_OTLP_MAX_PENDING) {
+      fail("%zu bytes pending", L.otlp.pending.len);
+      break;
+    }
+  }
+  if (dropped() == 0) {
+    fail("nothing dropped after %d records", count);
+  }
+
+  // What's left is the newest, and arrives once the collector's back
+  size_t pending = log_otlp_flush();
+  unsigned long bounded_dropped = dropped();
+
+  stub_up(S.port);
+  if (!flush_all(5)) {
+    fail("records still pending after the collector came back");
+  }
+  if (pending + bounded_dropped != (size_t)count) {
+    fail(
+      "%zu pending + %lu dropped of %d records", pending, bounded_dropped,
+      count);
+  }
+  expect_records(0, count - (int)pending, (int)pending);
+
+  log_otlp_close();
+} // check_bounded()
+
+/**
+ * @brief Make an empty directory to spool into, and point the exporter at it.
+ */
+static bool
+open_spool(char *dir, size_t max_bytes) {
+  strcpy(dir, "/tmp/otlpstub-XXXXXX");
+  if (mkdtemp(dir) == NULL) {
+    fail("can't make a spool directory");
+    return false;
+  }
+  if (log_otlp_set_spool(dir, max_bytes) != 0) {
+    fail("log_otlp_set_spool() failed");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Count the segment files in `dir`, deleting them and the directory
+ *        if `remove` is set.
+ */
+static int
+spool_files(const char *dir, bool remove) {
+  char path[1024];
+  struct dirent *entry;
+  int count = 0;
+  DIR *d = opendir(dir);
+
+  if (d == NULL) {
+    return 0;
+  }
+  while ((entry = readdir(d)) != NULL) {
+    if (strstr(entry->d_name, ".spool") != NULL) {
+      count++;
+      if (remove) {
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        unlink(path);
+      }
+    }
+  }
+  closedir(d);
+  if (remove) {
+    rmdir(dir);
+  }
+  return count;
+}
+
+/**
+ * @brief While the collector is down, batches go to disk instead of
+ *        memory. Once it's back they're replayed in order, ahead of newer
+ *        records and a few batches per send, and the segments are deleted.
+ */
+static void
+check_spool(void) {
+  char dir[64];
+
+  open_exporter();
+  if (!open_spool(dir, 64 * 1024 * 1024)) {
+    return;
+  }
+  stub_down();
+
+  // Several batches' worth, more than one segment
+  log_records(0, 40000);
+  if (L.otlp.pending.len > 2 * LOG_OTLP_BATCH_SIZE) {
+    fail("%zu bytes pending in memory with a spool", L.otlp.pending.len);
+  }
+  if (spool_files(dir, false) < 2) {
+    fail("%d spool segment(s) written", spool_files(dir, false));
+  }
+
+  stub_up(S.port);
+  skip_backoff();
+  log_otlp_flush();
+  if (S.requests > LOG_OTLP_SPOOL_REPLAY_FRAMES) {
+    fail(
+      "%u batches replayed in one send, more than %d", S.requests,
+      LOG_OTLP_SPOOL_REPLAY_FRAMES);
+  }
+
+  // Newer records wait their turn behind the spool
+  log_records(40000, 100);
+  if (!flush_all(100)) {
+    fail("spool not replayed after the collector came back");
+  }
+  expect_records(0, 0, 40100);
+
+  if (dropped() != 0) {
+    fail("%lu records dropped", dropped());
+  }
+  if (spool_files(dir, false) > 1) {
+    fail("%d spool segments left after replay", spool_files(dir, false));
+  }
+
+  log_otlp_close();
+  spool_files(dir, true);
+} // check_spool()
+
+/**
+ * @brief Segments left by an earlier run are replayed by the next one, and
+ *        a full spool drops its oldest segments.
+ */
+static void
+check_spool_restart(void) {
+  char dir[64];
+
+  open_exporter();
+  if (!open_spool(dir, 64 * 1024 * 1024)) {
+    return;
+  }
+  stub_down();
+  log_records(0, 20000);
+  log_otlp_close();
+
+  if (dropped() != 0) {
+    fail("%lu records dropped at close", dropped());
+  }
+
+  // The next run
+  stub_up(S.port);
+  open_exporter();
+  if (log_otlp_set_spool(dir, 64 * 1024 * 1024) != 0) {
+    fail("log_otlp_set_spool() failed");
+  }
+  if (!flush_all(100)) {
+    fail("earlier run's spool not replayed");
+  }
+  expect_records(0, 0, 20000);
+  log_otlp_close();
+
+  // A spool too small for everything keeps the newest
+  stub_reset();
+  open_exporter();
+  if (log_otlp_set_spool(dir, 3 * LOG_OTLP_SPOOL_SEGMENT_SIZE / 2) != 0) {
+    fail("log_otlp_set_spool() failed");
+  }
+  stub_down();
+  log_records(0, 60000);
+  log_otlp_flush();
+
+  unsigned long spool_dropped = dropped();
+  if (spool_dropped == 0) {
+    fail("nothing dropped from a full spool");
+  }
+
+  stub_up(S.port);
+  if (!flush_all(100)) {
+    fail("spool not replayed after the collector came back");
+  }
+  expect_records(0, (int)spool_dropped, 60000 - (int)spool_dropped);
+
+  log_otlp_close();
+  spool_files(dir, true);
+} // check_spool_restart()
+
+typedef struct {
+  const char *name;
+  void (*run)(void);
+} Check;
+
+static const Check checks[] = {
+  { "export",   check_export },
+  { "retry",    check_retry },
+  { "bounded",  check_bounded },
+  { "spool",    check_spool },
+  { "spool-restart", check_spool_restart },
+};
+
+static int
+run_checks(int argc, char **argv) {
+  int failed = 0;
+
+  for (size_t c = 0; c < sizeof(checks) / sizeof(checks[0]); c++) {
+    bool wanted = argc == 0;
+
+    for (int i = 0; i < argc; i++) {
+      wanted = wanted || strcmp(argv[i], checks[c].name) == 0;
+    }
+    if (!wanted) {
+      continue;
+    }
+
+    failure[0] = '\0';
+    dropped_before = log_otlp_dropped();
+    stub_reset();
+    if (!stub_up(0)) {
+      fail("can't listen on 127.0.0.1");
+    } else {
+      checks[c].run();
+    }
+    stub_down();
+
+    if (failure[0] == '\0') {
+      printf("%-20s ok\n", checks[c].name);
+    } else {
+      printf("%-20s FAIL: %s\n", checks[c].name, failure);
+      failed++;
+    }
+  }
+
+  return failed > 0 ? 1 : 0;
+} // run_checks()
+
+
+// Main
+// ===========================================================================
+
+static void
+usage(void) {
+  fprintf(
+    stderr,
+    "usage: otlpstub serve PORT\n"
+    "       otlpstub check [CHECK...]\n");
+}
+
+int
+main(int argc, char **argv) {
+  S.listen_fd = -1;
+
+  if (argc >= 2 && strcmp(argv[1], "check") == 0) {
+    return run_checks(argc - 2, argv + 2);
+  }
+
+  if (argc == 3 && strcmp(argv[1], "serve") == 0) {
+    S.print = true;
+    if (!stub_up(atoi(argv[2]))) {
+      perror("otlpstub");
+      return 1;
+    }
+    fprintf(stderr, "otlpstub: listening on 127.0.0.1:%d\n", S.port);
+    pthread_join(S.thread, NULL);
+    return 0;
+  }
+
+  usage();
+  return 1;
+} // main()